@@ -0,0 +1,101 @@
+from __future__ import print_function
+
+from iocs import mapped_lib
+from metrics import escape
+
+
+# (library file name regular expression, symbol, enter handler): the
+# allocator of the C library and the EPICS free lists of libCom
+ALLOC_PROBES = [
+    (r"^libc[.-]", "malloc", "enter_malloc"),
+    (r"^libc[.-]", "calloc", "enter_calloc"),
+    (r"^libc[.-]", "realloc", "enter_realloc"),
+    (r"^libc[.-]", "free", "enter_free"),
+    (r"^libCom\.so", "freeListMalloc", "enter_freelist_malloc"),
+    (r"^libCom\.so", "freeListCalloc", "enter_freelist_malloc"),
+    (r"^libCom\.so", "freeListFree", "enter_freelist_free"),
+]
+
+
+class AllocProbes(object):
+    """Allocator probes of the traced IOCs, attached to each IOC process
+    only (every process of the host calls malloc) and counted by the kernel
+    only while the thread is in dbProcess."""
+
+    def __init__(self, bpf, iocs, top=20):
+        self.bpf = bpf
+        self.iocs = iocs
+        self.top = top
+        self.attached = {}  # tgid -> [(path, symbol)]
+
+    def _attach(self, tgid):
+        probes = []
+        for pattern, sym, fn in ALLOC_PROBES:
+            try:
+                path = mapped_lib(tgid, pattern)
+                if path is None:
+                    continue
+                self.bpf.attach_uprobe(name=path, sym=sym, fn_name=fn, pid=tgid)
+                self.bpf.attach_uretprobe(name=path, sym=sym, fn_name="exit_alloc", pid=tgid)
+                probes.append((path, sym))
+            except Exception:
+                print(f"{sym} not found for {tgid}: not counted")
+        return probes
+
+    def _detach(self, tgid, probes):
+        for path, sym in probes:
+            try:
+                self.bpf.detach_uprobe(name=path, sym=sym, pid=tgid)
+                self.bpf.detach_uretprobe(name=path, sym=sym, pid=tgid)
+            except Exception:
+                pass
+
+    def sync(self):
+        """Attach to the IOCs started and detach from the exited ones."""
+        for tgid in [t for t in self.iocs.iocs if t not in self.attached]:
+            self.attached[tgid] = self._attach(tgid)
+        for tgid in [t for t in self.attached if t not in self.iocs.iocs]:
+            self._detach(tgid, self.attached.pop(tgid))
+
+    def rows(self):
+        """[(tgid, record name, alloc_record)] by time in the allocator."""
+        rows = [
+            (key.tgid, rec.name.decode("utf-8", "replace"), rec)
+            for key, rec in self.bpf["alloc_records"].items()
+        ]
+        rows.sort(key=lambda r: r[2].ns, reverse=True)
+        return rows
+
+    def report(self):
+        """Print the records spending the most time in the allocator."""
+        print(
+            f"{'PID':>7} {'PV':<40} {'ALLOCS':>9} {'BYTES':>11} {'FREES':>9} "
+            f"{'POOL':>9} {'ALLOC_US':>10} {'AVG_NS':>7}"
+        )
+        for tgid, name, rec in self.rows()[: self.top]:
+            n = rec.calls + rec.frees + rec.pool
+            print(
+                f"{tgid:>7} {name:<40} {rec.calls:>9} {rec.bytes:>11} {rec.frees:>9} "
+                f"{rec.pool:>9} {rec.ns / 1e3:>10.0f} {rec.ns / n if n else 0:>7.0f}"
+            )
+
+    def gauges(self, metrics):
+        def rows(field, scale=1):
+            def fn():
+                out = []
+                for tgid, name, rec in self.rows()[: self.top]:
+                    ioc = self.iocs.iocs.get(tgid)
+                    labels = f'ioc="{escape(ioc.name if ioc else str(tgid))}",pv="{escape(name)}"'
+                    value = getattr(rec, field)
+                    out.append((labels, value / scale if scale != 1 else value))
+                return out
+
+            return fn
+
+        metrics.gauge("epics_alloc_calls_total", "malloc/calloc/realloc calls.", rows("calls"))
+        metrics.gauge("epics_alloc_bytes_total", "Bytes requested.", rows("bytes"))
+        metrics.gauge("epics_alloc_frees_total", "free calls.", rows("frees"))
+        metrics.gauge("epics_alloc_pool_total", "freeList calls.", rows("pool"))
+        metrics.gauge(
+            "epics_alloc_seconds_total", "Time in the allocator.", rows("ns", 1e9)
+        )
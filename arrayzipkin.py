@@ -0,0 +1,169 @@
+from __future__ import print_function
+import ctypes as ct
+import hashlib
+import struct
+import time
+
+
+from opentelemetry.sdk.resources import SERVICE_NAME, Resource
+
+
+from spanids import scope, start_span
+
+BOOT_TIME_NS = int((time.time() - time.monotonic()) * 1e9)
+
+MAX_STRING_SIZE = 40  # epicsStructure.h
+DBF_STRING = 0
+DBF_NOACCESS = 17
+
+ARRAY_SOURCE = {1: "process", 2: "put", 3: "caput"}
+
+# struct format of DBF_CHAR..DBF_ENUM (same order as menuFtype)
+DBF_FORMAT = {
+    1: "b",
+    2: "B",
+    3: "h",
+    4: "H",
+    5: "i",
+    6: "I",
+    7: "q",
+    8: "Q",
+    9: "f",
+    10: "d",
+    11: "H",
+}
+DBF_NAME = [
+    "STRING",
+    "CHAR",
+    "UCHAR",
+    "SHORT",
+    "USHORT",
+    "LONG",
+    "ULONG",
+    "INT64",
+    "UINT64",
+    "FLOAT",
+    "DOUBLE",
+    "ENUM",
+]
+
+
+# The structure is defined manually in this program.
+# BCC can cast the automatically, but double is not supported.
+# https://github.com/iovisor/bcc/pull/2198
+# Only the header: data[] follows with nbytes valid bytes.
+
+
+class Data_array(ct.Structure):
+    _fields_ = [
+        ("ktime_ns", ct.c_ulonglong),
+        ("source", ct.c_uint),
+        ("pid", ct.c_uint),
+        ("tgid", ct.c_uint),
+        ("pvname", ct.c_char * 61),
+        ("tid", ct.c_ulonglong),
+        ("sid", ct.c_ulonglong),
+        ("field_type", ct.c_ushort),
+        ("elem_size", ct.c_ushort),
+        ("count", ct.c_uint),
+        ("captured", ct.c_uint),
+        ("nbytes", ct.c_uint),
+    ]
+
+
+def load_array_layouts(bpf, db):
+    """Tell exit_process where VAL, FTVL and NORD are for every record type
+    with an array VAL field (waveform, aai, aao, subArray, ...)."""
+    table = bpf["array_layout_hash"]
+    count = 0
+    for rdes, rtype, name in db.record_types():
+        fields = db.fields(rtype)
+        if not all(f in fields for f in ("VAL", "FTVL", "NORD")):
+            continue
+        if fields["VAL"].field_type != DBF_NOACCESS:
+            continue
+        layout = table.Leaf()
+        layout.val_offset = fields["VAL"].offset
+        layout.ftvl_offset = fields["FTVL"].offset
+        layout.nord_offset = fields["NORD"].offset
+        table[table.Key(rdes)] = layout
+        count += 1
+    return count
+
+
+def summarize(field_type, count, data):
+    """Content hash and statistics of the captured elements."""
+    summary = {"array.hash": hashlib.blake2b(data, digest_size=8).hexdigest()}
+
+    if field_type == DBF_STRING:
+        items = [
+            data[i : i + MAX_STRING_SIZE].split(b"\0", 1)[0]
+            for i in range(0, len(data), MAX_STRING_SIZE)
+        ]
+        summary["array.distinct"] = len(set(items))
+        return summary
+
+    fmt = DBF_FORMAT.get(field_type)
+    if fmt is None or count == 0:
+        return summary
+
+    values = struct.unpack(f"<{count}{fmt}", data[: count * struct.calcsize(fmt)])
+    summary["array.min"] = min(values)
+    summary["array.max"] = max(values)
+    summary["array.mean"] = sum(values) / count
+    return summary
+
+
+class ArrayTracer(object):
+    def __init__(self, servie_name, processor):
+        self.processor = processor
+        self.resource = Resource(attributes={SERVICE_NAME: servie_name})
+        self.scope = scope("tracer.array")
+        self.service_name = servie_name
+        self.iocs = None
+
+    def callback(self, cpu, data, size):
+        event = ct.cast(data, ct.POINTER(Data_array)).contents
+        payload = ct.string_at(
+            ct.cast(data, ct.c_void_p).value + ct.sizeof(Data_array), event.nbytes
+        )
+        if self.iocs:
+            self.iocs.export(event.tgid, event.tid, self.export, event, payload)
+        else:
+            self.export(event, payload)
+
+    def export(self, event, payload):
+        resource = self.resource
+        if self.iocs:
+            resource = self.iocs.resource(self, event.tgid)
+
+        pvname = event.pvname.decode("utf-8")
+        ftype = (
+            DBF_NAME[event.field_type]
+            if event.field_type < len(DBF_NAME)
+            else str(event.field_type)
+        )
+        span_name = f"{pvname} [{event.count}]"
+        # Child of the span of the put or the process
+        span = start_span(
+            span_name,
+            self.processor,
+            resource,
+            self.scope,
+            event.ktime_ns + BOOT_TIME_NS,
+            event.tid,
+            None,
+            event.tid,
+            event.sid,
+        )
+        span.set_attribute("pv.name", pvname)
+        span.set_attribute("array.source", ARRAY_SOURCE.get(event.source, ""))
+        span.set_attribute("array.type", ftype)
+        span.set_attribute("array.count", event.count)
+        span.set_attribute("array.bytes", event.count * event.elem_size)
+        span.set_attribute("array.captured", event.captured)
+        for key, value in summarize(
+            event.field_type, event.captured, payload
+        ).items():
+            span.set_attribute(key, value)
+        span.end(event.ktime_ns + BOOT_TIME_NS)
@@ -0,0 +1,169 @@
+#!/usr/bin/python3
+"""Probe overhead benchmark on a stand-in libdbCore.
+
+Builds libfakedbCore.so and the driver, then runs the driver without a
+collector and under proctrace.py in each mode, and reports the probe
+overhead per dbProcess, the ring buffer throughput, the events lost and
+the collector CPU. Needs root for the traced modes."""
+
+from __future__ import print_function
+import argparse
+import json
+import os
+import signal
+import subprocess
+import sys
+import time
+
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+REPO = os.path.dirname(HERE)
+LIB = os.path.join(HERE, "libfakedbCore.so")
+DRIVER = os.path.join(HERE, "driver")
+
+# Mode name -> proctrace.py options (None: no collector)
+MODES = {
+    "baseline": None,
+    "default": [],
+    "changed-only": ["--changed-only"],
+    "aggregate": ["--aggregate", "5"],
+    "profile": ["-F", "99"],
+    "flight-recorder": ["--flight-recorder", "10"],
+}
+
+# Modes that do not send every event on purpose
+FILTERED = {"changed-only"}
+
+
+def build(cc):
+    subprocess.check_call(
+        [cc, "-O2", "-g", "-shared", "-fPIC", "-o", LIB, "fakedbcore.c"], cwd=HERE
+    )
+    subprocess.check_call(
+        [cc, "-O2", "-g", "-o", DRIVER, "driver.c", "-L.", "-lfakedbCore",
+         "-Wl,-rpath,$ORIGIN", "-lpthread"],
+        cwd=HERE,
+    )
+
+
+def cpu_seconds(pid):
+    with open(f"/proc/{pid}/stat") as f:
+        fields = f.read().rsplit(")", 1)[1].split()
+    # utime and stime, fields 14 and 15
+    return (int(fields[11]) + int(fields[12])) / os.sysconf("SC_CLK_TCK")
+
+
+def run_driver(driver_args):
+    out = subprocess.check_output([DRIVER] + driver_args)
+    return json.loads(out.decode().strip().splitlines()[-1])
+
+
+def run_mode(options, driver_args, drain):
+    if options is None:
+        return run_driver(driver_args), None
+
+    collector = subprocess.Popen(
+        [sys.executable, "-u", "proctrace.py", "-p", LIB, "--exporter", "none",
+         "--count-events"] + options,
+        cwd=REPO,
+        stdout=subprocess.PIPE,
+        universal_newlines=True,
+    )
+    try:
+        for line in collector.stdout:
+            if line.strip() == "start":
+                break
+        else:
+            raise RuntimeError("collector exited before start")
+
+        cpu = cpu_seconds(collector.pid)
+        result = run_driver(driver_args)
+        time.sleep(drain)
+        result["collector_cpu_s"] = cpu_seconds(collector.pid) - cpu
+    finally:
+        collector.send_signal(signal.SIGINT)
+        out, _ = collector.communicate()
+
+    received = {}
+    for line in out.splitlines():
+        fields = line.split()
+        if len(fields) == 3 and fields[0] == "received":
+            received[fields[1]] = int(fields[2])
+    return result, received
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument("--cc", default=os.environ.get("CC", "cc"))
+    parser.add_argument(
+        "--modes",
+        default=",".join(MODES),
+        help=f"Comma separated modes out of {', '.join(MODES)}",
+    )
+    parser.add_argument("--chains", type=int, default=10)
+    parser.add_argument("--depth", type=int, default=4)
+    parser.add_argument("--fanout", type=int, default=1)
+    parser.add_argument("--threads", type=int, default=1)
+    parser.add_argument("--iterations", type=int, default=10000)
+    parser.add_argument("--work-ns", type=int, default=0)
+    parser.add_argument("--caput-every", type=int, default=0)
+    parser.add_argument("--steady", action="store_true", help="Put the same value every time")
+    parser.add_argument(
+        "--drain", type=float, default=2.0,
+        help="Seconds given to the collector to empty the ring buffers",
+    )
+    parser.add_argument("--json", help="Also write the results to this file")
+    args = parser.parse_args()
+
+    build(args.cc)
+
+    driver_args = [
+        "-n", str(args.chains), "-d", str(args.depth), "-f", str(args.fanout),
+        "-t", str(args.threads), "-i", str(args.iterations),
+        "-w", str(args.work_ns), "-c", str(args.caput_every),
+    ]
+    if args.steady:
+        driver_args.append("-s")
+
+    results = {}
+    baseline = None
+    print(
+        f"{'MODE':<16} {'NS/PROC':>9} {'OVERHEAD':>9} {'EVENTS/S':>10} "
+        f"{'LOST':>7} {'COLL_CPU':>9}"
+    )
+    for mode in args.modes.split(","):
+        if mode not in MODES:
+            parser.error(f"unknown mode {mode}")
+        result, received = run_mode(MODES[mode], driver_args, args.drain)
+        elapsed_s = result["elapsed_ns"] / 1e9
+        if MODES[mode] is None:
+            baseline = result["ns_per_process"]
+
+        row = dict(result)
+        row["overhead_ns"] = result["ns_per_process"] - baseline if baseline else None
+        if received is not None:
+            # One enter and one exit per dbProcess, one event per put and CA put
+            expected = 2 * result["process"] + result["puts"] + result["caputs"]
+            total = sum(received.values())
+            row["received"] = received
+            row["events_per_s"] = total / elapsed_s
+            row["lost"] = None if mode in FILTERED else 1 - total / expected
+            row["collector_cpu"] = result["collector_cpu_s"] / (elapsed_s + args.drain)
+        results[mode] = row
+
+        def fmt(value, spec):
+            return "-" if value is None else format(value, spec)
+
+        print(
+            f"{mode:<16} {result['ns_per_process']:>9.1f} "
+            f"{fmt(row['overhead_ns'], '>9.1f')} {fmt(row.get('events_per_s'), '>10.0f')} "
+            f"{fmt(row.get('lost'), '>7.2%')} {fmt(row.get('collector_cpu'), '>9.1%')}"
+        )
+
+    if args.json:
+        with open(args.json, "w") as f:
+            json.dump({"driver": driver_args, "results": results}, f, indent=2)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,190 @@
+/* Process chains of bench records through the stand-in libdbCore and print
+ * the timing as one JSON line. */
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "fakedbcore.h"
+
+struct options
+{
+    int chains;     /* chains per thread */
+    int depth;      /* records from the root to a leaf */
+    int fanout;     /* forward links of each record */
+    int threads;
+    long iterations;
+    long work_ns;
+    int caput_every; /* one CA put every N puts, 0: none */
+    int steady;      /* put the same value every time */
+};
+
+struct worker
+{
+    pthread_t thread;
+    struct options *opt;
+    benchRecord **roots;
+    long puts;
+    long caputs;
+};
+
+static struct options opt = {
+    .chains = 10,
+    .depth = 4,
+    .fanout = 1,
+    .threads = 1,
+    .iterations = 10000,
+    .work_ns = 0,
+    .caput_every = 0,
+    .steady = 0,
+};
+
+static long records;
+
+static long nowNs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static benchRecord *createChain(const char *prefix, int depth)
+{
+    char name[61];
+    DBENTRY ent;
+
+    memset(&ent, 0, sizeof(ent));
+    snprintf(name, sizeof(name), "%s", prefix);
+    dbCreateRecord(&ent, name);
+    /* iocInit walks the records with dbFirstRecord/dbGetRecordName */
+    dbGetRecordName(&ent);
+    records++;
+
+    benchRecord *prec = ent.precnode->precord;
+    prec->work_ns = opt.work_ns;
+
+    if (depth > 1)
+    {
+        prec->nlinks = opt.fanout;
+        prec->links = calloc(opt.fanout, sizeof(benchRecord *));
+        for (int i = 0; i < opt.fanout; i++)
+        {
+            snprintf(name, sizeof(name), "%s:%d", prefix, i);
+            prec->links[i] = createChain(name, depth - 1);
+        }
+    }
+    return prec;
+}
+
+static void putDone(void *userPvt)
+{
+    (void)userPvt;
+}
+
+static void *run(void *arg)
+{
+    struct worker *w = arg;
+    double val = 0;
+
+    for (long it = 0; it < w->opt->iterations; it++)
+    {
+        if (!w->opt->steady)
+            val += 1;
+        for (int c = 0; c < w->opt->chains; c++)
+        {
+            benchRecord *root = w->roots[c];
+            dbPutField(&root->addr, DBF_DOUBLE, &val, 1);
+            w->puts++;
+            if (w->opt->caput_every && w->puts % w->opt->caput_every == 0)
+            {
+                dbCaPutLinkCallback(&root->calink, DBF_DOUBLE, &val, 1, putDone, 0);
+                w->caputs++;
+            }
+        }
+    }
+    return 0;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [-n chains per thread] [-d depth] [-f fanout] [-t threads]\n"
+            "          [-i iterations] [-w work ns] [-c caput every N puts] [-s]\n",
+            prog);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    int c;
+    while ((c = getopt(argc, argv, "n:d:f:t:i:w:c:s")) != -1)
+    {
+        switch (c)
+        {
+        case 'n':
+            opt.chains = atoi(optarg);
+            break;
+        case 'd':
+            opt.depth = atoi(optarg);
+            break;
+        case 'f':
+            opt.fanout = atoi(optarg);
+            break;
+        case 't':
+            opt.threads = atoi(optarg);
+            break;
+        case 'i':
+            opt.iterations = atol(optarg);
+            break;
+        case 'w':
+            opt.work_ns = atol(optarg);
+            break;
+        case 'c':
+            opt.caput_every = atoi(optarg);
+            break;
+        case 's':
+            opt.steady = 1;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (opt.chains < 1 || opt.depth < 1 || opt.fanout < 1 || opt.threads < 1)
+        usage(argv[0]);
+
+    fakeDbInit();
+
+    struct worker *workers = calloc(opt.threads, sizeof(struct worker));
+    for (int t = 0; t < opt.threads; t++)
+    {
+        workers[t].opt = &opt;
+        workers[t].roots = calloc(opt.chains, sizeof(benchRecord *));
+        for (int i = 0; i < opt.chains; i++)
+        {
+            char name[61];
+            snprintf(name, sizeof(name), "bench:%d:%d", t, i);
+            workers[t].roots[i] = createChain(name, opt.depth);
+        }
+    }
+
+    long start = nowNs();
+    for (int t = 0; t < opt.threads; t++)
+        pthread_create(&workers[t].thread, 0, run, &workers[t]);
+    long puts = 0, caputs = 0;
+    for (int t = 0; t < opt.threads; t++)
+    {
+        pthread_join(workers[t].thread, 0);
+        puts += workers[t].puts;
+        caputs += workers[t].caputs;
+    }
+    long elapsed = nowNs() - start;
+
+    long per_chain = records / (opt.threads * opt.chains);
+    long process = puts * per_chain;
+    printf("{\"records\": %ld, \"puts\": %ld, \"caputs\": %ld, \"process\": %ld, "
+           "\"elapsed_ns\": %ld, \"ns_per_process\": %.1f}\n",
+           records, puts, caputs, process, elapsed, (double)elapsed / process);
+    return 0;
+}
@@ -0,0 +1,145 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "fakedbcore.h"
+
+#define NOINLINE __attribute__((noinline, visibility("default")))
+
+dbBase *pdbbase;
+
+static dbRecordType benchType;
+static dbFldDes valFldDes;
+static dbFldDes *papFldDes[1] = {&valFldDes};
+
+static void ellAdd(ELLLIST *list, ELLNODE *node)
+{
+    node->next = 0;
+    node->previous = list->node.previous;
+    if (list->node.previous)
+        list->node.previous->next = node;
+    else
+        list->node.next = node;
+    list->node.previous = node;
+    list->count++;
+}
+
+static long nowNs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+void fakeDbInit(void)
+{
+    pdbbase = calloc(1, sizeof(dbBase));
+
+    valFldDes.name = "VAL";
+    valFldDes.pdbRecordType = &benchType;
+    valFldDes.field_type = DBF_DOUBLE;
+    valFldDes.size = sizeof(double);
+    valFldDes.offset = offsetof(benchRecord, val);
+
+    benchType.name = "bench";
+    benchType.no_fields = 1;
+    benchType.pvalFldDes = &valFldDes;
+    benchType.papFldDes = papFldDes;
+    benchType.rec_size = sizeof(benchRecord);
+
+    ellAdd(&pdbbase->recordTypeList, &benchType.node);
+}
+
+NOINLINE long dbCreateRecord(DBENTRY *pdbentry, const char *precordName)
+{
+    benchRecord *prec = calloc(1, sizeof(benchRecord));
+    dbRecordNode *pnode = calloc(1, sizeof(dbRecordNode));
+
+    strncpy(prec->common.name, precordName, sizeof(prec->common.name) - 1);
+    prec->common.rdes = &benchType;
+
+    prec->addr.precord = &prec->common;
+    prec->addr.pfield = &prec->val;
+    prec->addr.pfldDes = &valFldDes;
+    prec->addr.no_elements = 1;
+    prec->addr.field_type = DBF_DOUBLE;
+    prec->addr.field_size = sizeof(double);
+    prec->addr.dbr_field_type = DBF_DOUBLE;
+
+    prec->ca.pvname = prec->common.name;
+    prec->ca.plink = &prec->calink;
+    prec->calink.precord = &prec->common;
+    prec->calink.value.pv_link.pvname = prec->common.name;
+    prec->calink.value.pv_link.pvt = &prec->ca;
+
+    pnode->precord = prec;
+    pnode->recordname = prec->common.name;
+    ellAdd(&benchType.recList, &pnode->node);
+
+    pdbentry->pdbbase = pdbbase;
+    pdbentry->precordType = &benchType;
+    pdbentry->pflddes = &valFldDes;
+    pdbentry->precnode = pnode;
+    return 0;
+}
+
+NOINLINE char *dbGetRecordName(DBENTRY *pdbentry)
+{
+    if (!pdbentry->precnode)
+        return 0;
+    return pdbentry->precnode->recordname;
+}
+
+NOINLINE long dbProcess(dbCommon *precord)
+{
+    benchRecord *prec = (benchRecord *)precord;
+
+    if (precord->pact)
+        return 0;
+    precord->pact = 1;
+
+    if (prec->work_ns > 0)
+    {
+        long end = nowNs() + prec->work_ns;
+        while (nowNs() < end)
+            ;
+    }
+
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    precord->time.secPastEpoch = ts.tv_sec - 631152000;
+    precord->time.nsec = ts.tv_nsec;
+
+    /* Forward links: the value propagates down the chain */
+    for (int i = 0; i < prec->nlinks; i++)
+    {
+        prec->links[i]->val = prec->val;
+        dbProcess(&prec->links[i]->common);
+    }
+
+    precord->pact = 0;
+    return 0;
+}
+
+NOINLINE long dbPutField(dbAddr *paddr, short dbrType, const void *pbuffer, long nRequest)
+{
+    if (dbrType != DBF_DOUBLE || nRequest != 1)
+        return -1;
+    memcpy(paddr->pfield, pbuffer, sizeof(double));
+    return dbProcess(paddr->precord);
+}
+
+NOINLINE long dbCaPutLinkCallback(struct link *plink, short dbrType, const void *pbuffer,
+                                  long nRequest, dbCaCallback callback, void *userPvt)
+{
+    caLink *pca = plink->value.pv_link.pvt;
+
+    pca->putType = dbrType;
+    pca->putnelements = nRequest;
+    pca->pputNative = (void *)pbuffer;
+    pca->putCallback = callback;
+    pca->putUserPvt = userPvt;
+    if (callback)
+        callback(userPvt);
+    return 0;
+}
@@ -0,0 +1,32 @@
+/* Stand-in for the libdbCore entry points probed by proctrace.py, with the
+ * structure layouts of epicsStructure.h. */
+#ifndef FAKEDBCORE_H
+#define FAKEDBCORE_H
+
+#include <stddef.h>
+#include "../epicsStructure.h"
+
+typedef struct benchRecord
+{
+    dbCommon common;
+    double val;
+    long work_ns;             /* busy time of each process */
+    int nlinks;               /* records processed after this one */
+    struct benchRecord **links;
+    dbAddr addr;              /* VAL, for dbPutField */
+    struct link calink;       /* CA output link, for dbCaPutLinkCallback */
+    caLink ca;
+} benchRecord;
+
+extern dbBase *pdbbase;
+
+void fakeDbInit(void);
+
+long dbCreateRecord(DBENTRY *pdbentry, const char *precordName);
+char *dbGetRecordName(DBENTRY *pdbentry);
+long dbProcess(dbCommon *precord);
+long dbPutField(dbAddr *paddr, short dbrType, const void *pbuffer, long nRequest);
+long dbCaPutLinkCallback(struct link *plink, short dbrType, const void *pbuffer,
+                         long nRequest, dbCaCallback callback, void *userPvt);
+
+#endif
@@ -0,0 +1,129 @@
+from __future__ import print_function
+import hashlib
+import random
+
+
+PERCENTILES = (50, 90, 99)
+
+
+def fingerprint(chain):
+    """Hash of the structure of a chain: record names in processing order
+    with their nesting depth."""
+    h = hashlib.blake2b(digest_size=8)
+    for p in chain:
+        h.update(b"%d:" % p[0].count)
+        h.update(p[0].pvname)
+        h.update(b";")
+    return h.hexdigest()
+
+
+class NodeStats(object):
+    """Durations of one record of a chain, with a bounded reservoir of
+    samples for the percentiles."""
+
+    def __init__(self, reservoir):
+        self.reservoir = reservoir
+        self.count = 0
+        self.total = 0
+        self.min = None
+        self.max = 0
+        self.samples = []
+
+    def add(self, duration):
+        self.count += 1
+        self.total += duration
+        self.min = duration if self.min is None else min(self.min, duration)
+        self.max = max(self.max, duration)
+        if len(self.samples) < self.reservoir:
+            self.samples.append(duration)
+        else:
+            i = random.randrange(self.count)
+            if i < self.reservoir:
+                self.samples[i] = duration
+
+    def percentile(self, q):
+        samples = sorted(self.samples)
+        return samples[round(q / 100 * (len(samples) - 1))]
+
+    def attributes(self):
+        attrs = {
+            "chain.node.count": self.count,
+            "chain.node.min_us": self.min / 1e3,
+            "chain.node.mean_us": self.total / self.count / 1e3,
+            "chain.node.max_us": self.max / 1e3,
+        }
+        for q in PERCENTILES:
+            attrs[f"chain.node.p{q}_us"] = self.percentile(q) / 1e3
+        return attrs
+
+
+class ChainGroup(object):
+    def __init__(self, size, reservoir):
+        self.nodes = [NodeStats(reservoir) for _ in range(size)]
+        self.count = 0
+        self.outliers = 0
+        self.representative = None
+
+
+class ChainAggregator(object):
+    """Export one representative trace per chain structure and interval,
+    annotated with the duration statistics of each of its records, plus the
+    full trace of the chains that are outliers.
+
+    A chain is an outlier when one of its records takes longer than
+    `outlier` times its median of the previous interval."""
+
+    def __init__(self, export, outlier=3.0, min_samples=20, reservoir=1024):
+        self.export = export
+        self.outlier = outlier
+        self.min_samples = min_samples
+        self.reservoir = reservoir
+        self.groups = {}
+        self.baseline = {}  # fingerprint -> [median of each node]
+
+    def add(self, chain):
+        """Account a finished chain: a list of [enter, exit] events."""
+        chain = [p for p in chain if len(p) >= 2]
+        if not chain:
+            return
+
+        fp = fingerprint(chain)
+        group = self.groups.get(fp)
+        if group is None:
+            group = self.groups[fp] = ChainGroup(len(chain), self.reservoir)
+        group.count += 1
+
+        durations = [p[1].ktime_ns - p[0].ktime_ns for p in chain]
+        for node, duration in zip(group.nodes, durations):
+            node.add(duration)
+
+        if group.representative is None:
+            # The events point into the ring buffer: keep copies
+            group.representative = [
+                [type(e).from_buffer_copy(e) for e in p[:2]] + p[2:] for p in chain
+            ]
+            return
+
+        medians = self.baseline.get(fp)
+        if medians and any(
+            d > self.outlier * m for d, m in zip(durations, medians) if m
+        ):
+            group.outliers += 1
+            self.export(chain, [{"chain.fingerprint": fp, "chain.outlier": True}] * len(chain))
+
+    def flush(self):
+        """Export the representatives of the interval and start a new one."""
+        for fp, group in self.groups.items():
+            attrs = []
+            for node in group.nodes:
+                a = node.attributes()
+                a["chain.fingerprint"] = fp
+                a["chain.count"] = group.count
+                a["chain.outliers"] = group.outliers
+                attrs.append(a)
+            self.export(group.representative, attrs)
+
+            if group.nodes[0].count >= self.min_samples:
+                self.baseline[fp] = [node.percentile(50) for node in group.nodes]
+
+        self.groups = {}
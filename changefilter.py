@@ -0,0 +1,30 @@
+from __future__ import print_function
+
+
+class ChangeFilterStats(object):
+    """Print the process exits dropped by the in-kernel change filter
+    (--changed-only) since the last flush, per record."""
+
+    def __init__(self, table, top=20):
+        self.table = table
+        self.top = top
+        self.last = {}
+
+    def flush(self):
+        rows = []
+        total = 0
+        for key, st in self.table.items():
+            pvname = key.name.decode("utf-8", "replace")
+            delta = st.total - self.last.get((key.tgid, pvname), 0)
+            self.last[(key.tgid, pvname)] = st.total
+            if delta > 0:
+                rows.append((key.tgid, pvname, delta))
+                total += delta
+        if not rows:
+            return
+        rows.sort(key=lambda r: r[2], reverse=True)
+
+        print(f"{'PID':>7} {'PV':<40} {'SUPPRESSED':>10}")
+        for tgid, pvname, delta in rows[: self.top]:
+            print(f"{tgid:>7} {pvname:<40} {delta:>10}")
+        print(f"{'':>7} {'total':<40} {total:>10}")
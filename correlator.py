@@ -0,0 +1,223 @@
+#!/usr/bin/python3
+"""Join the traces of CA links between IOCs.
+
+Collectors started with --correlator send their spans here instead of to
+Zipkin. A CA put span (dbCaPutLinkCallback) of one IOC is matched with the
+dbPutField span that starts a new trace on the IOC serving the PV, by record
+name, value and time. The downstream trace is then moved into the upstream
+one, under the CA put span, before the spans are posted to Zipkin."""
+
+from __future__ import print_function
+import argparse
+import asyncio
+import collections
+import json
+import os
+import time
+import urllib.request
+
+
+# epics.span_kind of the CaputTracer and PutTracer spans: the service names
+# are per IOC ("cm1/put-service") with an IocRegistry
+CAPUT_KIND = "caput"
+PUT_KIND = "put"
+MAX_HOPS = 16
+# The collectors export in batches every OTEL_BSP_SCHEDULE_DELAY (5 s by
+# default): the spans of a trace can arrive that far apart
+EXPORT_DELAY_S = float(os.environ.get("OTEL_BSP_SCHEDULE_DELAY", 5000)) / 1e3
+
+
+def link_key(span):
+    """(record name, value) of a CA put or a put span."""
+    tags = span.get("tags", {})
+    pvname = tags.get("pv.name", "").split()[0] if tags.get("pv.name") else ""
+    return pvname.split(".", 1)[0], tags.get("pv.value", "")
+
+
+class Correlator(object):
+    def __init__(self, window_ms, hold_s, alpha=0.1):
+        self.window_us = window_ms * 1e3
+        self.hold_s = hold_s
+        self.alpha = alpha
+
+        self.traces = {}  # traceId -> [spans, last span arrival]
+        self.caputs = collections.defaultdict(collections.deque)
+        self.puts = collections.defaultdict(collections.deque)
+        # downstream traceId -> (upstream traceId, CA put id, put id, time)
+        self.parent = {}
+        self.skew = {}  # (CA put host, put host) -> expected put - CA put (us)
+        self.stats = collections.Counter()
+
+    def add(self, span, now):
+        tid = span["traceId"]
+        entry = self.traces.get(tid)
+        if entry is None:
+            entry = self.traces[tid] = [[], now]
+        entry[0].append(span)
+        entry[1] = now
+        self.stats["spans"] += 1
+
+        kind = span.get("tags", {}).get("epics.span_kind")
+        if kind == CAPUT_KIND:
+            self.match(span, now, upstream=True)
+        elif kind == PUT_KIND and "parentId" not in span:
+            self.match(span, now, upstream=False)
+
+    def match(self, span, now, upstream):
+        key = link_key(span)
+        host = span["tags"].get("epics.host", "")
+        others, mine = (self.puts, self.caputs) if upstream else (self.caputs, self.puts)
+
+        best = None
+        for i, (other, ohost, _) in enumerate(others.get(key, ())):
+            caput, put = (span, other) if upstream else (other, span)
+            pair = (host, ohost) if upstream else (ohost, host)
+            d = abs(put["timestamp"] - caput["timestamp"] - self.skew.get(pair, 0))
+            if d <= self.window_us and (best is None or d < best[0]):
+                best = (d, i, caput, put, pair)
+
+        if best is None:
+            mine[key].append((span, host, now))
+            return
+
+        _, i, caput, put, pair = best
+        del others[key][i]
+        if not others[key]:
+            del others[key]
+
+        # Expected one-way delay plus clock offset between the two hosts
+        offset = put["timestamp"] - caput["timestamp"]
+        skew = self.skew.get(pair, offset)
+        self.skew[pair] = skew + self.alpha * (offset - skew)
+
+        self.parent[put["traceId"]] = (caput["traceId"], caput["id"], put["id"], now)
+        self.stats["links"] += 1
+
+    def root(self, tid):
+        for _ in range(MAX_HOPS):
+            if tid not in self.parent:
+                break
+            tid = self.parent[tid][0]
+        return tid
+
+    def flush(self, now):
+        """Return the spans of the traces complete for hold_s seconds."""
+        out = []
+        for tid in [t for t, e in self.traces.items() if now - e[1] >= self.hold_s]:
+            spans = self.traces.pop(tid)[0]
+            link = self.parent.get(tid)
+            if link:
+                root = self.root(tid)
+                for span in spans:
+                    span["traceId"] = root
+                    if span["id"] == link[2]:
+                        span["parentId"] = link[1]
+                        span["tags"]["link.trace_id"] = tid
+            out.extend(spans)
+
+        for table, name in ((self.caputs, "unmatched_caputs"), (self.puts, None)):
+            for key in list(table):
+                q = table[key]
+                while q and now - q[0][2] >= self.hold_s:
+                    q.popleft()
+                    if name:
+                        self.stats[name] += 1
+                if not q:
+                    del table[key]
+
+        # Late spans of a moved trace still have to follow it
+        for tid in [t for t, l in self.parent.items() if now - l[3] >= 10 * self.hold_s]:
+            del self.parent[tid]
+
+        return out
+
+    def report(self):
+        print(
+            f"spans {self.stats['spans']} links {self.stats['links']} "
+            f"unmatched CA puts {self.stats['unmatched_caputs']} "
+            f"open traces {len(self.traces)}"
+        )
+        for (chost, phost), skew in sorted(self.skew.items()):
+            print(f"  {chost} -> {phost}: {skew / 1e3:+.3f} ms")
+
+
+def post(endpoint, spans):
+    req = urllib.request.Request(
+        endpoint,
+        data=json.dumps(spans).encode("utf-8"),
+        headers={"Content-Type": "application/json"},
+    )
+    try:
+        urllib.request.urlopen(req, timeout=10).close()
+    except OSError as e:
+        print(f"zipkin: {e}")
+
+
+async def main(args):
+    corr = Correlator(args.window_ms, args.hold)
+
+    async def handle(reader, writer):
+        async for line in reader:
+            try:
+                corr.add(json.loads(line), time.monotonic())
+            except (ValueError, KeyError):
+                corr.stats["bad_lines"] += 1
+        writer.close()
+
+    host, port = args.listen.rsplit(":", 1)
+    server = await asyncio.start_server(handle, host, int(port), limit=1 << 20)
+    print(f"listening on {args.listen}")
+
+    loop = asyncio.get_running_loop()
+    next_report = time.monotonic() + args.report
+    async with server:
+        while True:
+            await asyncio.sleep(0.5)
+            now = time.monotonic()
+            spans = corr.flush(now)
+            if spans:
+                # Keep accepting spans while Zipkin answers
+                await loop.run_in_executor(None, post, args.zipkin, spans)
+            if args.report and now >= next_report:
+                next_report = now + args.report
+                corr.report()
+
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument(
+        "--listen",
+        default="0.0.0.0:9412",
+        help="Address the collectors send their spans to",
+    )
+    parser.add_argument(
+        "--zipkin",
+        default="http://localhost:9411/api/v2/spans",
+        help="Zipkin v2 span endpoint",
+    )
+    parser.add_argument(
+        "--window-ms",
+        type=float,
+        default=1000,
+        help="Largest difference between the CA put and the put, after the "
+        "learned delay between the two hosts",
+    )
+    parser.add_argument(
+        "--hold",
+        type=float,
+        default=3 * EXPORT_DELAY_S,
+        help="Seconds a trace is kept after its last span before it is posted "
+        "(default: three times the export delay of the collectors, "
+        "OTEL_BSP_SCHEDULE_DELAY, so a CA put exported in the next batch "
+        "still finds its trace)",
+    )
+    parser.add_argument(
+        "--report",
+        type=float,
+        default=10.0,
+        help="Seconds between statistics prints (0: never)",
+    )
+    try:
+        asyncio.run(main(parser.parse_args()))
+    except KeyboardInterrupt:
+        pass
@@ -159,6 +159,25 @@ union value
     struct vxiio vxiio;       /* vxi io */
 };
 
+/* link types */
+#define CONSTANT 0
+#define PV_LINK 1
+#define VME_IO 2
+#define CAMAC_IO 3
+#define AB_IO 4
+#define GPIB_IO 5
+#define BITBUS_IO 6
+#define MACRO_LINK 7
+#define JSON_LINK 8
+#define PN_LINK 9
+#define DB_LINK 10
+#define CA_LINK 11
+#define INST_IO 12
+#define BBGPIB_IO 13
+#define RF_IO 14
+#define VXI_IO 15
+#define LINK_NTYPES 16
+
 struct link
 {
     struct dbCommon *precord; /* Pointer to record owning link */
@@ -513,3 +532,41 @@ typedef struct caLink
     unsigned long nNoWrite; /*only modified by dbCaPutLink*/
     unsigned long nUpdate;
 } caLink;
+
+typedef struct db_field_log
+{
+    unsigned int type : 1; /* type (root) field */
+    unsigned int ctx : 1;  /* context where filter runs */
+    unsigned int mask : 8; /* DBE_* mask */
+    /* Common fields */
+    epicsTimeStamp time;    /* Time stamp */
+    epicsUTag utag;         /* Time tag */
+    unsigned short stat;    /* Alarm Status */
+    unsigned short sevr;    /* Alarm Severity */
+    short field_type;       /* DBF type of data */
+    short field_size;       /* Size of a single element */
+    long no_elements;       /* No of valid array elements */
+    /* Filter destructor and value/reference union omitted */
+} db_field_log;
+
+struct dbChannel;
+
+typedef void EVENTFUNC(void *user_arg, struct dbChannel *chan,
+                       int eventsRemaining, struct db_field_log *pfl);
+
+/* Private to dbEvent.c */
+struct evSubscrip
+{
+    ELLNODE node;
+    struct dbChannel *chan;
+    EVENTFUNC *user_sub;
+    void *user_arg;
+    struct event_que *ev_que;
+    db_field_log **pLastLog;
+    unsigned long npend;    /* n times this event is on the queue */
+    unsigned long nreplace; /* n times replacing event on the queue */
+    unsigned char select;
+    char useValque;
+    char callBackInProgress;
+    char enabled;
+};
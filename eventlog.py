@@ -0,0 +1,127 @@
+from __future__ import print_function
+import glob
+import json
+import mmap
+import os
+import struct
+import zlib
+
+
+MAGIC = b"PTRACE1\0"
+HEADER = struct.Struct("<8sI")  # magic, JSON length
+BLOCK = struct.Struct("<III")  # compressed length, raw length, records
+RECORD = struct.Struct("<HHIQ")  # ring, cpu, payload size, kernel time (ns)
+
+
+class SegmentWriter(object):
+    """Append raw ring buffer payloads to memory-mapped segment files
+    <prefix>.000, <prefix>.001, ...
+
+    Records are batched into zlib compressed blocks; a segment is sized
+    up front, filled through the mapping and truncated when it is closed.
+    The segments of an earlier recording with the same prefix are removed,
+    or read_segments() would replay them after this one."""
+
+    def __init__(self, prefix, rings, segment_bytes=64 << 20, block_bytes=256 << 10, meta=None):
+        self.prefix = prefix
+        self.rings = list(rings)
+        self.ring_ids = {name: i for i, name in enumerate(self.rings)}
+        self.segment_bytes = segment_bytes
+        self.block_bytes = block_bytes
+        self.meta = dict(meta or {}, rings=self.rings)
+
+        self.index = 0
+        self.file = None
+        self.map = None
+        self.pos = 0
+        self.block = []
+        self.block_size = 0
+        for path in segments(prefix):
+            os.unlink(path)
+
+    def _open(self):
+        path = f"{self.prefix}.{self.index:03d}"
+        self.index += 1
+        self.file = open(path, "w+b")
+        self.file.truncate(self.segment_bytes)
+        self.map = mmap.mmap(self.file.fileno(), self.segment_bytes)
+
+        meta = json.dumps(self.meta).encode("utf-8")
+        self.map[: HEADER.size] = HEADER.pack(MAGIC, len(meta))
+        self.map[HEADER.size : HEADER.size + len(meta)] = meta
+        self.pos = HEADER.size + len(meta)
+
+    def _close_segment(self):
+        if self.map is None:
+            return
+        self.map.close()
+        self.file.truncate(self.pos)
+        self.file.close()
+        self.map = None
+        self.file = None
+
+    def write(self, ring, cpu, ts_ns, payload):
+        self.block.append(RECORD.pack(self.ring_ids[ring], cpu, len(payload), ts_ns))
+        self.block.append(payload)
+        self.block_size += RECORD.size + len(payload)
+        if self.block_size >= self.block_bytes:
+            self.flush()
+
+    def flush(self):
+        if not self.block:
+            return
+        raw = b"".join(self.block)
+        data = zlib.compress(raw, 1)
+        count = len(self.block) // 2
+        self.block = []
+        self.block_size = 0
+
+        need = BLOCK.size + len(data)
+        if self.map is not None and self.pos + need > self.segment_bytes:
+            self._close_segment()
+        if self.map is None:
+            self._open()
+            if self.pos + need > self.segment_bytes:
+                raise ValueError("block larger than a segment")
+
+        self.map[self.pos : self.pos + BLOCK.size] = BLOCK.pack(len(data), len(raw), count)
+        self.map[self.pos + BLOCK.size : self.pos + need] = data
+        self.pos += need
+
+    def close(self):
+        self.flush()
+        self._close_segment()
+
+
+def segments(prefix):
+    return sorted(glob.glob(glob.escape(prefix) + ".[0-9][0-9][0-9]"))
+
+
+def read_segments(prefix):
+    """Yield (meta, ring name, cpu, kernel time, payload) of every record."""
+    for path in segments(prefix):
+        with open(path, "rb") as f:
+            if os.fstat(f.fileno()).st_size < HEADER.size:
+                continue
+            with mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ) as m:
+                magic, length = HEADER.unpack_from(m, 0)
+                if magic != MAGIC:
+                    raise ValueError(f"{path}: not a proctrace segment")
+                meta = json.loads(m[HEADER.size : HEADER.size + length])
+                rings = meta["rings"]
+
+                pos = HEADER.size + length
+                while pos + BLOCK.size <= len(m):
+                    clen, rawlen, count = BLOCK.unpack_from(m, pos)
+                    if clen == 0:
+                        break
+                    pos += BLOCK.size
+                    raw = memoryview(zlib.decompress(m[pos : pos + clen], bufsize=rawlen))
+                    pos += clen
+
+                    off = 0
+                    for _ in range(count):
+                        ring, cpu, size, ts_ns = RECORD.unpack_from(raw, off)
+                        off += RECORD.size
+                        yield meta, rings[ring], cpu, ts_ns, raw[off : off + size]
+                        off += size
@@ -0,0 +1,114 @@
+from __future__ import print_function
+import collections
+import ctypes as ct
+import time
+
+from tracezipkin import Data_process, STATE_ENTER_PROC, STATE_EXIT_PROC
+
+
+class FlightRecorder(object):
+    """Keep the last seconds of raw ring buffer events and only hand them to
+    the tracers when something worth looking at happened.
+
+    Raw payloads are stored as bytes in a bounded deque; nothing is decoded
+    further than the header needed for the triggers until a dump."""
+
+    def __init__(self, window_s, post_s, max_events, latency_ms=0, alarm=False):
+        self.window_ns = int(window_s * 1e9)
+        self.post_ns = int(post_s * 1e9)
+        self.latency_ns = int(latency_ms * 1e6)
+        self.alarm = alarm
+
+        self.events = collections.deque(maxlen=max_events)
+        self.callbacks = {}
+        self.resets = []
+        self.enters = {}
+        self.sevr = {}  # (tgid, record name) -> last SEVR
+
+        self.trigger_ns = None
+        self.reason = None
+
+    def wrap(self, ring, callback, ctype, reset=None):
+        """Return a ring buffer callback that records into the window."""
+        self.callbacks[ring] = callback
+        if reset is not None:
+            self.resets.append(reset)
+
+        def record(cpu, data, size):
+            raw = ct.string_at(data, size)
+            event = ctype.from_buffer_copy(raw.ljust(ct.sizeof(ctype), b"\0"))
+            ktime_ns = event.ktime_ns
+            self.events.append((ktime_ns, ring, raw))
+            self._check(event, ktime_ns)
+
+            while self.events and self.events[0][0] < ktime_ns - self.window_ns - self.post_ns:
+                self.events.popleft()
+
+        return record
+
+    def trigger(self, reason, ktime_ns=None):
+        if self.trigger_ns is not None:
+            return
+        self.trigger_ns = time.monotonic_ns() if ktime_ns is None else ktime_ns
+        self.reason = reason
+        print(f"flight recorder triggered: {reason}")
+
+    def _check(self, event, ktime_ns):
+        if isinstance(event, Data_process):
+            key = (event.pid, event.count)
+            if event.state == STATE_ENTER_PROC:
+                self.enters[key] = ktime_ns
+                return
+            if event.state != STATE_EXIT_PROC:
+                return
+
+            enter_ns = self.enters.pop(key, None)
+            pvname = event.pvname.decode("utf-8")
+            if self.latency_ns and enter_ns and ktime_ns - enter_ns > self.latency_ns:
+                self.trigger(f"{pvname} processed in {(ktime_ns - enter_ns) / 1e6:.3f} ms", ktime_ns)
+
+            if self.alarm:
+                # Same record names in several IOCs (one per cryomodule)
+                record = (event.tgid, pvname)
+                if event.sevr > 0 and self.sevr.get(record, 0) == 0:
+                    self.trigger(
+                        f"{pvname} of {event.tgid} in alarm (STAT={event.stat} SEVR={event.sevr})",
+                        ktime_ns,
+                    )
+                self.sevr[record] = event.sevr
+            return
+
+        if hasattr(event, "ktime_ns_end") and self.latency_ns:
+            if event.ktime_ns_end - event.ktime_ns > self.latency_ns:
+                pvname = event.pvname.decode("utf-8")
+                self.trigger(
+                    f"{pvname} put in {(event.ktime_ns_end - event.ktime_ns) / 1e6:.3f} ms",
+                    ktime_ns,
+                )
+
+    def poll(self):
+        """Dump the window once the post-trigger time has passed."""
+        if self.trigger_ns is None:
+            return
+        if time.monotonic_ns() < self.trigger_ns + self.post_ns:
+            return
+
+        start = self.trigger_ns - self.window_ns
+        end = self.trigger_ns + self.post_ns
+        count = 0
+        for ktime_ns, ring, raw in list(self.events):
+            if start <= ktime_ns <= end:
+                buf = ct.create_string_buffer(raw, len(raw))
+                self.callbacks[ring](0, buf, len(raw))
+                count += 1
+
+        while self.events and self.events[0][0] <= end:
+            self.events.popleft()
+
+        # Chains cut by the window must not leak into the next dump
+        for reset in self.resets:
+            reset()
+
+        print(f"flight recorder exported {count} events ({self.reason})")
+        self.trigger_ns = None
+        self.reason = None
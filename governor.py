@@ -0,0 +1,128 @@
+from __future__ import print_function
+import time
+
+from metrics import Histogram, escape
+from probestats import ProbeStats
+
+
+SAMPLE_ALL = 0xFFFFFFFF  # proctrace.c
+GOVERNOR_SAMPLE = 0
+GOVERNOR_METRICS_ONLY = 1
+LATENCY_SLOTS = 40
+# bpf_log2l(ns) == slot for 2^(slot-1) <= ns < 2^slot
+LATENCY_BOUNDS = [1 << slot for slot in range(LATENCY_SLOTS)]
+
+
+class Governor(object):
+    """Keep the cost of the probes within a CPU and a ring buffer drop
+    budget by changing the share of the traces sampled in the kernel.
+
+    Every poll the probe CPU time (from the kernel's per-program statistics,
+    plus `trap_ns` per run for the uprobe itself) and the ring buffer drops
+    are compared with the budgets. Over budget the ratio is halved, down to
+    `min_ratio` and then metrics-only (no span is exported, the in-kernel
+    latency histograms still count). After `relax` polls under half the
+    budget the steps are undone one at a time."""
+
+    def __init__(self, bpf, cpu_percent, drops_per_s, min_ratio=0.01, relax=5, trap_ns=1000):
+        self.bpf = bpf
+        self.cpu_percent = cpu_percent
+        self.drops_per_s = drops_per_s
+        self.min_ratio = min_ratio
+        self.relax = relax
+        self.trap_ns = trap_ns
+        self.probes = ProbeStats(bpf)
+
+        self.ratio = 1.0
+        self.metrics_only = False
+        self.calm = 0
+        self.last = None
+        self.write()
+
+    def write(self):
+        table = self.bpf["governor"]
+        table[table.Key(GOVERNOR_SAMPLE)] = table.Leaf(int(self.ratio * SAMPLE_ALL))
+        table[table.Key(GOVERNOR_METRICS_ONLY)] = table.Leaf(int(self.metrics_only))
+
+    def measure(self):
+        runs = ns = 0
+        for row in self.probes.sample().values():
+            runs += row["runs"]
+            ns += row["ns"]
+        drops = sum(v.value for v in self.bpf["ring_drops"].values())
+        return time.monotonic_ns(), runs * self.trap_ns + ns, drops
+
+    def change(self, reason):
+        mode = "metrics-only" if self.metrics_only else f"sample ratio {self.ratio:g}"
+        print(f"{time.strftime('%Y-%m-%dT%H:%M:%S')} governor: {mode} ({reason})")
+        self.write()
+
+    def poll(self):
+        now = self.measure()
+        if self.last is None:
+            self.last = now
+            return
+        elapsed = now[0] - self.last[0]
+        if elapsed <= 0:
+            return
+        cpu = (now[1] - self.last[1]) / elapsed * 100
+        drops = (now[2] - self.last[2]) / elapsed * 1e9
+        self.last = now
+        reason = f"probes {cpu:.1f}% of a CPU, {drops:.0f} drops/s"
+
+        if cpu > self.cpu_percent or drops > self.drops_per_s:
+            self.calm = 0
+            if self.metrics_only:
+                return
+            if self.ratio / 2 < self.min_ratio:
+                self.metrics_only = True
+            else:
+                self.ratio /= 2
+            self.change(reason)
+            return
+
+        if cpu > self.cpu_percent / 2 or drops > self.drops_per_s / 2:
+            self.calm = 0
+            return
+        if self.ratio >= 1.0 and not self.metrics_only:
+            return
+        self.calm += 1
+        if self.calm < self.relax:
+            return
+        self.calm = 0
+        if self.metrics_only:
+            self.metrics_only = False
+        else:
+            self.ratio = min(self.ratio * 2, 1.0)
+        self.change(reason)
+
+    def gauges(self, metrics):
+        metrics.gauge(
+            "proctrace_sample_ratio",
+            "Share of the traces sampled by the governor.",
+            lambda: [("", self.ratio)],
+        )
+        metrics.gauge(
+            "proctrace_metrics_only",
+            "1 while the governor exports no span.",
+            lambda: [("", int(self.metrics_only))],
+        )
+
+    def latency(self, iocs=None):
+        """[(labels, Histogram)] of the in-kernel dbProcess latency per IOC."""
+        hists = {}
+        for key, count in self.bpf["process_latency"].items():
+            hist = hists.get(key.tgid)
+            if hist is None:
+                hist = hists[key.tgid] = Histogram(LATENCY_BOUNDS)
+            hist.buckets[min(key.slot, LATENCY_SLOTS - 1)] += count.value
+        for tgid, total in self.bpf["process_latency_sum"].items():
+            if tgid.value in hists:
+                hists[tgid.value].sum_ns = total.value
+
+        rows = []
+        for tgid, hist in sorted(hists.items()):
+            ioc = iocs.iocs.get(tgid) if iocs else None
+            name = ioc.name if ioc else str(tgid)
+            rows.append((f'ioc="{escape(name)}",pid="{tgid}"', hist))
+        return rows
@@ -0,0 +1,77 @@
+from __future__ import print_function
+
+from iocmem import IocMemory, leaf_type
+
+
+DBBASE_RECORDTYPELIST_OFFSET = 24  # dbBase.recordTypeList follows menuList
+DBRN_FLAGS_ISALIAS = 1
+MAX_WALK = 1 << 20
+
+
+class IocDatabase(object):
+    """Walk the record database of a running IOC from pdbbase, using the
+    ctypes layouts BCC generated for the dbRecordType/dbRecordNode/dbFldDes
+    scratch maps of proctrace.c."""
+
+    def __init__(self, bpf, pid, libpath, root=""):
+        self.bpf = bpf
+        self.mem = IocMemory(pid, root)
+        self.libpath = libpath
+
+        self.RecordType = leaf_type(bpf["rectype"])
+        self.RecordNode = leaf_type(bpf["recn"])
+        self.FldDes = leaf_type(bpf["mapdbfld"])
+        self.Common = leaf_type(bpf["db_data"])
+
+    def record_types(self):
+        """Yield (dbRecordType address, dbRecordType, name)."""
+        path = self.mem.path(self.libpath)
+        ppdbbase = self.mem.symbol_address(path, "pdbbase")
+        if not ppdbbase:
+            return
+        pdbbase = self.mem.read_ptr(ppdbbase)
+        if not pdbbase:
+            return
+
+        rdes = self.mem.read_ptr(pdbbase + DBBASE_RECORDTYPELIST_OFFSET)
+        for _ in range(MAX_WALK):
+            if not rdes:
+                break
+            rtype = self.mem.read_struct(self.RecordType, rdes)
+            yield rdes, rtype, self.mem.read_str(rtype.name)
+            rdes = rtype.node.next
+
+    def records(self):
+        """Yield (precord, dbRecordType address) of every record."""
+        seen = set()
+        for rdes, rtype, _ in self.record_types():
+            rnode = rtype.recList.node.next
+            for _ in range(MAX_WALK):
+                if not rnode:
+                    break
+                node = self.mem.read_struct(self.RecordNode, rnode)
+                if node.precord and not node.flags & DBRN_FLAGS_ISALIAS:
+                    seen.add(node.precord)
+                    yield node.precord, rdes
+                rnode = node.node.next
+
+        # Fall back on the records seen by dbCreateRecord/dbGetRecordName.
+        for key, ent in self.bpf["pv_entry_hash"].items():
+            if key.tgid != self.mem.pid or not ent.precnode:
+                continue
+            node = self.mem.read_struct(self.RecordNode, ent.precnode)
+            if node.precord and node.precord not in seen:
+                seen.add(node.precord)
+                yield node.precord, ent.precordType
+
+    def fields(self, rtype):
+        """Return {field name: dbFldDes} of a dbRecordType."""
+        fields = {}
+        if not rtype.papFldDes or rtype.no_fields <= 0:
+            return fields
+        for pfld in self.mem.read_ptrs(rtype.papFldDes, rtype.no_fields):
+            if not pfld:
+                continue
+            fld = self.mem.read_struct(self.FldDes, pfld)
+            fields[self.mem.read_str(fld.name, 8)] = fld
+        return fields
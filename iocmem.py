@@ -0,0 +1,156 @@
+from __future__ import print_function
+import ctypes as ct
+import struct
+
+
+ELF_MAGIC = b"\x7fELF"
+ET_DYN = 3
+PT_LOAD = 1
+SHT_DYNSYM = 11
+
+
+def leaf_type(table):
+    # BCC replaces Leaf of per-CPU tables by an array over all CPUs.
+    return getattr(table, "sLeaf", table.Leaf)
+
+
+class IocMemory(object):
+    """Read-only view of an IOC process through /proc/<pid>/mem.
+
+    Used by the loader to walk structures that are only reachable through
+    pointers in the IOC (the database, rset/dset tables) and to map runtime
+    addresses back to (file, ELF address) pairs for attach_uprobe."""
+
+    def __init__(self, pid, root=""):
+        self.pid = pid
+        self.root = root
+        self._maps = None
+        self._load_bias = {}
+
+    def read(self, addr, size):
+        with open(f"/proc/{self.pid}/mem", "rb", 0) as mem:
+            mem.seek(addr)
+            return mem.read(size)
+
+    def read_ptr(self, addr):
+        return struct.unpack("<Q", self.read(addr, 8))[0]
+
+    def read_ptrs(self, addr, count):
+        return struct.unpack(f"<{count}Q", self.read(addr, 8 * count))
+
+    def read_str(self, addr, size=61):
+        if not addr:
+            return ""
+        data = self.read(addr, size)
+        return data.split(b"\0", 1)[0].decode("utf-8", "replace")
+
+    def read_struct(self, ctype, addr):
+        return ctype.from_buffer_copy(self.read(addr, ct.sizeof(ctype)))
+
+    def maps(self):
+        if self._maps is None:
+            self._maps = []
+            with open(f"/proc/{self.pid}/maps") as f:
+                for line in f:
+                    parts = line.split(None, 5)
+                    if len(parts) < 6 or not parts[5].startswith("/"):
+                        continue
+                    start, end = [int(x, 16) for x in parts[0].split("-")]
+                    self._maps.append(
+                        (start, end, int(parts[2], 16), parts[5].strip())
+                    )
+        return self._maps
+
+    def path(self, path):
+        # Host-visible path of a file mapped by the IOC.
+        return self.root + path
+
+    def elf_address(self, addr):
+        """Translate a runtime address to (path, ELF virtual address)."""
+        for start, end, offset, path in self.maps():
+            if start <= addr < end:
+                file_off = addr - start + offset
+                vaddr = self._file_offset_to_vaddr(self.path(path), file_off)
+                if vaddr is None:
+                    return None
+                return (self.path(path), vaddr)
+        return None
+
+    def symbol_address(self, path, name):
+        """Runtime address of an exported data or function symbol of path."""
+        elf = _read_elf(path)
+        if elf is None or name not in elf["dynsym"]:
+            return None
+        vaddr = elf["dynsym"][name]
+        if elf["type"] != ET_DYN:
+            return vaddr
+
+        # Shared objects are mapped at a bias from their first PT_LOAD.
+        first = min(p[1] - p[0] for p in elf["loads"] if p[0] == 0)
+        for start, _, offset, mpath in self.maps():
+            if self.path(mpath) == path and offset == 0:
+                return start - first + vaddr
+        return None
+
+    def _file_offset_to_vaddr(self, path, file_off):
+        elf = _read_elf(path)
+        if elf is None:
+            return None
+        for p_offset, p_vaddr, p_filesz in elf["loads"]:
+            if p_offset <= file_off < p_offset + p_filesz:
+                return file_off - p_offset + p_vaddr
+        return None
+
+
+_elf_cache = {}
+
+
+def _read_elf(path):
+    # Just enough of a 64-bit little-endian ELF reader for the loader:
+    # PT_LOAD segments and the dynamic symbol table.
+    if path in _elf_cache:
+        return _elf_cache[path]
+
+    with open(path, "rb") as f:
+        data = f.read()
+
+    if data[:4] != ELF_MAGIC or data[4] != 2:
+        _elf_cache[path] = None
+        return None
+
+    (e_type,) = struct.unpack_from("<H", data, 16)
+    e_phoff, e_shoff = struct.unpack_from("<QQ", data, 32)
+    e_phentsize, e_phnum, e_shentsize, e_shnum = struct.unpack_from(
+        "<HHHH", data, 54
+    )
+
+    loads = []
+    for i in range(e_phnum):
+        p_type, _, p_offset, p_vaddr, _, p_filesz = struct.unpack_from(
+            "<IIQQQQ", data, e_phoff + i * e_phentsize
+        )
+        if p_type == PT_LOAD:
+            loads.append((p_offset, p_vaddr, p_filesz))
+
+    sections = []
+    for i in range(e_shnum):
+        sh = struct.unpack_from("<IIQQQQIIQQ", data, e_shoff + i * e_shentsize)
+        sections.append(sh)
+
+    dynsym = {}
+    for sh_name, sh_type, _, _, sh_offset, sh_size, sh_link, _, _, sh_entsize in sections:
+        if sh_type != SHT_DYNSYM or not sh_entsize:
+            continue
+        strtab = sections[sh_link][4]
+        for off in range(sh_offset, sh_offset + sh_size, sh_entsize):
+            st_name, _, _, st_shndx, st_value, _ = struct.unpack_from(
+                "<IBBHQQ", data, off
+            )
+            if not st_value or not st_shndx:
+                continue
+            end = data.index(b"\0", strtab + st_name)
+            dynsym[data[strtab + st_name : end].decode("utf-8", "replace")] = st_value
+
+    elf = {"type": e_type, "loads": loads, "dynsym": dynsym}
+    _elf_cache[path] = elf
+    return elf
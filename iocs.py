@@ -0,0 +1,358 @@
+from __future__ import print_function
+import collections
+import ctypes as ct
+import json
+import os
+import re
+
+from opentelemetry.sdk.resources import SERVICE_NAME, Resource
+
+
+SAMPLE_ALL = 0xFFFFFFFF
+# Scans between rechecks of the processes without a traced library
+RECHECK_SCANS = 12
+DEFAULT_SERVICE = "{ioc}/{service}"
+TRACE_DECISIONS = 65536  # traces whose include/exclude decision is kept
+HELD_TRACES = 4096  # undecided traces whose spans are held
+CONTAINER_ID = re.compile(r"([0-9a-f]{64})")
+
+
+def _file_id(path):
+    st = os.stat(path)
+    return (st.st_dev, st.st_ino)
+
+
+def _mapped_paths(pid):
+    paths = set()
+    with open(f"/proc/{pid}/maps") as f:
+        for line in f:
+            parts = line.split(None, 5)
+            if len(parts) == 6 and parts[5].startswith("/"):
+                paths.add(parts[5].strip())
+    return paths
+
+
+def mapped_lib(pid, pattern):
+    """Host path of the first library of pid whose file name matches the
+    regular expression, or None."""
+    for path in sorted(_mapped_paths(pid)):
+        if re.search(pattern, os.path.basename(path)):
+            return f"/proc/{pid}/root{path}"
+    return None
+
+
+def ioc_name(pid):
+    """$IOC or $IOCNAME of the process, else its working directory
+    (iocBoot/<ioc>), else its command name."""
+    try:
+        with open(f"/proc/{pid}/environ", "rb") as f:
+            env = dict(
+                kv.split(b"=", 1) for kv in f.read().split(b"\0") if b"=" in kv
+            )
+        for name in (b"IOC", b"IOCNAME"):
+            if env.get(name):
+                return env[name].decode("utf-8", "replace")
+    except OSError:
+        pass
+    try:
+        cwd = os.path.basename(os.readlink(f"/proc/{pid}/cwd"))
+        if cwd and cwd != "/":
+            return cwd
+    except OSError:
+        pass
+    try:
+        with open(f"/proc/{pid}/comm") as f:
+            return f.read().strip()
+    except OSError:
+        return str(pid)
+
+
+def container_id(pid):
+    """Docker/containerd/podman id from the cgroup path of the process."""
+    try:
+        with open(f"/proc/{pid}/cgroup") as f:
+            for line in f:
+                m = CONTAINER_ID.search(line)
+                if m:
+                    return m.group(1)
+    except OSError:
+        pass
+    return None
+
+
+def _held(arg):
+    """A copy of the ctypes events in arg: the ring buffer reuses them."""
+    if isinstance(arg, ct.Structure):
+        return type(arg).from_buffer_copy(arg)
+    if isinstance(arg, list):
+        return [_held(a) for a in arg]
+    return arg
+
+
+def ns_tgid(pid):
+    """Process id in the innermost PID namespace (NSpid of the status)."""
+    try:
+        with open(f"/proc/{pid}/status") as f:
+            for line in f:
+                if line.startswith("NSpid:"):
+                    return int(line.split()[-1])
+    except (OSError, ValueError):
+        pass
+    return pid
+
+
+class Lib(object):
+    """A libdbCore build, attached through `path`. Discovered builds are
+    held open so they can be detached once their container is gone."""
+
+    def __init__(self, path, fd=None):
+        self.path = path
+        self.fd = fd
+        self.tgids = set()
+
+
+class Ioc(object):
+    def __init__(self, tgid, name, lib, path, rule):
+        self.tgid = tgid
+        self.name = name
+        self.lib = lib
+        # The library as the IOC sees it, and its root from the host
+        self.path = path
+        self.root = ""
+        self.container = None
+        self.ns_tgid = tgid
+        self.service = rule.get("service", DEFAULT_SERVICE)
+        self.sample = float(rule.get("sample", 1.0))
+        self.include = re.compile(rule["include"]) if rule.get("include") else None
+        self.exclude = re.compile(rule["exclude"]) if rule.get("exclude") else None
+
+    def allows(self, pvname):
+        if self.include and not self.include.match(pvname):
+            return False
+        return not (self.exclude and self.exclude.match(pvname))
+
+
+class IocRegistry(object):
+    """The IOC processes that map one of the traced libdbCore builds.
+
+    Each IOC is named from its environment and gets the first rule of the
+    JSON config whose "match" regular expression matches the name:
+
+        [{"match": "cm[0-9]+", "service": "{ioc}/{service}",
+          "sample": 0.1, "include": "CM.*", "exclude": ".*:HEARTBEAT"}]
+
+    "sample" is the share of traces kept, decided in the kernel at the root
+    of each trace; "include"/"exclude" filter whole traces in the collector,
+    by the name of their top-level record (see decide()).
+
+    With `discover` (a regular expression on library file names) the
+    libraries mapped by any process are also considered, resolved through
+    /proc/<pid>/root so those of containers are found too, and given to
+    `attach`; `detach` is called when the last process using one exits.
+    Without them (adopting the probes of a holder) they are only named."""
+
+    def __init__(self, bpf, libpaths, config=None, discover=None, attach=None, detach=None):
+        self.bpf = bpf
+        self.libs = {_file_id(p): Lib(p) for p in libpaths}
+        self.names = {os.path.basename(p) for p in libpaths}
+        self.discover = re.compile(discover) if discover else None
+        self.attach = attach
+        self.detach = detach
+        self.mnt_ns = os.readlink("/proc/self/ns/mnt")
+        self.rules = []
+        if config:
+            with open(config) as f:
+                self.rules = json.load(f)
+        self.iocs = {}
+        self.resources = {}
+        self.threads = {}
+        self.traces = collections.OrderedDict()  # trace id -> allowed
+        self.held = collections.OrderedDict()  # trace id -> [(fn, args)]
+        self.others = set()
+        self.rejected = set()  # file ids of libraries the probes failed on
+        self.scans = 0
+
+    def _rule(self, name):
+        for rule in self.rules:
+            if re.fullmatch(rule.get("match", ".*"), name):
+                return rule
+        return {}
+
+    def _lib(self, pid):
+        """(Lib, path in the process) of the traced library pid maps."""
+        for path in _mapped_paths(pid):
+            name = os.path.basename(path)
+            if name not in self.names and not (self.discover and self.discover.search(name)):
+                continue
+            host_path = f"/proc/{pid}/root{path}"
+            try:
+                file_id = _file_id(host_path)
+            except OSError:
+                continue
+            if file_id in self.rejected:
+                continue
+            lib = self.libs.get(file_id)
+            if lib is None and self.discover:
+                # /proc/<our pid>/fd/<n> stays valid after the container is gone
+                fd = os.open(host_path, os.O_RDONLY)
+                lib = Lib(f"/proc/{os.getpid()}/fd/{fd}", fd)
+                if self.attach:
+                    print(f"attach {path} of {pid}")
+                    try:
+                        self.attach(lib.path)
+                    except Exception as e:
+                        # BCC raises Exception for a missing symbol: not a
+                        # libdbCore the probes fit, never retried
+                        print(f"cannot attach {path} of {pid}: {e}")
+                        if self.detach:
+                            self.detach(lib.path)
+                        os.close(fd)
+                        self.rejected.add(file_id)
+                        continue
+                self.libs[file_id] = lib
+            if lib:
+                return lib, path
+        return None, None
+
+    def _add(self, tgid):
+        try:
+            lib, path = self._lib(tgid)
+        except OSError:
+            return None
+        if lib is None:
+            self.others.add(tgid)
+            return None
+
+        name = ioc_name(tgid)
+        ioc = self.iocs[tgid] = Ioc(tgid, name, lib, path, self._rule(name))
+        lib.tgids.add(tgid)
+        try:
+            if os.readlink(f"/proc/{tgid}/ns/mnt") != self.mnt_ns:
+                ioc.root = f"/proc/{tgid}/root"
+        except OSError:
+            pass
+        ioc.container = container_id(tgid)
+        ioc.ns_tgid = ns_tgid(tgid)
+
+        table = self.bpf["ioc_sample"]
+        if ioc.sample < 1.0:
+            table[table.Key(tgid)] = table.Leaf(int(max(ioc.sample, 0.0) * SAMPLE_ALL))
+        where = f" container {ioc.container[:12]} pid {ioc.ns_tgid}" if ioc.container else ""
+        print(f"IOC {name} ({tgid}){where} {path} sample={ioc.sample:g}")
+        return ioc
+
+    def _remove(self, tgid):
+        ioc = self.iocs.pop(tgid)
+        table = self.bpf["ioc_sample"]
+        try:
+            del table[table.Key(tgid)]
+        except KeyError:
+            pass
+        print(f"IOC {ioc.name} ({tgid}) exited")
+        self.resources = {k: v for k, v in self.resources.items() if k[1] != tgid}
+
+        lib = ioc.lib
+        lib.tgids.discard(tgid)
+        if lib.fd is not None and not lib.tgids:
+            if self.detach:
+                print(f"detach {ioc.path}")
+                self.detach(lib.path)
+            os.close(lib.fd)
+            self.libs = {k: v for k, v in self.libs.items() if v is not lib}
+
+    def scan(self):
+        """Pick up started IOCs and forget the exited ones."""
+        self.scans += 1
+        if self.scans % RECHECK_SCANS == 0:
+            # Forget exited processes, and recheck the ones that were
+            # scanned before the dynamic loader mapped their libraries
+            self.others = set()
+
+        seen = set()
+        for entry in os.listdir("/proc"):
+            if not entry.isdigit():
+                continue
+            tgid = int(entry)
+            if tgid in self.others:
+                continue
+            if tgid in self.iocs or self._add(tgid):
+                seen.add(tgid)
+
+        for tgid in [t for t in self.iocs if t not in seen]:
+            self._remove(tgid)
+        self.threads = {}
+
+    def get(self, tgid):
+        ioc = self.iocs.get(tgid)
+        if ioc is None and tgid and tgid not in self.others:
+            # Started since the last scan
+            ioc = self._add(tgid)
+        return ioc
+
+    def decide(self, tgid, pvname, tid):
+        """Whether the spans of trace `tid` are exported, decided by its
+        top-level record: the enter of the dbProcess at depth 1, or the put
+        starting the trace, whichever comes first. The spans held for the
+        trace by export() are then exported or dropped."""
+        allowed = self.traces.get(tid)
+        if allowed is not None:
+            return allowed
+        ioc = self.get(tgid)
+        allowed = ioc is None or ioc.allows(pvname)
+        self.traces[tid] = allowed
+        if len(self.traces) > TRACE_DECISIONS:
+            self.traces.popitem(last=False)
+        for fn, args in self.held.pop(tid, ()):
+            if allowed:
+                fn(*args)
+        return allowed
+
+    def export(self, tgid, tid, fn, *args):
+        """Call fn(*args), the export of a span of trace `tid`, once the
+        trace is decided. Spans reach the collector before the top-level
+        record: on other rings, and with --changed-only the enters are sent
+        with the exits, innermost first. They are held until decide(), at
+        most HELD_TRACES traces, the oldest dropped."""
+        ioc = self.get(tgid)
+        if ioc is None or not (ioc.include or ioc.exclude) or not tid:
+            fn(*args)
+            return
+        allowed = self.traces.get(tid)
+        if allowed is None:
+            self.held.setdefault(tid, []).append((fn, [_held(a) for a in args]))
+            if len(self.held) > HELD_TRACES:
+                self.held.popitem(last=False)
+        elif allowed:
+            fn(*args)
+
+    def trace_allowed(self, tid):
+        """decide() of a trace so far, for spans exported right away."""
+        return self.traces.get(tid, True)
+
+    def ns_pid(self, tid):
+        """Thread id in the PID namespace of the thread, from ns_pid_hash."""
+        pid = self.threads.get(tid)
+        if pid is None:
+            table = self.bpf["ns_pid_hash"]
+            try:
+                pid = table[table.Key(tid)].pid
+            except KeyError:
+                pid = tid
+            self.threads[tid] = pid
+        return pid
+
+    def resource(self, owner, tgid):
+        """The resource of the spans of owner (a XxxTracer) for the IOC."""
+        ioc = self.get(tgid)
+        if ioc is None:
+            return owner.resource
+        service = ioc.service.format(ioc=ioc.name, service=owner.service_name)
+        key = (service, tgid if ioc.container else 0)
+        resource = self.resources.get(key)
+        if resource is None:
+            attributes = {SERVICE_NAME: service, "ioc.name": ioc.name}
+            if ioc.container:
+                attributes["container.id"] = ioc.container
+                attributes["process.pid"] = ioc.ns_tgid
+            resource = self.resources[key] = Resource(attributes=attributes)
+        return resource
@@ -0,0 +1,181 @@
+from __future__ import print_function
+import ctypes as ct
+import time
+
+
+from opentelemetry.sdk.resources import SERVICE_NAME, Resource
+
+
+from metrics import escape
+from pvvalue import decode_value, VAL_TYPE_NULL
+from scanjitter import percentile
+from spanids import scope, start_span
+
+# The structure is defined manually in this program.
+# BCC can cast the automatically, but double is not supported.
+# https://github.com/iovisor/bcc/pull/2198
+
+BOOT_TIME_NS = int((time.time() - time.monotonic()) * 1e9)
+
+MAX_STRING_SIZE = 40  # epicsStructure.h
+SAMPLE_ALL = 0xFFFFFFFF  # proctrace.c
+LATENCY_SLOTS = 64
+LINK_DIRS = ["get", "put"]  # enum link_dir of proctrace.c
+# Link types of epicsStructure.h
+LINK_TYPES = {
+    0: "CONSTANT",
+    1: "PV_LINK",
+    7: "MACRO_LINK",
+    8: "JSON_LINK",
+    9: "PN_LINK",
+    10: "DB_LINK",
+    11: "CA_LINK",
+}
+
+
+class Data_link(ct.Structure):
+    _fields_ = [
+        ("ktime_ns", ct.c_ulonglong),
+        ("ktime_ns_end", ct.c_ulonglong),
+        ("pvname", ct.c_char * 61),
+        ("target", ct.c_char * 100),
+        ("dir", ct.c_uint),
+        ("link_type", ct.c_int),
+        ("dbr_type", ct.c_int),
+        ("status", ct.c_longlong),
+        ("ptid", ct.c_ulonglong),
+        ("psid", ct.c_ulonglong),
+        ("tid", ct.c_ulonglong),
+        ("sid", ct.c_ulonglong),
+        ("val_type", ct.c_uint),
+        ("val_i", ct.c_longlong),
+        ("val_u", ct.c_ulonglong),
+        ("val_d", ct.c_double),
+        ("val_s", ct.c_char * MAX_STRING_SIZE),
+        ("tgid", ct.c_uint),
+        ("sample", ct.c_uint),
+    ]
+
+
+def link_type(value):
+    return LINK_TYPES.get(value, str(value))
+
+
+class LinkTracer(object):
+    """dbGetLink and dbPutLink of the records in dbProcess, as child spans
+    of the record, and the latency of every link counted in the kernel."""
+
+    def __init__(self, servie_name, processor, bpf, top=20):
+        self.bpf = bpf
+        self.top = top
+        self.processor = processor
+        self.resource = Resource(attributes={SERVICE_NAME: servie_name})
+        self.scope = scope("tracer.link")
+        self.service_name = servie_name
+        self.iocs = None
+
+    def callback(self, cpu, data, size):
+        event = ct.cast(data, ct.POINTER(Data_link)).contents
+        if self.iocs:
+            self.iocs.export(event.tgid, event.tid, self.export, event)
+        else:
+            self.export(event)
+
+    def export(self, event):
+        pvname = event.pvname.decode("utf-8", "replace")
+        target = event.target.decode("utf-8", "replace")
+        resource = self.resource
+        if self.iocs:
+            resource = self.iocs.resource(self, event.tgid)
+
+        direction = LINK_DIRS[event.dir] if event.dir < len(LINK_DIRS) else str(event.dir)
+        span_name = f"{pvname} {direction} {target}"
+        val = None
+        if event.val_type and event.val_type != VAL_TYPE_NULL:
+            val = decode_value(event)
+            span_name += f" ({val})"
+        span = start_span(
+            span_name,
+            self.processor,
+            resource,
+            self.scope,
+            event.ktime_ns + BOOT_TIME_NS,
+            event.tid,
+            event.sid,
+            event.ptid,
+            event.psid,
+        )
+        span.set_attribute("pv.name", pvname)
+        span.set_attribute("link.direction", direction)
+        span.set_attribute("link.type", link_type(event.link_type))
+        span.set_attribute("link.target", target)
+        span.set_attribute("link.dbr_type", event.dbr_type)
+        if val is not None:
+            span.set_attribute("link.value", val)
+        if event.status:
+            span.set_attribute("link.status", event.status)
+        if event.sample != SAMPLE_ALL:
+            span.set_attribute("sampling.ratio", event.sample / SAMPLE_ALL)
+        span.end(event.ktime_ns_end + BOOT_TIME_NS)
+
+    def rows(self):
+        """[(link_key, link_stat, latency buckets)] by time in the link."""
+        buckets = {}
+        for key, n in self.bpf["link_latency"].items():
+            slots = buckets.setdefault((key.tgid, key.dir, key.plink), [0] * LATENCY_SLOTS)
+            if key.slot < LATENCY_SLOTS:
+                slots[key.slot] += n.value
+        rows = [
+            (key, st, buckets.get((key.tgid, key.dir, key.plink), [0] * LATENCY_SLOTS))
+            for key, st in self.bpf["link_stats"].items()
+        ]
+        rows.sort(key=lambda r: r[1].ns, reverse=True)
+        return rows
+
+    def report(self):
+        """Print the links with the most time spent in them."""
+        print(
+            f"{'PID':>7} {'PV':<30} {'DIR':<3} {'TYPE':<8} {'TARGET':<36} {'CALLS':>9} "
+            f"{'AVG_US':>8} {'P99_US':>8} {'MAX_US':>9} {'ERRORS':>6}"
+        )
+        for key, st, slots in self.rows()[: self.top]:
+            p99 = percentile(slots, 99)
+            print(
+                f"{key.tgid:>7} {st.pvname.decode('utf-8', 'replace'):<30} "
+                f"{LINK_DIRS[key.dir] if key.dir < len(LINK_DIRS) else key.dir:<3} "
+                f"{link_type(st.link_type):<8} {st.target.decode('utf-8', 'replace'):<36} "
+                f"{st.count:>9} {st.ns / st.count / 1e3 if st.count else 0:>8.1f} "
+                f"{p99 / 1e3 if p99 else 0:>8.1f} {st.max_ns / 1e3:>9.1f} {st.errors:>6}"
+            )
+
+    def gauges(self, metrics):
+        def rows(fn):
+            def collect():
+                out = []
+                for key, st, slots in self.rows()[: self.top]:
+                    ioc = self.iocs.iocs.get(key.tgid) if self.iocs else None
+                    labels = (
+                        f'ioc="{escape(ioc.name if ioc else str(key.tgid))}",'
+                        f'pv="{escape(st.pvname.decode("utf-8", "replace"))}",'
+                        f'direction="{LINK_DIRS[key.dir] if key.dir < len(LINK_DIRS) else key.dir}",'
+                        f'target="{escape(st.target.decode("utf-8", "replace"))}"'
+                    )
+                    out.append((labels, fn(st, slots)))
+                return out
+
+            return collect
+
+        def p99(st, slots):
+            q = percentile(slots, 99)
+            return q / 1e9 if q else None
+
+        metrics.gauge("epics_link_calls_total", "dbGetLink/dbPutLink calls.", rows(lambda st, _: st.count))
+        metrics.gauge(
+            "epics_link_seconds_total", "Time in dbGetLink/dbPutLink.", rows(lambda st, _: st.ns / 1e9)
+        )
+        metrics.gauge(
+            "epics_link_p99_seconds",
+            "Upper bound of the 99th percentile of the link latency.",
+            rows(p99),
+        )
+        metrics.gauge("epics_link_errors_total", "Link calls returning an error.", rows(lambda st, _: st.errors))
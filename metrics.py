@@ -0,0 +1,216 @@
+from __future__ import print_function
+import bisect
+import re
+import threading
+import time
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+
+
+# Index of the rings in ring_drops (enum ring_id of proctrace.c)
+RING_NAMES = [
+    "ring_buf",
+    "ring_buf_put",
+    "ring_buf_caput",
+    "ring_buf_support",
+    "ring_buf_post",
+    "ring_buf_stall",
+    "ring_buf_array",
+    "ring_buf_link",
+]
+
+# Upper bounds of the latency buckets (ns): powers of two from 1 us to ~1 s
+# per record type, decades from 10 us to 1 s per record to keep the scrape
+# of many records small
+RTYPE_BUCKETS = [1000 << i for i in range(21)]
+RECORD_BUCKETS = [10**i for i in range(4, 10)]
+
+OTHER = "__other__"
+CONTENT_TYPE = "application/openmetrics-text; version=1.0.0; charset=utf-8"
+
+
+class Histogram(object):
+    __slots__ = ("bounds", "buckets", "sum_ns")
+
+    def __init__(self, bounds):
+        self.bounds = bounds
+        self.buckets = [0] * (len(bounds) + 1)
+        self.sum_ns = 0
+
+    def observe(self, ns):
+        self.buckets[bisect.bisect_left(self.bounds, ns)] += 1
+        self.sum_ns += ns
+
+    def labels(self):
+        # repr, not :g, which rounds to 6 digits (2**20 ns would be 0.00104858)
+        return [repr(b / 1e9) for b in self.bounds] + ["+Inf"]
+
+
+def escape(value):
+    return value.replace("\\", "\\\\").replace('"', '\\"').replace("\n", "\\n")
+
+
+def queue_depth(processor):
+    """Spans waiting in a BatchSpanProcessor, if the SDK lets us see them."""
+    inner = getattr(processor, "_batch_processor", processor)
+    for name in ("_queue", "queue"):
+        queue = getattr(inner, name, None)
+        if queue is not None:
+            return len(queue)
+    return None
+
+
+class Metrics(object):
+    """Per-record and per-record-type counters and latency histograms, fed
+    from the tracer callbacks with a dict lookup and a list increment.
+
+    At most `max_pvs` PV names (matching `pv_regex`, if given) get their own
+    label; the others are counted under pv="__other__"."""
+
+    def __init__(self, max_pvs=1000, pv_regex=None, min_interval=1.0):
+        self.max_pvs = max_pvs
+        self.pv_regex = re.compile(pv_regex) if pv_regex else None
+        self.min_interval = min_interval
+
+        self.records = {}  # pv -> [rtype, Histogram]
+        self.rtypes = {}  # rtype -> Histogram
+        self.puts = {}
+        self.caputs = {}
+        self.labels = set()
+        self.gauges = []  # (name, help, function returning [(labels, value)])
+        self.histograms = []  # (name, help, function returning [(labels, Histogram)])
+
+        self.lock = threading.Lock()
+        self.cache = b""
+        self.cache_time = 0
+
+    def _label(self, pv):
+        if pv in self.labels:
+            return pv
+        if len(self.labels) >= self.max_pvs:
+            return OTHER
+        if self.pv_regex and not self.pv_regex.match(pv):
+            return OTHER
+        self.labels.add(pv)
+        return pv
+
+    def process(self, pv, rtype, duration_ns):
+        entry = self.records.get(pv)
+        if entry is None:
+            label = self._label(pv)
+            entry = self.records.get(label)
+            if entry is None:
+                entry = self.records[label] = [
+                    rtype if label != OTHER else "",
+                    Histogram(RECORD_BUCKETS),
+                ]
+        entry[1].observe(duration_ns)
+
+        hist = self.rtypes.get(rtype)
+        if hist is None:
+            hist = self.rtypes[rtype] = Histogram(RTYPE_BUCKETS)
+        hist.observe(duration_ns)
+
+    def put(self, pv):
+        label = pv if pv in self.labels else self._label(pv)
+        self.puts[label] = self.puts.get(label, 0) + 1
+
+    def caput(self, pv):
+        label = pv if pv in self.labels else self._label(pv)
+        self.caputs[label] = self.caputs.get(label, 0) + 1
+
+    def gauge(self, name, help, fn):
+        self.gauges.append((name, help, fn))
+
+    def histogram(self, name, help, fn):
+        self.histograms.append((name, help, fn))
+
+    def _histogram(self, out, name, help, rows):
+        out.append(f"# TYPE {name} histogram")
+        out.append(f"# UNIT {name} seconds")
+        out.append(f"# HELP {name} {help}")
+        les = None
+        for labels, hist in rows:
+            les = les or hist.labels()
+            buckets = list(hist.buckets)
+            total = 0
+            for le, n in zip(les, buckets):
+                total += n
+                out.append(f'{name}_bucket{{{labels},le="{le}"}} {total}')
+            out.append(f"{name}_count{{{labels}}} {total}")
+            out.append(f"{name}_sum{{{labels}}} {hist.sum_ns / 1e9}")
+
+    def _counter(self, out, name, help, label, counts):
+        out.append(f"# TYPE {name} counter")
+        out.append(f"# HELP {name} {help}")
+        for key, n in counts:
+            out.append(f'{name}_total{{{label}="{escape(key)}"}} {n}')
+
+    def render(self):
+        """OpenMetrics text, rendered at most every min_interval seconds.
+
+        Runs in the HTTP thread. The tables are only copied (list() of a
+        dict is atomic under the GIL), the callbacks never wait for it."""
+        with self.lock:
+            now = time.monotonic()
+            if self.cache and now - self.cache_time < self.min_interval:
+                return self.cache
+
+            out = []
+            records = list(self.records.items())
+            self._histogram(
+                out,
+                "epics_record_process_seconds",
+                "dbProcess duration per record.",
+                ((f'pv="{escape(pv)}",rtype="{escape(e[0])}"', e[1]) for pv, e in records),
+            )
+            self._histogram(
+                out,
+                "epics_rtype_process_seconds",
+                "dbProcess duration per record type.",
+                ((f'rtype="{escape(t)}"', h) for t, h in list(self.rtypes.items())),
+            )
+            for name, help, fn in self.histograms:
+                self._histogram(out, name, help, fn())
+            self._counter(out, "epics_put", "dbPutField calls.", "pv", list(self.puts.items()))
+            self._counter(
+                out, "epics_caput", "dbCaPutLinkCallback calls.", "pv", list(self.caputs.items())
+            )
+            for name, help, fn in self.gauges:
+                kind = "counter" if name.endswith("_total") else "gauge"
+                base = name[: -len("_total")] if kind == "counter" else name
+                out.append(f"# TYPE {base} {kind}")
+                out.append(f"# HELP {base} {help}")
+                for labels, value in fn():
+                    if value is not None:
+                        out.append(f"{name}{{{labels}}} {value}" if labels else f"{name} {value}")
+            out.append("# EOF\n")
+
+            self.cache = "\n".join(out).encode("utf-8")
+            self.cache_time = now
+            return self.cache
+
+
+class Handler(BaseHTTPRequestHandler):
+    metrics = None
+
+    def do_GET(self):
+        if self.path.split("?", 1)[0] != "/metrics":
+            self.send_error(404)
+            return
+        data = self.metrics.render()
+        self.send_response(200)
+        self.send_header("Content-Type", CONTENT_TYPE)
+        self.send_header("Content-Length", str(len(data)))
+        self.end_headers()
+        self.wfile.write(data)
+
+    def log_message(self, format, *args):
+        pass
+
+
+def serve(metrics, listen):
+    handler = type("MetricsHandler", (Handler,), {"metrics": metrics})
+    host, port = listen.rsplit(":", 1)
+    server = ThreadingHTTPServer((host, int(port)), handler)
+    threading.Thread(target=server.serve_forever, daemon=True).start()
+    return server
@@ -0,0 +1,132 @@
+from __future__ import print_function
+import ctypes as ct
+import json
+import os
+import platform
+import re
+
+from bcc import BPF
+
+import spanids
+
+
+PIN_DIR = "/sys/fs/bpf/proctrace"
+MANIFEST = "manifest.json"
+
+BPF_OBJ_PIN = 6
+BPF_OBJ_GET = 7
+SYS_BPF = {"x86_64": 321, "aarch64": 280, "ppc64le": 361, "s390x": 351}
+
+# Map declarations of proctrace.c: BPF_HASH(name, ...), BPF_TABLE("type", k, v, name, ...)
+MAP_DECL = re.compile(
+    r'^BPF_(?:HASH|ARRAY|PERCPU_ARRAY|HISTOGRAM|RINGBUF_OUTPUT|STACK_TRACE)\((\w+)'
+    r'|^BPF_TABLE\("\w+", [^,]+, [^,]+, (\w+)',
+    re.M,
+)
+
+_libc = ct.CDLL(None, use_errno=True)
+
+
+class _ObjAttr(ct.Structure):
+    # union bpf_attr for BPF_OBJ_PIN/BPF_OBJ_GET
+    _fields_ = [
+        ("pathname", ct.c_uint64),
+        ("bpf_fd", ct.c_uint32),
+        ("file_flags", ct.c_uint32),
+    ]
+
+
+def _bpf(cmd, path, fd=0):
+    path = path.encode()
+    attr = _ObjAttr(ct.cast(ct.c_char_p(path), ct.c_void_p).value, fd, 0)
+    ret = _libc.syscall(SYS_BPF[platform.machine()], cmd, ct.byref(attr), ct.sizeof(attr))
+    if ret < 0:
+        errno = ct.get_errno()
+        raise OSError(errno, os.strerror(errno), path.decode())
+    return ret
+
+
+def obj_pin(fd, path):
+    _bpf(BPF_OBJ_PIN, path, fd)
+
+
+def obj_get(path):
+    return _bpf(BPF_OBJ_GET, path)
+
+
+def map_names(src="proctrace.c"):
+    with open(src) as f:
+        return [a or b for a, b in MAP_DECL.findall(f.read())]
+
+
+def unpin(directory):
+    if not os.path.isdir(directory):
+        return
+    for name in os.listdir(directory):
+        os.unlink(os.path.join(directory, name))
+    os.rmdir(directory)
+
+
+def pin(bpf, directory, cflags, probes, libpaths, discover):
+    """Pin every map and loaded program of bpf under directory, with the
+    manifest a collector needs to adopt them: the cflags, and in probes the
+    options deciding what was attached. The probes stay attached as long as
+    this process holds them."""
+    unpin(directory)
+    os.makedirs(directory)
+    maps = []
+    for name in map_names():
+        try:
+            table = bpf[name]
+        except KeyError:
+            # Compiled out by the cflags
+            continue
+        obj_pin(table.map_fd, os.path.join(directory, name))
+        maps.append(name)
+    progs = []
+    for name, fn in bpf.funcs.items():
+        obj_pin(fn.fd, os.path.join(directory, f"prog_{name}"))
+        progs.append(name)
+
+    manifest = {
+        "pid": os.getpid(),
+        "cflags": cflags,
+        "probes": probes,
+        "libpaths": libpaths,
+        "discover": discover,
+        "maps": maps,
+        "progs": progs,
+        # The salt is in the cflags, the high half of the trace ids here
+        "trace_id_hi": spanids.TRACE_ID_HI,
+    }
+    with open(os.path.join(directory, MANIFEST), "w") as f:
+        json.dump(manifest, f)
+    return manifest
+
+
+def load_manifest(directory):
+    with open(os.path.join(directory, MANIFEST)) as f:
+        manifest = json.load(f)
+    if not os.path.exists(f"/proc/{manifest['pid']}"):
+        print(f"holder {manifest['pid']} is gone: the probes are no longer attached")
+    return manifest
+
+
+def adopt(bpf, directory, manifest):
+    """Point the tables and programs of bpf, compiled with the holder's
+    cflags but not attached, at the pinned ones. The tables keep their
+    types and file descriptor numbers: the pinned map is dup2()ed over the
+    fd of the compiled one, which frees the duplicate and its ring buffer
+    memory (no program of bpf is loaded to hold it) and leaves BCC's own
+    reference to the fd pointing at the pinned map.
+
+    The compilation itself remains: BCC builds its tables from the module
+    it compiles, so adopting takes seconds of clang, not milliseconds."""
+    spanids.TRACE_ID_HI = manifest["trace_id_hi"]
+    for name in manifest["maps"]:
+        fd = obj_get(os.path.join(directory, name))
+        os.dup2(fd, bpf[name].map_fd)
+        os.close(fd)
+    for name in manifest["progs"]:
+        fd = obj_get(os.path.join(directory, f"prog_{name}"))
+        bpf.funcs[name] = BPF.Function(bpf, name, fd)
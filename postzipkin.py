@@ -0,0 +1,98 @@
+from __future__ import print_function
+import ctypes as ct
+import time
+
+
+from opentelemetry.sdk.resources import SERVICE_NAME, Resource
+
+
+from spanids import scope, start_span
+
+# The structure is defined manually in this program.
+# BCC can cast the automatically, but double is not supported.
+# https://github.com/iovisor/bcc/pull/2198
+
+BOOT_TIME_NS = int((time.time() - time.monotonic()) * 1e9)
+
+
+class Data(ct.Structure):
+    _fields_ = [
+        ("ktime_ns", ct.c_ulonglong),
+        ("ktime_ns_end", ct.c_ulonglong),
+        ("pid", ct.c_uint),
+        ("pvname", ct.c_char * 61),
+        ("subscribers", ct.c_uint),
+        ("queued", ct.c_uint),
+        ("bytes", ct.c_ulonglong),
+        ("overflows", ct.c_uint),
+        ("ptid", ct.c_ulonglong),
+        ("psid", ct.c_ulonglong),
+        ("tid", ct.c_ulonglong),
+        ("sid", ct.c_ulonglong),
+    ]
+
+
+class PostTracer(object):
+    def __init__(self, servie_name, processor, stats, top=20):
+        self.stats = stats
+        self.top = top
+        self.processor = processor
+        self.resource = Resource(attributes={SERVICE_NAME: servie_name})
+        self.scope = scope("tracer.post")
+        self.service_name = servie_name
+        self.iocs = None
+
+    def callback(self, cpu, data, size):
+        event = ct.cast(data, ct.POINTER(Data)).contents
+        if self.iocs:
+            self.iocs.export(event.pid, event.tid, self.export, event)
+        else:
+            self.export(event)
+
+    def export(self, event):
+        resource = self.resource
+        if self.iocs:
+            resource = self.iocs.resource(self, event.pid)
+
+        pvname = event.pvname.decode("utf-8")
+        span_name = f"{pvname} post ({event.queued}/{event.subscribers})"
+        span = start_span(
+            span_name,
+            self.processor,
+            resource,
+            self.scope,
+            event.ktime_ns + BOOT_TIME_NS,
+            event.tid,
+            event.sid,
+            event.ptid,
+            event.psid,
+        )
+        span.set_attribute("pv.name", pvname)
+        span.set_attribute("post.subscribers", event.subscribers)
+        span.set_attribute("post.queued", event.queued)
+        span.set_attribute("post.bytes", event.bytes)
+        span.set_attribute("post.overflows", event.overflows)
+        span.end(event.ktime_ns_end + BOOT_TIME_NS)
+
+    def report(self):
+        """Print the PVs with the most time spent in db_post_events."""
+        rows = []
+        for key, st in self.stats.items():
+            if st.posts == 0 and st.delivered == 0:
+                continue
+            rows.append((key.tgid, key.name.decode("utf-8", "replace"), st))
+        rows.sort(key=lambda r: r[2].post_ns, reverse=True)
+
+        print(
+            f"{'PID':>7} {'PV':<40} {'POSTS':>8} {'POST_US':>9} {'SUBS':>6} {'QUEUED':>8} "
+            f"{'BYTES':>10} {'OVERFLOW':>8} {'LAT_US':>9} {'MAX_US':>9}"
+        )
+        for tgid, pvname, st in rows[: self.top]:
+            post_us = st.post_ns / st.posts / 1e3 if st.posts else 0
+            subs = st.subscribers / st.posts if st.posts else 0
+            lat_us = st.latency_ns / st.delivered / 1e3 if st.delivered else 0
+            print(
+                f"{tgid:>7} {pvname:<40} {st.posts:>8} {post_us:>9.1f} {subs:>6.0f} "
+                f"{st.queued:>8} {st.bytes:>10} {st.overflows:>8} "
+                f"{lat_us:>9.1f} {st.latency_max_ns / 1e3:>9.1f}"
+            )
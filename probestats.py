@@ -0,0 +1,223 @@
+from __future__ import print_function
+import atexit
+import ctypes as ct
+import os
+import platform
+
+from pinned import SYS_BPF
+
+
+# Index of the handlers in probe_stats (enum probe_id of proctrace.c)
+PROBE_NAMES = [
+    "enter_dbput",
+    "exit_dbput",
+    "enter_process",
+    "exit_process",
+    "enter_createrec",
+    "exit_createrec",
+    "enter_dbfirstrecord",
+    "exit_dbfirstrecord",
+    "enter_caput",
+    "exit_caput",
+    "sample_process",
+    "enter_support",
+    "exit_support",
+    "enter_post",
+    "exit_post",
+    "enter_queue_log",
+    "exit_queue_log",
+    "enter_delete_log",
+    "sched_switch",
+    "enter_scan_once",
+    "enter_malloc",
+    "enter_calloc",
+    "enter_realloc",
+    "enter_free",
+    "enter_freelist_malloc",
+    "enter_freelist_free",
+    "exit_alloc",
+    "enter_get_link",
+    "enter_put_link",
+    "exit_link",
+]
+
+# BCC names the program of TRACEPOINT_PROBE after the tracepoint
+PROGRAM_NAMES = {"sched_switch": "tracepoint__sched__sched_switch"}
+
+# Traced IOC call -> (enter handler, exit handler)
+CALLS = [
+    ("dbProcess", "enter_process", "exit_process"),
+    ("dbPutField", "enter_dbput", "exit_dbput"),
+    ("dbCaPutLinkCallback", "enter_caput", "exit_caput"),
+    ("rset/dset routine", "enter_support", "exit_support"),
+    ("db_post_events", "enter_post", "exit_post"),
+    ("db_queue_event_log", "enter_queue_log", "exit_queue_log"),
+    ("db_delete_field_log", "enter_delete_log", None),
+    ("dbCreateRecord", "enter_createrec", "exit_createrec"),
+    ("dbGetRecordName", "enter_dbfirstrecord", "exit_dbfirstrecord"),
+    ("scanOnce", "enter_scan_once", None),
+    ("malloc", "enter_malloc", "exit_alloc"),
+    ("calloc", "enter_calloc", "exit_alloc"),
+    ("realloc", "enter_realloc", "exit_alloc"),
+    ("free", "enter_free", "exit_alloc"),
+    ("freeListMalloc", "enter_freelist_malloc", "exit_alloc"),
+    ("freeListFree", "enter_freelist_free", "exit_alloc"),
+    ("dbGetLink", "enter_get_link", "exit_link"),
+    ("dbPutLink", "enter_put_link", "exit_link"),
+]
+
+BPF_STATS_SYSCTL = "/proc/sys/kernel/bpf_stats_enabled"
+BPF_ENABLE_STATS = 32
+BPF_STATS_RUN_TIME = 0
+COUNTERS = ("read_bytes", "read_errors", "update_errors", "ring_errors")
+
+_libc = ct.CDLL(None, use_errno=True)
+
+
+def enable_bpf_stats():
+    """Turn on the kernel's per-program run count and time.
+
+    bpf(BPF_ENABLE_STATS) keeps them on while the returned fd is open, so
+    the kernel turns them off when the collector exits, however it exits.
+    Before Linux 5.8 the host-wide sysctl is set instead, and restored at
+    exit."""
+    attr = ct.c_uint32(BPF_STATS_RUN_TIME)  # union bpf_attr: enable_stats.type
+    fd = _libc.syscall(
+        SYS_BPF[platform.machine()], BPF_ENABLE_STATS, ct.byref(attr), ct.sizeof(attr)
+    )
+    if fd >= 0:
+        return fd
+
+    with open(BPF_STATS_SYSCTL) as f:
+        previous = f.read().strip()
+    with open(BPF_STATS_SYSCTL, "w") as f:
+        f.write("1")
+    atexit.register(restore_bpf_stats, previous)
+    return None
+
+
+def restore_bpf_stats(previous):
+    with open(BPF_STATS_SYSCTL, "w") as f:
+        f.write(previous)
+
+
+def _fdinfo(fd):
+    info = {}
+    with open(f"/proc/self/fdinfo/{fd}") as f:
+        for line in f:
+            key, _, value = line.partition(":")
+            info[key.strip()] = value.strip()
+    return info
+
+
+def collector_usage():
+    """(CPU seconds, resident bytes) of this process."""
+    times = os.times()
+    rss = 0
+    with open("/proc/self/status") as f:
+        for line in f:
+            if line.startswith("VmRSS:"):
+                rss = int(line.split()[1]) * 1024
+    return times.user + times.system, rss
+
+
+class ProbeStats(object):
+    """Cost of the probes from the kernel's run_cnt/run_time_ns of each BPF
+    program (bpf_stats_enabled) and the per-CPU probe_stats counters."""
+
+    def __init__(self, bpf):
+        self.bpf = bpf
+        self.last = {}
+        self.last_usage = None
+
+    def sample(self):
+        """{handler: {"runs", "ns", read_bytes, ...}} since the start."""
+        table = self.bpf["probe_stats"]
+        stats = {}
+        for i, name in enumerate(PROBE_NAMES):
+            fn = self.bpf.funcs.get(PROGRAM_NAMES.get(name, name))
+            if fn is None:
+                continue
+            info = _fdinfo(fn.fd)
+            row = {"runs": int(info.get("run_cnt", 0)), "ns": int(info.get("run_time_ns", 0))}
+            percpu = table[table.Key(i)]
+            for counter in COUNTERS:
+                row[counter] = sum(getattr(cpu, counter) for cpu in percpu)
+            stats[name] = row
+        return stats
+
+    def gauges(self, metrics):
+        def rows(field, scale=1):
+            return lambda: [
+                (f'probe="{name}"', row[field] / scale if scale != 1 else row[field])
+                for name, row in self.sample().items()
+            ]
+
+        metrics.gauge("proctrace_probe_runs_total", "Handler runs.", rows("runs"))
+        metrics.gauge(
+            "proctrace_probe_seconds_total", "Time spent in the handler.", rows("ns", 1e9)
+        )
+        metrics.gauge(
+            "proctrace_probe_read_bytes_total", "Bytes read from the IOC.", rows("read_bytes")
+        )
+        metrics.gauge(
+            "proctrace_probe_read_errors_total", "Failed reads from the IOC.", rows("read_errors")
+        )
+        metrics.gauge(
+            "proctrace_probe_update_errors_total", "Failed map updates.", rows("update_errors")
+        )
+        metrics.gauge(
+            "proctrace_probe_ring_errors_total", "Events lost on a full ring buffer.",
+            rows("ring_errors"),
+        )
+        metrics.gauge(
+            "proctrace_collector_cpu_seconds_total", "CPU time of the collector.",
+            lambda: [("", collector_usage()[0])],
+        )
+        metrics.gauge(
+            "proctrace_collector_resident_bytes", "Resident memory of the collector.",
+            lambda: [("", collector_usage()[1])],
+        )
+
+    def report(self):
+        """Print the handler costs and the latency added to each traced call
+        since the last report. The uprobe trap itself (about a microsecond
+        per probe) is not included."""
+        now = self.sample()
+        usage = (os.times().elapsed,) + collector_usage()
+        delta = {}
+        for name, row in now.items():
+            last = self.last.get(name, {})
+            delta[name] = {k: v - last.get(k, 0) for k, v in row.items()}
+        self.last = now
+
+        print(
+            f"{'HANDLER':<20} {'RUNS':>10} {'AVG_NS':>8} {'BYTES/RUN':>9} "
+            f"{'READ_ERR':>8} {'UPD_ERR':>8} {'RING_ERR':>8}"
+        )
+        for name in PROBE_NAMES:
+            d = delta.get(name)
+            if not d or not d["runs"]:
+                continue
+            print(
+                f"{name:<20} {d['runs']:>10} {d['ns'] / d['runs']:>8.0f} "
+                f"{d['read_bytes'] / d['runs']:>9.0f} {d['read_errors']:>8} "
+                f"{d['update_errors']:>8} {d['ring_errors']:>8}"
+            )
+
+        print(f"{'CALL':<20} {'CALLS':>10} {'ADDED_NS':>8}")
+        for call, enter, exit in CALLS:
+            e = delta.get(enter)
+            if not e or not e["runs"]:
+                continue
+            added = e["ns"] / e["runs"]
+            x = delta.get(exit) if exit else None
+            if x and x["runs"]:
+                added += x["ns"] / x["runs"]
+            print(f"{call:<20} {e['runs']:>10} {added:>8.0f}")
+
+        if self.last_usage:
+            elapsed = usage[0] - self.last_usage[0]
+            cpu = (usage[1] - self.last_usage[1]) / elapsed * 100 if elapsed else 0
+            print(f"collector cpu {cpu:.1f}% rss {usage[2] / 2**20:.1f} MiB")
+        self.last_usage = usage
@@ -1,20 +1,52 @@
 #include <linux/ptrace.h>
 #include <linux/sched.h>
+#include <uapi/linux/bpf_perf_event.h>
 #include "epicsStructure.h"
 
 #define TASK_COMM_LEN 16
+#define RECTYPE_NAME_LEN 32
+#define STALL_MAX_DEPTH 8
+
+#ifndef STALL_DEFAULT_NS
+#define STALL_DEFAULT_NS 0
+#endif
+
+#ifndef ARRAY_CAPTURE_ELEMS
+#define ARRAY_CAPTURE_ELEMS 256
+#endif
+#ifndef ARRAY_CAPTURE_BYTES
+#define ARRAY_CAPTURE_BYTES 2048
+#endif
+
+// Host, boot and run identity mixed into the ids (spanids.py)
+#ifndef ID_SALT
+#define ID_SALT 0
+#endif
+#define ID_CPU_SHIFT 52
+#define ID_COUNT_MASK ((1ULL << ID_CPU_SHIFT) - 1)
 
 struct otel_context
 {
     __u64 tid;
     __u64 sid;
+    __u32 sample;
+    __u32 sampled;
 };
 
+// Records are per IOC: the same name in two processes is two records
 struct key_t
 {
+    __u32 tgid;
     char name[61];
 };
 
+// Ids of a thread in its own PID namespace (the container of the IOC)
+struct ns_pid
+{
+    __u32 pid;
+    __u32 tgid;
+};
+
 struct create_rec_args
 {
     struct key_t key;
@@ -32,6 +64,50 @@ struct key_proc_pv
     __u32 count;
 };
 
+// Allocator calls made by a record itself (not its nested records)
+struct alloc_stat
+{
+    __u32 calls;
+    __u32 frees;
+    __u32 pool;
+    __u32 pad;
+    __u64 bytes;
+    __u64 ns;
+};
+
+struct proc_frame
+{
+    struct dbCommon *precord;
+    __u64 tid;
+    __u64 sid;
+    __u64 ktime_ns;
+    __u64 deadline_ns;
+    __u32 stalled;
+    __u32 emit_child;
+    __u64 child_ns;
+    struct alloc_stat alloc;
+    __u64 link_sid;
+};
+
+struct support_call
+{
+    __u64 addr;
+    __u64 ktime_ns;
+};
+
+struct event_support
+{
+    __u64 ktime_ns;
+    __u64 ktime_ns_end;
+    __u32 pid;
+    __u64 addr;
+    char pvname[61];
+    __u64 ptid;
+    __u64 psid;
+    __u64 tid;
+    __u64 sid;
+};
+
 struct event_process
 {
     __u32 type;
@@ -52,6 +128,20 @@ struct event_process
     __u64 val_u;
     double val_d;
     char val_s[MAX_STRING_SIZE];
+    __u16 stat;
+    __u16 sevr;
+    __u32 suppressed;
+    char rtype[RECTYPE_NAME_LEN];
+    __u32 tgid;
+    __u32 sample;
+    struct alloc_stat alloc;
+};
+
+struct change_state
+{
+    __u64 hash;
+    __u32 pending;
+    __u64 total;
 };
 
 enum state_type
@@ -67,6 +157,333 @@ enum val_type
     VAL_TYPE_DOUBLE = 3,
     VAL_TYPE_STRING = 4,
     VAL_TYPE_NULL = 5,
+    VAL_TYPE_FLOAT = 6,
+};
+
+enum ring_id
+{
+    RING_PROCESS = 0,
+    RING_PUT = 1,
+    RING_CAPUT = 2,
+    RING_SUPPORT = 3,
+    RING_POST = 4,
+    RING_STALL = 5,
+    RING_ARRAY = 6,
+    RING_LINK = 7,
+    RING_COUNT = 8,
+};
+
+enum probe_id
+{
+    PROBE_ENTER_DBPUT = 0,
+    PROBE_EXIT_DBPUT = 1,
+    PROBE_ENTER_PROCESS = 2,
+    PROBE_EXIT_PROCESS = 3,
+    PROBE_ENTER_CREATEREC = 4,
+    PROBE_EXIT_CREATEREC = 5,
+    PROBE_ENTER_DBFIRSTRECORD = 6,
+    PROBE_EXIT_DBFIRSTRECORD = 7,
+    PROBE_ENTER_CAPUT = 8,
+    PROBE_EXIT_CAPUT = 9,
+    PROBE_SAMPLE_PROCESS = 10,
+    PROBE_ENTER_SUPPORT = 11,
+    PROBE_EXIT_SUPPORT = 12,
+    PROBE_ENTER_POST = 13,
+    PROBE_EXIT_POST = 14,
+    PROBE_ENTER_QUEUE_LOG = 15,
+    PROBE_EXIT_QUEUE_LOG = 16,
+    PROBE_ENTER_DELETE_LOG = 17,
+    PROBE_SCHED_SWITCH = 18,
+    PROBE_ENTER_SCAN_ONCE = 19,
+    PROBE_ENTER_MALLOC = 20,
+    PROBE_ENTER_CALLOC = 21,
+    PROBE_ENTER_REALLOC = 22,
+    PROBE_ENTER_FREE = 23,
+    PROBE_ENTER_FREELIST_MALLOC = 24,
+    PROBE_ENTER_FREELIST_FREE = 25,
+    PROBE_EXIT_ALLOC = 26,
+    PROBE_ENTER_GET_LINK = 27,
+    PROBE_ENTER_PUT_LINK = 28,
+    PROBE_EXIT_LINK = 29,
+    PROBE_COUNT = 30,
+};
+
+// Counted per handler with --stats; run counts and times are the kernel's
+struct probe_stat
+{
+    __u64 read_bytes;
+    __u64 read_errors;
+    __u64 update_errors;
+    __u64 ring_errors;
+};
+
+enum governor_slot
+{
+    GOVERNOR_SAMPLE = 0,
+    GOVERNOR_METRICS_ONLY = 1,
+    GOVERNOR_COUNT = 2,
+};
+
+#define SAMPLE_ALL 0xffffffff
+#define LATENCY_SLOTS 40
+
+struct latency_key
+{
+    __u32 tgid;
+    __u32 slot;
+};
+
+#ifndef SCAN_MISS_PCT
+#define SCAN_MISS_PCT 150
+#endif
+// Jitter slots: early by ~2^slot ns below JITTER_SLOTS, late above
+#define JITTER_SLOTS 40
+
+// Name of a scan thread, and its period in scan_period
+struct scan_thread
+{
+    char comm[TASK_COMM_LEN];
+};
+
+struct scan_key
+{
+    __u64 precord;
+    __u32 tgid;
+    __u32 slot;
+};
+
+// Time of the IOC threads in top-level dbProcess, and the wait of the
+// records queued to them by scanOnce (the callback threads call the
+// process routine of the record directly, without dbProcess)
+struct thread_stat
+{
+    __u32 tgid;
+    char comm[TASK_COMM_LEN];
+    __u64 busy_ns;
+    __u64 processes;
+    __u64 wait_ns;
+    __u64 waits;
+    __u64 wait_max_ns;
+};
+
+struct thread_record_key
+{
+    __u32 tid;
+    __u32 pad;
+    __u64 precord;
+};
+
+struct thread_record
+{
+    __u64 self_ns;
+    __u64 count;
+    char name[61];
+};
+
+enum alloc_kind
+{
+    ALLOC_MALLOC = 0,
+    ALLOC_FREE = 1,
+    ALLOC_POOL = 2,
+};
+
+struct alloc_call
+{
+    __u64 ktime_ns;
+    __u64 size;
+    __u32 kind;
+    __u32 depth;
+};
+
+struct alloc_record
+{
+    __u64 calls;
+    __u64 frees;
+    __u64 pool;
+    __u64 bytes;
+    __u64 ns;
+    char name[61];
+};
+
+enum link_dir
+{
+    LINK_GET = 0,
+    LINK_PUT = 1,
+};
+
+struct event_link
+{
+    __u64 ktime_ns;
+    __u64 ktime_ns_end;
+    char pvname[61];
+    char target[100];
+    __u32 dir;
+    __s32 link_type;
+    __s32 dbr_type;
+    __s64 status;
+    __u64 ptid;
+    __u64 psid;
+    __u64 tid;
+    __u64 sid;
+    __u32 val_type;
+    __s64 val_i;
+    __u64 val_u;
+    double val_d;
+    char val_s[MAX_STRING_SIZE];
+    __u32 tgid;
+    __u32 sample;
+};
+
+struct link_call
+{
+    struct event_link e;
+    struct link *plink;
+    void *pbuffer;
+};
+
+// A link of a record, slot 0 in link_stats, the log2 latency in link_latency
+struct link_key
+{
+    __u64 plink;
+    __u32 tgid;
+    __u16 dir;
+    __u16 slot;
+};
+
+struct link_stat
+{
+    __u64 count;
+    __u64 ns;
+    __u64 max_ns;
+    __u64 errors;
+    __s32 link_type;
+    __u32 pad;
+    char pvname[61];
+    char target[100];
+};
+
+struct queued_record
+{
+    __u32 tgid;
+    __u32 pad;
+    __u64 precord;
+};
+
+struct scan_stat
+{
+    __u64 last_ns;
+    __u64 period_ns;
+    __u64 count;
+    __u64 sum_ns;
+    __u64 max_ns;
+    __u64 missed;
+    __u32 tid;
+    char comm[TASK_COMM_LEN];
+    char name[61];
+};
+
+enum array_source
+{
+    ARRAY_SOURCE_PROCESS = 1,
+    ARRAY_SOURCE_PUT = 2,
+    ARRAY_SOURCE_CAPUT = 3,
+};
+
+struct array_layout
+{
+    __u16 val_offset;
+    __u16 ftvl_offset;
+    __u16 nord_offset;
+};
+
+struct event_array
+{
+    __u64 ktime_ns;
+    __u32 source;
+    __u32 pid;
+    __u32 tgid;
+    char pvname[61];
+    __u64 tid;
+    __u64 sid;
+    __u16 field_type;
+    __u16 elem_size;
+    __u32 count;
+    __u32 captured;
+    __u32 nbytes;
+    __u8 data[ARRAY_CAPTURE_BYTES];
+};
+
+struct profile_key
+{
+    __u32 pid;
+    int user_stack_id;
+    char pvname[61];
+    char rtype[RECTYPE_NAME_LEN];
+};
+
+struct post_state
+{
+    __u64 ktime_ns;
+    struct key_t key;
+    __u32 subscribers;
+    __u32 queued;
+    __u64 bytes;
+    __u32 overflows;
+};
+
+struct queue_state
+{
+    struct evSubscrip *pevent;
+    __u64 nreplace;
+};
+
+struct queued_log
+{
+    __u64 ktime_ns;
+    struct key_t key;
+};
+
+struct post_stat
+{
+    __u64 posts;
+    __u64 post_ns;
+    __u64 subscribers;
+    __u64 queued;
+    __u64 bytes;
+    __u64 overflows;
+    __u64 delivered;
+    __u64 latency_ns;
+    __u64 latency_max_ns;
+};
+
+struct event_post
+{
+    __u64 ktime_ns;
+    __u64 ktime_ns_end;
+    __u32 pid;
+    char pvname[61];
+    __u32 subscribers;
+    __u32 queued;
+    __u64 bytes;
+    __u32 overflows;
+    __u64 ptid;
+    __u64 psid;
+    __u64 tid;
+    __u64 sid;
+};
+
+struct event_stall
+{
+    __u64 ktime_ns;
+    __u32 pid;
+    __u32 tgid;
+    char comm[TASK_COMM_LEN];
+    int user_stack_id;
+    __u32 depth;
+    __u64 tid;
+    __u64 sid;
+    __u64 enter_ns[STALL_MAX_DEPTH];
+    char pvname[STALL_MAX_DEPTH][61];
 };
 
 struct event_put
@@ -84,6 +501,8 @@ struct event_put
     __u64 val_u;
     double val_d;
     char val_s[MAX_STRING_SIZE];
+    __u32 tgid;
+    __u32 sample;
 };
 
 struct put_pv
@@ -106,9 +525,19 @@ struct event_caput
     __u64 val_u;
     double val_d;
     char val_s[MAX_STRING_SIZE];
+    __u32 tgid;
+    __u32 sample;
 };
 
 BPF_HASH(otel_ctx, __u64, struct otel_context);
+BPF_PERCPU_ARRAY(id_counter, __u64, 1);
+// tgid -> traces sampled when bpf_get_prandom_u32() <= value (all if missing)
+BPF_HASH(ioc_sample, __u32, __u32, 1024);
+// Set by the overhead governor of the collector (--governor)
+BPF_ARRAY(governor, __u32, GOVERNOR_COUNT);
+BPF_HISTOGRAM(process_latency, struct latency_key, 1024 * LATENCY_SLOTS);
+BPF_HASH(process_latency_sum, __u32, __u64, 1024);
+BPF_TABLE("lru_hash", __u32, struct ns_pid, ns_pid_hash, 16384);
 
 BPF_PERCPU_ARRAY(db_data, dbCommon, 1);
 BPF_PERCPU_ARRAY(retdb_data, dbCommon, 1);
@@ -121,7 +550,7 @@ BPF_PERCPU_ARRAY(dbent, struct create_rec_args, 1);
 BPF_HASH(pv_entry_hash, struct key_t, DBENTRY);
 
 BPF_HASH(process_hash, __u64, struct process_info);
-BPF_HASH(proc_pv_hash, struct key_proc_pv, dbCommon *);
+BPF_HASH(proc_pv_hash, struct key_proc_pv, struct proc_frame);
 
 BPF_RINGBUF_OUTPUT(ring_buf, 1 << 4);
 
@@ -137,47 +566,441 @@ BPF_PERCPU_ARRAY(calink_data, struct caLink, 1);
 BPF_HASH(caput_pv_hash, __u64, struct event_caput);
 BPF_RINGBUF_OUTPUT(ring_buf_caput, 1 << 4);
 
-static __always_inline short pickPvValue(short dbr_type, void *pbuffer, __s64 *val_i, __u64 *val_u, double *val_d, char *val_s)
+BPF_HASH(support_depth_hash, __u64, struct process_info);
+BPF_HASH(support_call_hash, struct key_proc_pv, struct support_call);
+BPF_RINGBUF_OUTPUT(ring_buf_support, 1 << 4);
+
+BPF_HASH(post_state_hash, __u64, struct post_state);
+BPF_HASH(queue_state_hash, __u64, struct queue_state);
+BPF_HASH(queued_log_hash, __u64, struct queued_log, 65536);
+BPF_HASH(post_stats, struct key_t, struct post_stat);
+BPF_RINGBUF_OUTPUT(ring_buf_post, 1 << 4);
+
+BPF_HASH(stall_threshold, struct key_t, __u64);
+BPF_STACK_TRACE(stall_stacks, 4096);
+BPF_HASH(stall_stack_hash, __u32, int);
+BPF_RINGBUF_OUTPUT(ring_buf_stall, 1 << 4);
+
+BPF_HASH(pending_enter, struct key_proc_pv, struct event_process);
+BPF_PERCPU_ARRAY(enter_temp, struct event_process, 1);
+BPF_HASH(change_state_hash, struct key_t, struct change_state);
+
+BPF_HASH(array_layout_hash, __u64, struct array_layout);
+BPF_RINGBUF_OUTPUT(ring_buf_array, 1 << 6);
+
+BPF_STACK_TRACE(profile_stacks, 16384);
+BPF_HASH(profile_counts, struct profile_key, __u64);
+
+BPF_ARRAY(ring_drops, __u64, RING_COUNT);
+
+BPF_PERCPU_ARRAY(probe_stats, struct probe_stat, PROBE_COUNT);
+BPF_PERCPU_ARRAY(probe_current, __u32, 1);
+
+BPF_HASH(scan_period, struct scan_thread, __u64, 1024);
+BPF_HASH(scan_stats, struct scan_key, struct scan_stat, 65536);
+BPF_HISTOGRAM(scan_jitter, struct scan_key, 65536 * 4);
+BPF_PERCPU_ARRAY(scan_temp, struct scan_stat, 1);
+
+BPF_HASH(thread_stats, __u32, struct thread_stat, 4096);
+BPF_TABLE("lru_hash", struct thread_record_key, struct thread_record, thread_records, 65536);
+BPF_PERCPU_ARRAY(thread_record_temp, struct thread_record, 1);
+BPF_TABLE("lru_hash", struct queued_record, __u64, queued_records, 16384);
+
+BPF_HASH(alloc_call_hash, __u64, struct alloc_call, 16384);
+// Keyed by tgid and record address like queued_records
+BPF_TABLE("lru_hash", struct queued_record, struct alloc_record, alloc_records, 65536);
+BPF_PERCPU_ARRAY(alloc_record_temp, struct alloc_record, 1);
+
+BPF_HASH(link_call_hash, struct key_proc_pv, struct link_call, 16384);
+BPF_PERCPU_ARRAY(link_call_temp, struct link_call, 1);
+BPF_TABLE("lru_hash", struct link_key, struct link_stat, link_stats, 65536);
+BPF_HISTOGRAM(link_latency, struct link_key, 65536 * 4);
+BPF_PERCPU_ARRAY(link_stat_temp, struct link_stat, 1);
+BPF_RINGBUF_OUTPUT(ring_buf_link, 1 << 4);
+
+static __always_inline void probeBegin(__u32 id)
 {
-    int ret;
-    short val_type;
+#ifdef PROBE_STATS
+    __u32 zero = 0;
+    __u32 *running = probe_current.lookup(&zero);
+    if (running)
+        *running = id;
+#endif
+}
 
-    switch (dbr_type)
-    {
-    case DBF_STRING:
+// Counters of the running handler: BPF programs do not nest on a CPU
+static __always_inline struct probe_stat *probeStat(void)
+{
+#ifdef PROBE_STATS
+    __u32 zero = 0;
+    __u32 *running = probe_current.lookup(&zero);
+    if (!running)
+        return 0;
+    __u32 id = *running;
+    return probe_stats.lookup(&id);
+#else
+    return 0;
+#endif
+}
+
+static __always_inline long readUser(void *dst, __u32 size, const void *src)
+{
+    long ret = bpf_probe_read_user(dst, size, src);
+#ifdef PROBE_STATS
+    struct probe_stat *stat = probeStat();
+    if (stat && ret == 0)
+        stat->read_bytes += size;
+    else if (stat)
+        stat->read_errors += 1;
+#endif
+    return ret;
+}
+
+static __always_inline long readUserStr(void *dst, __u32 size, const void *src)
+{
+    long ret = bpf_probe_read_user_str(dst, size, src);
+#ifdef PROBE_STATS
+    struct probe_stat *stat = probeStat();
+    if (stat && ret > 0)
+        stat->read_bytes += ret;
+    else if (stat)
+        stat->read_errors += 1;
+#endif
+    return ret;
+}
+
+static __always_inline void checkUpdate(long ret)
+{
+#ifdef PROBE_STATS
+    struct probe_stat *stat = probeStat();
+    if (stat && ret != 0)
+        stat->update_errors += 1;
+#endif
+}
+
+static __always_inline void countDrop(long ret, __u32 ring)
+{
+    if (ret == 0)
+        return;
+#ifdef PROBE_STATS
+    struct probe_stat *stat = probeStat();
+    if (stat)
+        stat->ring_errors += 1;
+#endif
+    __u64 *drops = ring_drops.lookup(&ring);
+    if (drops)
+        __sync_fetch_and_add(drops, 1);
+}
+
+static __always_inline void makeKey(struct key_t *key, __u64 pid, char *name)
+{
+    __builtin_memset(key, 0, sizeof(*key));
+    key->tgid = pid >> 32;
+    memcpy(key->name, name, sizeof(key->name));
+}
+
+// Sampling threshold of a new trace: 0 for none, SAMPLE_ALL for all
+static __always_inline __u32 sampleThreshold(__u64 pid)
+{
+    __u32 tgid = pid >> 32;
+    __u32 threshold = SAMPLE_ALL;
+    __u32 *ioc = ioc_sample.lookup(&tgid);
+
+    if (ioc)
+        threshold = *ioc;
+#ifdef GOVERNOR
+    __u32 slot = GOVERNOR_METRICS_ONLY;
+    __u32 *value = governor.lookup(&slot);
+    if (value && *value)
+        return 0;
+    // Scales the share of every IOC, so each step halves all of them
+    slot = GOVERNOR_SAMPLE;
+    value = governor.lookup(&slot);
+    if (value && threshold)
     {
-        ret = bpf_probe_read_user(val_s, MAX_STRING_SIZE, pbuffer);
-        val_type = VAL_TYPE_STRING;
-        break;
+        __u64 scaled = (__u64)threshold * *value / SAMPLE_ALL;
+        threshold = scaled ? scaled : 1;
     }
-    case DBF_CHAR:
+#endif
+    return threshold;
+}
+
+static __always_inline void traceSample(__u64 pid, struct otel_context *ot_ctx)
+{
+    ot_ctx->sample = sampleThreshold(pid);
+    ot_ctx->sampled = ot_ctx->sample && bpf_get_prandom_u32() <= ot_ctx->sample;
+}
+
+static __always_inline void recordNsPid(__u64 pid)
+{
+    __u32 tid = pid;
+
+    if (ns_pid_hash.lookup(&tid))
+        return;
+
+    struct task_struct *task = (struct task_struct *)bpf_get_current_task();
+    struct task_struct *leader = 0;
+    struct pid *thread_pid = 0;
+    struct pid *leader_pid = 0;
+    unsigned int level = 0;
+    struct ns_pid ids = {};
+
+    // numbers[level] is the innermost namespace of the thread
+    bpf_probe_read_kernel(&thread_pid, sizeof(thread_pid), &task->thread_pid);
+    bpf_probe_read_kernel(&leader, sizeof(leader), &task->group_leader);
+    if (!thread_pid || !leader)
+        return;
+    bpf_probe_read_kernel(&leader_pid, sizeof(leader_pid), &leader->thread_pid);
+    bpf_probe_read_kernel(&level, sizeof(level), &thread_pid->level);
+    bpf_probe_read_kernel(&ids.pid, sizeof(ids.pid), &thread_pid->numbers[level].nr);
+    if (leader_pid)
+        bpf_probe_read_kernel(&ids.tgid, sizeof(ids.tgid), &leader_pid->numbers[level].nr);
+
+    checkUpdate(ns_pid_hash.update(&tid, &ids));
+}
+
+static __always_inline __u32 traceSampled(__u64 pid)
+{
+    struct otel_context *ot_ctx = otel_ctx.lookup(&pid);
+
+    return !ot_ctx || ot_ctx->sampled;
+}
+
+static __always_inline __u32 traceThreshold(__u64 pid)
+{
+    struct otel_context *ot_ctx = otel_ctx.lookup(&pid);
+
+    return ot_ctx ? ot_ctx->sample : SAMPLE_ALL;
+}
+
+static __always_inline void countLatency(__u64 pid, __u64 ns)
+{
+#ifdef GOVERNOR
+    struct latency_key key = {.tgid = pid >> 32, .slot = bpf_log2l(ns)};
+    __u64 zero = 0;
+
+    if (key.slot >= LATENCY_SLOTS)
+        key.slot = LATENCY_SLOTS - 1;
+    process_latency.increment(key);
+
+    __u64 *sum = process_latency_sum.lookup_or_try_init(&key.tgid, &zero);
+    if (sum)
+        __sync_fetch_and_add(sum, ns);
+#endif
+}
+
+// Interval since the last dbProcess of the record by the same scan thread
+// (a thread with a period in scan_period): intervals over SCAN_MISS_PCT
+// percent of the period count the scans missed, the others their deviation
+// from the period.
+static __always_inline void countScan(__u64 pid, void *precord, char *comm, char *name, __u64 now)
+{
+#ifdef SCAN_JITTER
+    struct scan_thread thread = {};
+    memcpy(thread.comm, comm, sizeof(thread.comm));
+    __u64 *period = scan_period.lookup(&thread);
+
+    if (!period || !*period)
+        return;
+
+    __u32 tid = pid;
+    struct scan_key key = {.precord = (__u64)precord, .tgid = pid >> 32};
+    struct scan_stat *stat = scan_stats.lookup(&key);
+
+    if (!stat)
     {
-        __s8 val;
-        ret = bpf_probe_read_user(&val, sizeof(val), pbuffer);
-        val_type = VAL_TYPE_INT;
-        *val_i = (__s64)val;
-        break;
+        __u32 zero = 0;
+        struct scan_stat *init = scan_temp.lookup(&zero);
+        if (!init)
+            return;
+        __builtin_memset(init, 0, sizeof(*init));
+        init->last_ns = now;
+        init->period_ns = *period;
+        init->tid = tid;
+        memcpy(init->comm, comm, sizeof(init->comm));
+        memcpy(init->name, name, sizeof(init->name));
+        checkUpdate(scan_stats.update(&key, init));
+        return;
     }
-    case DBF_SHORT:
+
+    if (stat->tid != tid)
     {
-        __s16 val;
-        ret = bpf_probe_read_user(&val, sizeof(val), pbuffer);
-        val_type = VAL_TYPE_INT;
-        *val_i = (__s64)val;
-        break;
+        // Scanned by another thread (SCAN changed): start a new series
+        stat->tid = tid;
+        stat->period_ns = *period;
+        memcpy(stat->comm, comm, sizeof(stat->comm));
+        stat->last_ns = now;
+        return;
     }
-    case DBF_LONG:
+
+    __u64 p = *period;
+    __u64 interval = now - stat->last_ns;
+    stat->last_ns = now;
+    stat->count++;
+    stat->sum_ns += interval;
+    if (interval > stat->max_ns)
+        stat->max_ns = interval;
+
+    if (interval * 100 > p * SCAN_MISS_PCT)
     {
-        __s32 val;
-        ret = bpf_probe_read_user(&val, sizeof(val), pbuffer);
-        val_type = VAL_TYPE_INT;
-        *val_i = (__s64)val;
+        __u64 n = (interval + p / 2) / p;
+        stat->missed += n > 1 ? n - 1 : 1;
+        return;
+    }
+
+    __u32 slot = bpf_log2l(interval >= p ? interval - p : p - interval);
+    if (slot >= JITTER_SLOTS)
+        slot = JITTER_SLOTS - 1;
+    key.slot = interval >= p ? JITTER_SLOTS + slot : slot;
+    scan_jitter.increment(key);
+#endif
+}
+
+static __always_inline struct thread_stat *threadStat(__u64 pid)
+{
+    __u32 tid = pid;
+    struct thread_stat *stat = thread_stats.lookup(&tid);
+
+    if (!stat)
+    {
+        struct thread_stat init = {.tgid = pid >> 32};
+        bpf_get_current_comm(&init.comm, sizeof(init.comm));
+        checkUpdate(thread_stats.update(&tid, &init));
+        stat = thread_stats.lookup(&tid);
+    }
+    return stat;
+}
+
+// The thread servicing the scanOnce queue, named by initOnce() of dbScan.c
+static __always_inline int isScanOnceThread(char *comm)
+{
+    const char name[] = "scanOnce";
+
+    for (int i = 0; i < sizeof(name); i++)
+    {
+        if (comm[i] != name[i])
+            return 0;
+    }
+    return 1;
+}
+
+// Queue wait of a record entering top-level dbProcess on the scanOnce
+// thread. The record may be processed by another thread (a periodic scan,
+// a put) before the queue gets to it: that one does not take the wait.
+static __always_inline void countWait(__u64 pid, void *precord, char *comm, __u64 now)
+{
+#ifdef THREAD_VIEW
+    if (!isScanOnceThread(comm))
+        return;
+
+    struct queued_record key = {.tgid = pid >> 32, .precord = (__u64)precord};
+    __u64 *queued = queued_records.lookup(&key);
+
+    if (!queued)
+        return;
+
+    __u64 wait = now > *queued ? now - *queued : 0;
+    queued_records.delete(&key);
+
+    struct thread_stat *stat = threadStat(pid);
+    if (!stat)
+        return;
+    __sync_fetch_and_add(&stat->wait_ns, wait);
+    __sync_fetch_and_add(&stat->waits, 1);
+    if (wait > stat->wait_max_ns)
+        stat->wait_max_ns = wait;
+#endif
+}
+
+// Busy time of the thread (top-level frames) and self time of the record
+// on it (the frame less its nested frames, added to the parent frame)
+static __always_inline void countThread(__u64 pid, struct proc_frame *frame, __u32 depth, __u64 now)
+{
+#ifdef THREAD_VIEW
+    __u64 duration = now - frame->ktime_ns;
+    __u64 self = duration > frame->child_ns ? duration - frame->child_ns : 0;
+    __u32 tid = pid;
+
+    if (depth > 1)
+    {
+        struct key_proc_pv parent_key = {.pid = tid, .count = depth - 1};
+        struct proc_frame *parent = proc_pv_hash.lookup(&parent_key);
+        if (parent)
+            parent->child_ns += duration;
+    }
+    else
+    {
+        struct thread_stat *stat = threadStat(pid);
+        if (stat)
+        {
+            __sync_fetch_and_add(&stat->busy_ns, duration);
+            __sync_fetch_and_add(&stat->processes, 1);
+        }
+    }
+
+    struct thread_record_key key = {.tid = tid, .precord = (__u64)frame->precord};
+    struct thread_record *rec = thread_records.lookup(&key);
+
+    if (!rec)
+    {
+        __u32 zero = 0;
+        struct thread_record *init = thread_record_temp.lookup(&zero);
+        if (!init)
+            return;
+        init->self_ns = 0;
+        init->count = 0;
+        readUserStr(init->name, sizeof(init->name), frame->precord->name);
+        checkUpdate(thread_records.update(&key, init));
+        rec = thread_records.lookup(&key);
+        if (!rec)
+            return;
+    }
+    rec->self_ns += self;
+    rec->count++;
+#endif
+}
+
+static __always_inline short pickPvValue(short dbr_type, void *pbuffer, __s64 *val_i, __u64 *val_u, double *val_d, char *val_s)
+{
+    int ret;
+    short val_type;
+
+    switch (dbr_type)
+    {
+    case DBF_STRING:
+    {
+        ret = readUser(val_s, MAX_STRING_SIZE, pbuffer);
+        val_type = VAL_TYPE_STRING;
+        break;
+    }
+    case DBF_CHAR:
+    {
+        __s8 val;
+        ret = readUser(&val, sizeof(val), pbuffer);
+        val_type = VAL_TYPE_INT;
+        *val_i = (__s64)val;
+        break;
+    }
+    case DBF_SHORT:
+    {
+        __s16 val;
+        ret = readUser(&val, sizeof(val), pbuffer);
+        val_type = VAL_TYPE_INT;
+        *val_i = (__s64)val;
+        break;
+    }
+    case DBF_LONG:
+    {
+        __s32 val;
+        ret = readUser(&val, sizeof(val), pbuffer);
+        val_type = VAL_TYPE_INT;
+        *val_i = (__s64)val;
         break;
     }
     case DBF_INT64:
     {
         __s64 val;
-        ret = bpf_probe_read_user(&val, sizeof(val), pbuffer);
+        ret = readUser(&val, sizeof(val), pbuffer);
         val_type = VAL_TYPE_INT;
         *val_i = (__s64)val;
         break;
@@ -185,7 +1008,7 @@ static __always_inline short pickPvValue(short dbr_type, void *pbuffer, __s64 *v
     case DBF_UCHAR:
     {
         __u8 val;
-        ret = bpf_probe_read_user(&val, sizeof(val), pbuffer);
+        ret = readUser(&val, sizeof(val), pbuffer);
         val_type = VAL_TYPE_UINT;
         *val_u = (__u64)val;
         break;
@@ -194,7 +1017,7 @@ static __always_inline short pickPvValue(short dbr_type, void *pbuffer, __s64 *v
     case DBF_ENUM:
     {
         __u16 val;
-        ret = bpf_probe_read_user(&val, sizeof(val), pbuffer);
+        ret = readUser(&val, sizeof(val), pbuffer);
         val_type = VAL_TYPE_UINT;
         *val_u = (__u64)val;
         break;
@@ -202,7 +1025,7 @@ static __always_inline short pickPvValue(short dbr_type, void *pbuffer, __s64 *v
     case DBF_ULONG:
     {
         __u32 val;
-        ret = bpf_probe_read_user(&val, sizeof(val), pbuffer);
+        ret = readUser(&val, sizeof(val), pbuffer);
         val_type = VAL_TYPE_UINT;
         *val_u = (__u64)val;
         break;
@@ -210,16 +1033,24 @@ static __always_inline short pickPvValue(short dbr_type, void *pbuffer, __s64 *v
     case DBF_UINT64:
     {
         __u64 val;
-        ret = bpf_probe_read_user(&val, sizeof(val), pbuffer);
+        ret = readUser(&val, sizeof(val), pbuffer);
         val_type = VAL_TYPE_UINT;
         *val_u = (__u64)val;
         break;
     }
     case DBF_FLOAT:
+    {
+        // No floating point in BPF: pass the bits and convert in Python
+        __u32 val;
+        ret = readUser(&val, sizeof(val), pbuffer);
+        val_type = VAL_TYPE_FLOAT;
+        *val_u = (__u64)val;
+        break;
+    }
     case DBF_DOUBLE:
     {
         double val;
-        ret = bpf_probe_read_user(&val, sizeof(val), pbuffer);
+        ret = readUser(&val, sizeof(val), pbuffer);
         val_type = VAL_TYPE_DOUBLE;
         *val_d = (double)val;
         break;
@@ -231,6 +1062,96 @@ static __always_inline short pickPvValue(short dbr_type, void *pbuffer, __s64 *v
     return val_type;
 }
 
+static __always_inline __u32 dbfElementSize(short dbf_type)
+{
+    switch (dbf_type)
+    {
+    case DBF_STRING:
+        return MAX_STRING_SIZE;
+    case DBF_CHAR:
+    case DBF_UCHAR:
+        return 1;
+    case DBF_SHORT:
+    case DBF_USHORT:
+    case DBF_ENUM:
+        return 2;
+    case DBF_LONG:
+    case DBF_ULONG:
+    case DBF_FLOAT:
+        return 4;
+    case DBF_INT64:
+    case DBF_UINT64:
+    case DBF_DOUBLE:
+        return 8;
+    default:
+        return 0;
+    }
+}
+
+static __always_inline void captureArray(__u32 source, char *pvname, __u64 tid, __u64 sid,
+                                         short dbf_type, void *pbuffer, long count)
+{
+#ifdef CAPTURE_ARRAYS
+    int ret;
+    __u32 elem_size = dbfElementSize(dbf_type);
+
+    if (!pbuffer || elem_size == 0 || count <= 0)
+        return;
+
+    __u32 captured = count;
+    if (captured > ARRAY_CAPTURE_ELEMS)
+        captured = ARRAY_CAPTURE_ELEMS;
+    if (captured > ARRAY_CAPTURE_BYTES / elem_size)
+        captured = ARRAY_CAPTURE_BYTES / elem_size;
+
+    __u32 nbytes = captured * elem_size;
+    if (nbytes > ARRAY_CAPTURE_BYTES)
+        nbytes = ARRAY_CAPTURE_BYTES;
+
+    struct event_array *e = ring_buf_array.ringbuf_reserve(sizeof(struct event_array));
+
+    if (!e)
+    {
+        countDrop(-1, RING_ARRAY);
+        return;
+    }
+
+    e->ktime_ns = bpf_ktime_get_ns();
+    e->source = source;
+    __u64 pid = bpf_get_current_pid_tgid();
+    e->pid = pid;
+    e->tgid = pid >> 32;
+    memcpy(e->pvname, pvname, sizeof(e->pvname));
+    e->tid = tid;
+    e->sid = sid;
+    e->field_type = dbf_type;
+    e->elem_size = elem_size;
+    e->count = count;
+    e->captured = captured;
+    e->nbytes = nbytes;
+    ret = readUser(e->data, nbytes, pbuffer);
+
+    ring_buf_array.ringbuf_submit(e, 0);
+#endif
+}
+
+// Span id, or low half of a trace id: the CPU number and a per-CPU count
+// (12 and 52 bits), XORed with the salt so two hosts do not share ids.
+// Never 0, which the count never is before the XOR.
+static __always_inline __u64 nextId()
+{
+    int zero = 0;
+    __u64 *counter = id_counter.lookup(&zero);
+
+    if (!counter)
+        return bpf_get_prandom_u32() | (__u64)bpf_get_prandom_u32() << 32;
+
+    __u64 n = __sync_fetch_and_add(counter, 1) + 1;
+    __u64 id = (((__u64)bpf_get_smp_processor_id() << ID_CPU_SHIFT) | (n & ID_COUNT_MASK)) ^ ID_SALT;
+
+    return id ? id : ID_SALT;
+}
+
 static __always_inline void updateOtelContext(__u64 pid, __u64 *ptid, __u64 *psid, __u64 *tid, __u64 *sid)
 {
     struct otel_context *ot_ctx = otel_ctx.lookup(&pid);
@@ -239,8 +1160,9 @@ static __always_inline void updateOtelContext(__u64 pid, __u64 *ptid, __u64 *psi
     if (!ot_ctx)
     {
         ot_ctx = &new_ctx;
-        ot_ctx->tid = bpf_get_prandom_u32();
-        ot_ctx->tid = (ot_ctx->tid - 1) | (ot_ctx->tid + 1) << 32;
+        ot_ctx->tid = nextId();
+        traceSample(pid, ot_ctx);
+        recordNsPid(pid);
         *ptid = 0;
         *psid = 0;
     }
@@ -250,13 +1172,12 @@ static __always_inline void updateOtelContext(__u64 pid, __u64 *ptid, __u64 *psi
         *psid = ot_ctx->sid;
     }
 
-    ot_ctx->sid = bpf_get_prandom_u32();
-    ot_ctx->sid = (ot_ctx->sid - 1) | (ot_ctx->sid + 1) << 32;
+    ot_ctx->sid = nextId();
 
     *tid = ot_ctx->tid;
     *sid = ot_ctx->sid;
 
-    otel_ctx.update(&pid, ot_ctx);
+    checkUpdate(otel_ctx.update(&pid, ot_ctx));
 }
 
 static __always_inline void updateOtelContext2(__u64 pid, __u64 *ptid, __u64 *psid, __u64 *tid, __u64 *sid)
@@ -267,12 +1188,12 @@ static __always_inline void updateOtelContext2(__u64 pid, __u64 *ptid, __u64 *ps
     if (!ot_ctx)
     {
         ot_ctx = &new_ctx;
-        ot_ctx->tid = bpf_get_prandom_u32();
-        ot_ctx->tid = (ot_ctx->tid - 1) | (ot_ctx->tid + 1) << 32;
+        ot_ctx->tid = nextId();
+        traceSample(pid, ot_ctx);
+        recordNsPid(pid);
         *ptid = 0;
         *psid = 0;
-        ot_ctx->sid = bpf_get_prandom_u32();
-        ot_ctx->sid = (ot_ctx->sid - 1) | (ot_ctx->sid + 1) << 32;
+        ot_ctx->sid = nextId();
         *sid = ot_ctx->sid;
     }
     else
@@ -280,23 +1201,124 @@ static __always_inline void updateOtelContext2(__u64 pid, __u64 *ptid, __u64 *ps
         *ptid = ot_ctx->tid;
         *psid = ot_ctx->sid;
 
-        __u64 _sid = bpf_get_prandom_u32();
-        _sid = (_sid - 1) | (_sid + 1) << 32;
-        *sid = _sid;
+        *sid = nextId();
     }
 
     *tid = ot_ctx->tid;
 
-    otel_ctx.update(&pid, ot_ctx);
+    checkUpdate(otel_ctx.update(&pid, ot_ctx));
+}
+
+#define FNV_OFFSET 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
+
+static __always_inline __u64 fnvMix(__u64 hash, __u64 val)
+{
+    return (hash ^ val) * FNV_PRIME;
+}
+
+static __always_inline __u64 valueHash(struct event_process *e)
+{
+    __u64 hash = FNV_OFFSET;
+    __u64 bits = 0;
+
+    hash = fnvMix(hash, e->val_type);
+    hash = fnvMix(hash, (__u64)e->val_i);
+    hash = fnvMix(hash, e->val_u);
+    memcpy(&bits, &e->val_d, sizeof(bits));
+    hash = fnvMix(hash, bits);
+    hash = fnvMix(hash, (__u64)e->stat << 16 | e->sevr);
+
+    // val_s is per-CPU scratch left over by other records unless it is the value
+    if (e->val_type != VAL_TYPE_STRING)
+        return hash;
+    for (int i = 0; i < MAX_STRING_SIZE; i += 8)
+    {
+        memcpy(&bits, e->val_s + i, sizeof(bits));
+        hash = fnvMix(hash, bits);
+    }
+    return hash;
+}
+
+static __always_inline struct proc_frame *currentFrame(__u64 pid)
+{
+    struct process_info *pproc_info = process_hash.lookup(&pid);
+
+    if (!pproc_info)
+        return 0;
+
+    struct key_proc_pv key_pv;
+    key_pv.pid = pid;
+    key_pv.count = pproc_info->count;
+
+    return proc_pv_hash.lookup(&key_pv);
+}
+
+static __always_inline void checkStall(__u64 pid, struct proc_frame *frame, int stack_id)
+{
+    int ret;
+    __u64 now = bpf_ktime_get_ns();
+
+    if (frame->stalled || frame->deadline_ns == 0 || now < frame->deadline_ns)
+        return;
+
+    struct process_info *pproc_info = process_hash.lookup(&pid);
+
+    if (!pproc_info)
+        return;
+
+    struct event_stall *e = ring_buf_stall.ringbuf_reserve(sizeof(struct event_stall));
+
+    if (!e)
+    {
+        countDrop(-1, RING_STALL);
+        return;
+    }
+
+    frame->stalled = 1;
+
+    e->ktime_ns = now;
+    e->pid = pid;
+    e->tgid = pid >> 32;
+    bpf_get_current_comm(&(e->comm), sizeof(e->comm));
+    e->user_stack_id = stack_id;
+    e->depth = pproc_info->count;
+    e->tid = frame->tid;
+    e->sid = frame->sid;
+
+    // Innermost frame first
+    for (int i = 0; i < STALL_MAX_DEPTH; i++)
+    {
+        struct key_proc_pv key_pv;
+        key_pv.pid = pid;
+        key_pv.count = pproc_info->count - i;
+
+        e->enter_ns[i] = 0;
+        e->pvname[i][0] = 0;
+
+        if (key_pv.count < 1 || key_pv.count > pproc_info->count)
+            continue;
+
+        struct proc_frame *f = proc_pv_hash.lookup(&key_pv);
+        if (!f || !f->precord)
+            continue;
+
+        e->enter_ns[i] = f->ktime_ns;
+        ret = readUser(e->pvname[i], sizeof(e->pvname[i]), f->precord->name);
+    }
+
+    ring_buf_stall.ringbuf_submit(e, 0);
 }
 
 int enter_dbput(struct pt_regs *ctx, void *paddr, short dbrType, void *pbuffer, long nRequest)
 {
+    probeBegin(PROBE_ENTER_DBPUT);
     int ret;
     __u32 zero = 0;
     struct event_put e = {};
 
     e.ktime_ns = bpf_ktime_get_ns();
+    e.tgid = bpf_get_current_pid_tgid() >> 32;
 
     dbAddr *data = db_data_put.lookup(&zero);
 
@@ -305,7 +1327,7 @@ int enter_dbput(struct pt_regs *ctx, void *paddr, short dbrType, void *pbuffer,
 
     int size = sizeof(dbAddr);
     if (paddr != 0)
-        ret = bpf_probe_read_user(data, size, paddr);
+        ret = readUser(data, size, paddr);
 
     if (!pbuffer)
         return 0;
@@ -314,22 +1336,27 @@ int enter_dbput(struct pt_regs *ctx, void *paddr, short dbrType, void *pbuffer,
     dbAddr *n = (dbAddr *)paddr;
 
     if (n != 0)
-        ret = bpf_probe_read_user(fieldname, sizeof(fieldname), n->pfldDes->name);
+        ret = readUser(fieldname, sizeof(fieldname), n->pfldDes->name);
 
     e.val_type = pickPvValue(dbrType, pbuffer, &(e.val_i), &(e.val_u), &(e.val_d), e.val_s);
-    ret = bpf_probe_read_user(e.pvname, sizeof(e.pvname), data->precord->name);
-    ret = bpf_probe_read_user(e.field_name, sizeof(e.field_name), n->pfldDes->name);
+    ret = readUser(e.pvname, sizeof(e.pvname), data->precord->name);
+    ret = readUser(e.field_name, sizeof(e.field_name), n->pfldDes->name);
 
     __u64 pid = bpf_get_current_pid_tgid();
     updateOtelContext(pid, &(e.ptid), &(e.psid), &(e.tid), &(e.sid));
+    e.sample = traceThreshold(pid);
+
+    if (nRequest > 1 && traceSampled(pid))
+        captureArray(ARRAY_SOURCE_PUT, e.pvname, e.tid, e.sid, dbrType, pbuffer, nRequest);
 
-    put_pv_hash.update(&pid, &e);
+    checkUpdate(put_pv_hash.update(&pid, &e));
 
     return 0;
 };
 
 int exit_dbput(struct pt_regs *ctx)
 {
+    probeBegin(PROBE_EXIT_DBPUT);
     __u64 pid = bpf_get_current_pid_tgid();
     struct event_put *p = put_pv_hash.lookup(&pid);
 
@@ -339,7 +1366,8 @@ int exit_dbput(struct pt_regs *ctx)
     }
 
     p->ktime_ns_end = bpf_ktime_get_ns();
-    ring_buf_put.ringbuf_output(p, sizeof(struct event_put), 0);
+    if (traceSampled(pid))
+        countDrop(ring_buf_put.ringbuf_output(p, sizeof(struct event_put), 0), RING_PUT);
 
     put_pv_hash.delete(&pid);
     otel_ctx.delete(&pid);
@@ -349,6 +1377,7 @@ int exit_dbput(struct pt_regs *ctx)
 
 int enter_process(struct pt_regs *ctx)
 {
+    probeBegin(PROBE_ENTER_PROCESS);
     int ret;
     __u32 zero = 0;
     struct event_process *e = event_temp.lookup(&zero);
@@ -369,7 +1398,7 @@ int enter_process(struct pt_regs *ctx)
 
     int size = sizeof(dbCommon);
     if (precord != 0)
-        ret = bpf_probe_read_user(data, size, precord);
+        ret = readUser(data, size, precord);
 
     bpf_trace_printk("enter: %s %d %d", data->name, data->time.secPastEpoch, data->time.nsec);
 
@@ -389,8 +1418,7 @@ int enter_process(struct pt_regs *ctx)
     key.pid = pid & 0xffffffff;
     key.count = proc_info.count;
 
-    process_hash.update(&pid, &proc_info);
-    proc_pv_hash.update(&key, &precord);
+    checkUpdate(process_hash.update(&pid, &proc_info));
     bpf_trace_printk("enter process: %d %d", key.pid, key.count);
 
     e->type = 0;
@@ -404,16 +1432,66 @@ int enter_process(struct pt_regs *ctx)
     e->val_i = 0;
     e->val_u = 0;
     e->val_d = 0;
+    e->stat = 0;
+    e->sevr = 0;
+
+    e->suppressed = 0;
+    e->rtype[0] = 0;
+    e->tgid = pid >> 32;
+    __builtin_memset(&e->alloc, 0, sizeof(e->alloc));
+    countScan(pid, precord, e->comm, data->name, e->ktime_ns);
+    if (proc_info.count == 1)
+        countWait(pid, precord, e->comm, e->ktime_ns);
 
     updateOtelContext(pid, &(e->ptid), &(e->psid), &(e->tid), &(e->sid));
+    e->sample = traceThreshold(pid);
 
-    ring_buf.ringbuf_output(e, sizeof(struct event_process), 0);
+    // The last span of the thread is a previous sibling, not the caller
+    if (key.count > 1)
+    {
+        struct key_proc_pv parent_key = {.pid = key.pid, .count = key.count - 1};
+        struct proc_frame *parent = proc_pv_hash.lookup(&parent_key);
+        // or the link read or written by the caller (enter_get_link)
+        if (parent)
+            e->psid = parent->link_sid ? parent->link_sid : parent->sid;
+    }
+
+    struct proc_frame frame = {};
+    frame.precord = precord;
+    frame.tid = e->tid;
+    frame.sid = e->sid;
+    frame.ktime_ns = e->ktime_ns;
+#ifdef STALL_WATCH
+    // Thresholds of this IOC first, then the ones for every IOC (tgid 0)
+    struct key_t stall_key;
+    makeKey(&stall_key, pid, data->name);
+    __u64 *threshold = stall_threshold.lookup(&stall_key);
+    if (!threshold)
+    {
+        stall_key.tgid = 0;
+        threshold = stall_threshold.lookup(&stall_key);
+    }
+    __u64 limit = threshold ? *threshold : STALL_DEFAULT_NS;
+    // No threshold for the record and no default: never stalled
+    frame.deadline_ns = limit ? e->ktime_ns + limit : 0;
+#endif
+    checkUpdate(proc_pv_hash.update(&key, &frame));
+
+#ifdef CHANGE_FILTER
+    // Sent by exit_process together with the exit if the value changed
+    if (traceSampled(pid))
+        checkUpdate(pending_enter.update(&key, e));
+#else
+    if (traceSampled(pid))
+        countDrop(ring_buf.ringbuf_output(e, sizeof(struct event_process), 0), RING_PROCESS);
+#endif
 
     return 0;
 };
 
 int exit_process(struct pt_regs *ctx)
 {
+    probeBegin(PROBE_EXIT_PROCESS);
     int ret;
     __u32 zero = 0;
 
@@ -439,21 +1517,43 @@ int exit_process(struct pt_regs *ctx)
     key_pv.pid = pid;
     key_pv.count = pproc_info->count;
 
-    struct dbCommon **pprecord;
-    pprecord = proc_pv_hash.lookup(&key_pv);
+    struct proc_frame *frame;
+    frame = proc_pv_hash.lookup(&key_pv);
     bpf_trace_printk("exit process: %d %d", key_pv.pid, key_pv.count);
 
-    if (!pprecord)
+    if (!frame)
     {
         bpf_trace_printk("exit error");
         return 0;
     }
 
     struct dbCommon *precord;
-    precord = *pprecord;
-
+    precord = frame->precord;
+    __u64 frame_tid = frame->tid;
+    __u64 frame_sid = frame->sid;
+    __u32 emit_child = frame->emit_child;
+    struct alloc_stat alloc = frame->alloc;
+    __u32 sampled = traceSampled(pid);
+    __u32 sample = traceThreshold(pid);
+
+    countLatency(pid, e->ktime_ns - frame->ktime_ns);
+    countThread(pid, frame, key_pv.count, e->ktime_ns);
     proc_pv_hash.delete(&key_pv);
 
+#ifdef CHANGE_FILTER
+    struct event_process *enter = enter_temp.lookup(&zero);
+    struct event_process *penter = pending_enter.lookup(&key_pv);
+    if (enter && penter)
+    {
+        memcpy(enter, penter, sizeof(struct event_process));
+        pending_enter.delete(&key_pv);
+    }
+    else
+    {
+        enter = 0;
+    }
+#endif
+
     if (pproc_info != 0)
     {
         proc_info.count = pproc_info->count;
@@ -466,21 +1566,25 @@ int exit_process(struct pt_regs *ctx)
         }
         else
         {
-            process_hash.update(&pid, &proc_info);
+            checkUpdate(process_hash.update(&pid, &proc_info));
         }
     }
 
+    // Nothing is read from the record for a trace that is not exported
+    if (!sampled)
+        return 0;
+
     dbCommon *data = retdb_data.lookup(&zero);
     if (!data)
         return 0;
 
     int size = sizeof(dbCommon);
     if (precord != 0)
-        ret = bpf_probe_read_user(data, size, precord);
+        ret = readUser(data, size, precord);
     bpf_trace_printk("exit: %s %d %d", data->name, data->time.secPastEpoch, data->time.nsec);
 
     struct key_t key;
-    memcpy(key.name, data->name, sizeof(key.name));
+    makeKey(&key, pid, data->name);
     bpf_trace_printk("%s", key.name);
 
     DBENTRY *ent = pv_entry_hash.lookup(&key);
@@ -500,14 +1604,14 @@ int exit_process(struct pt_regs *ctx)
 
     if (ent->precnode != 0)
     {
-        ret = bpf_probe_read_user(recnode, size, ent->precnode);
+        ret = readUser(recnode, size, ent->precnode);
     }
 
     char pvname[61];
     size = sizeof(pvname);
     if (recnode->recordname != 0)
     {
-        ret = bpf_probe_read_user(pvname, size, recnode->recordname);
+        ret = readUser(pvname, size, recnode->recordname);
         bpf_trace_printk("exit: %s", pvname);
     }
 
@@ -520,8 +1624,11 @@ int exit_process(struct pt_regs *ctx)
     size = sizeof(dbRecordType);
     if (ent->precordType != 0)
     {
-        ret = bpf_probe_read_user(type, size, ent->precordType);
+        ret = readUser(type, size, ent->precordType);
     }
+    e->rtype[0] = 0;
+    if (type->name != 0)
+        ret = readUserStr(e->rtype, sizeof(e->rtype), type->name);
 
     dbFldDes *dbfld = mapdbfld.lookup(&zero);
 
@@ -533,14 +1640,14 @@ int exit_process(struct pt_regs *ctx)
 
     if (type->pvalFldDes != 0)
     {
-        ret = bpf_probe_read_user(dbfld, size, type->pvalFldDes);
+        ret = readUser(dbfld, size, type->pvalFldDes);
     }
 
     char fname[10];
     size = sizeof(fname);
     if (dbfld->name != 0)
     {
-        ret = bpf_probe_read_user(fname, size, dbfld->name);
+        ret = readUser(fname, size, dbfld->name);
         bpf_trace_printk("exit: %s", fname);
     }
 
@@ -559,19 +1666,84 @@ int exit_process(struct pt_regs *ctx)
     e->val_i = 0;
     e->val_u = 0;
     e->val_d = 0;
+    e->stat = data->stat;
+    e->sevr = data->sevr;
+    e->suppressed = 0;
+    e->tgid = pid >> 32;
+    e->sample = sample;
+    e->alloc = alloc;
 
     if (precord != 0)
     {
         e->val_type = pickPvValue(field_type, (void *)((char *)recnode->precord + dbfld->offset), &(e->val_i), &(e->val_u), &(e->val_d), e->val_s);
     }
 
-    ring_buf.ringbuf_output(e, sizeof(struct event_process), 0);
+#ifdef CAPTURE_ARRAYS
+    __u64 rtype_key = (__u64)ent->precordType;
+    struct array_layout *layout = array_layout_hash.lookup(&rtype_key);
+
+    if (precord != 0 && field_type == DBF_NOACCESS && layout)
+    {
+        void *pval = 0;
+        __u16 ftvl = 0;
+        __u32 nord = 0;
+        char *base = (char *)recnode->precord;
+
+        ret = readUser(&pval, sizeof(pval), base + layout->val_offset);
+        ret = readUser(&ftvl, sizeof(ftvl), base + layout->ftvl_offset);
+        ret = readUser(&nord, sizeof(nord), base + layout->nord_offset);
+
+        // menuFtype has the DBF_STRING..DBF_ENUM order
+        captureArray(ARRAY_SOURCE_PROCESS, e->pvname, frame_tid, frame_sid, ftvl, pval, nord);
+    }
+#endif
+
+#ifdef CHANGE_FILTER
+    if (!enter)
+        return 0;
+
+    // Arrays and other fields without a scalar value are always sent
+    if (e->val_type != VAL_TYPE_NULL)
+    {
+        struct change_state *state = change_state_hash.lookup(&key);
+        __u64 hash = valueHash(e);
+
+        if (state && state->hash == hash && !emit_child)
+        {
+            state->pending += 1;
+            __sync_fetch_and_add(&state->total, 1);
+            return 0;
+        }
+
+        struct change_state new_state = {.hash = hash};
+        if (state)
+        {
+            e->suppressed = state->pending;
+            new_state.total = state->total;
+        }
+        checkUpdate(change_state_hash.update(&key, &new_state));
+    }
+
+    // The caller has to be sent too, or this span has no parent
+    if (key_pv.count > 1)
+    {
+        struct key_proc_pv parent_key = {.pid = key_pv.pid, .count = key_pv.count - 1};
+        struct proc_frame *parent = proc_pv_hash.lookup(&parent_key);
+        if (parent)
+            parent->emit_child = 1;
+    }
+
+    countDrop(ring_buf.ringbuf_output(enter, sizeof(struct event_process), 0), RING_PROCESS);
+#endif
+
+    countDrop(ring_buf.ringbuf_output(e, sizeof(struct event_process), 0), RING_PROCESS);
 
     return 0;
 };
 
 int enter_createrec(struct pt_regs *ctx)
 {
+    probeBegin(PROBE_ENTER_CREATEREC);
     int ret;
     __u32 zero = 0;
 
@@ -590,10 +1762,11 @@ int enter_createrec(struct pt_regs *ctx)
     if (!ent)
         return 0;
     ent->pentry = pent;
+    ent->key.tgid = bpf_get_current_pid_tgid() >> 32;
 
     int size = sizeof(ent->key.name);
     if (pname != 0)
-        ret = bpf_probe_read_user(ent->key.name, size, pname);
+        ret = readUser(ent->key.name, size, pname);
 
     bpf_trace_printk("enter create: %s", ent->key.name);
 
@@ -615,6 +1788,7 @@ int enter_createrec(struct pt_regs *ctx)
 
 int exit_createrec(struct pt_regs *ctx)
 {
+    probeBegin(PROBE_EXIT_CREATEREC);
     __u32 zero = 0;
 
     struct create_rec_args *pent;
@@ -627,17 +1801,18 @@ int exit_createrec(struct pt_regs *ctx)
 
     int ret;
     if (pent != 0)
-        ret = bpf_probe_read_user(&ent, sizeof(ent), pent->pentry);
+        ret = readUser(&ent, sizeof(ent), pent->pentry);
 
     bpf_trace_printk("exit create");
 
-    pv_entry_hash.update(&(pent->key), &ent);
+    checkUpdate(pv_entry_hash.update(&(pent->key), &ent));
 
     return 0;
 };
 
 int enter_dbfirstrecord(struct pt_regs *ctx)
 {
+    probeBegin(PROBE_ENTER_DBFIRSTRECORD);
     int ret;
     __u32 zero = 0;
 
@@ -657,6 +1832,7 @@ int enter_dbfirstrecord(struct pt_regs *ctx)
 
 int exit_dbfirstrecord(struct pt_regs *ctx)
 {
+    probeBegin(PROBE_EXIT_DBFIRSTRECORD);
     __u32 zero = 0;
 
     DBENTRY **ppent = dbent_dbl.lookup(&zero);
@@ -671,7 +1847,7 @@ int exit_dbfirstrecord(struct pt_regs *ctx)
 
     int ret;
     if (pent != 0)
-        ret = bpf_probe_read_user(&ent, sizeof(ent), pent);
+        ret = readUser(&ent, sizeof(ent), pent);
 
     dbRecordNode *recnode = recn.lookup(&zero);
 
@@ -683,19 +1859,19 @@ int exit_dbfirstrecord(struct pt_regs *ctx)
 
     if (ent.precnode != 0)
     {
-        ret = bpf_probe_read_user(recnode, size, ent.precnode);
+        ret = readUser(recnode, size, ent.precnode);
     }
 
     char pvname[61];
     size = sizeof(pvname);
     if (recnode->recordname != 0)
     {
-        ret = bpf_probe_read_user(pvname, size, recnode->recordname);
+        ret = readUser(pvname, size, recnode->recordname);
         bpf_trace_printk("dbl: %s", pvname);
     }
 
     struct key_t key;
-    memcpy(key.name, pvname, sizeof(key.name));
+    makeKey(&key, bpf_get_current_pid_tgid(), pvname);
 
     int flag = 0;
     for (int i = 0; i < sizeof(key.name); i++)
@@ -710,19 +1886,21 @@ int exit_dbfirstrecord(struct pt_regs *ctx)
         }
     }
 
-    pv_entry_hash.update(&key, &ent);
+    checkUpdate(pv_entry_hash.update(&key, &ent));
     return 0;
 };
 
 int enter_caput(struct pt_regs *ctx, struct link *plink, short dbrType,
                 void *pbuffer, long nRequest, dbCaCallback callback, void *userPvt)
 {
+    probeBegin(PROBE_ENTER_CAPUT);
     int ret;
     short _dbrType;
     __u32 zero = 0;
     struct event_caput e = {};
 
     e.ktime_ns = bpf_ktime_get_ns();
+    e.tgid = bpf_get_current_pid_tgid() >> 32;
 
     struct link *ldata = link_data.lookup(&zero);
 
@@ -732,7 +1910,7 @@ int enter_caput(struct pt_regs *ctx, struct link *plink, short dbrType,
     if (!plink)
         return 0;
 
-    ret = bpf_probe_read_user(ldata, sizeof(struct link), plink);
+    ret = readUser(ldata, sizeof(struct link), plink);
 
     caLink *pca = calink_data.lookup(&zero);
 
@@ -742,14 +1920,14 @@ int enter_caput(struct pt_regs *ctx, struct link *plink, short dbrType,
     if (!(plink->value.pv_link.pvt))
         return 0;
 
-    ret = bpf_probe_read_user(pca, sizeof(struct caLink), plink->value.pv_link.pvt);
+    ret = readUser(pca, sizeof(struct caLink), plink->value.pv_link.pvt);
 
     char pvname[100];
 
     if (!(pca->pvname))
         return 0;
 
-    ret = bpf_probe_read_user(e.pvname, sizeof(pvname), pca->pvname);
+    ret = readUser(e.pvname, sizeof(pvname), pca->pvname);
 
     if (!pbuffer)
         return 0;
@@ -764,14 +1942,19 @@ int enter_caput(struct pt_regs *ctx, struct link *plink, short dbrType,
 
     __u64 pid = bpf_get_current_pid_tgid();
     updateOtelContext2(pid, &(e.ptid), &(e.psid), &(e.tid), &(e.sid));
+    e.sample = traceThreshold(pid);
+
+    if (nRequest > 1 && traceSampled(pid))
+        captureArray(ARRAY_SOURCE_CAPUT, e.pvname, e.tid, e.sid, dbrType, pbuffer, nRequest);
 
-    caput_pv_hash.update(&pid, &e);
+    checkUpdate(caput_pv_hash.update(&pid, &e));
 
     return 0;
 };
 
 int exit_caput(struct pt_regs *ctx)
 {
+    probeBegin(PROBE_EXIT_CAPUT);
     __u64 pid = bpf_get_current_pid_tgid();
     struct event_caput *p = caput_pv_hash.lookup(&pid);
 
@@ -781,9 +1964,604 @@ int exit_caput(struct pt_regs *ctx)
     }
 
     p->ktime_ns_end = bpf_ktime_get_ns();
-    ring_buf_caput.ringbuf_output(p, sizeof(struct event_caput), 0);
+    if (traceSampled(pid))
+        countDrop(ring_buf_caput.ringbuf_output(p, sizeof(struct event_caput), 0), RING_CAPUT);
 
     caput_pv_hash.delete(&pid);
 
     return 0;
 };
+
+int sample_process(struct bpf_perf_event_data *ctx)
+{
+    probeBegin(PROBE_SAMPLE_PROCESS);
+    int ret;
+    __u64 pid = bpf_get_current_pid_tgid();
+    struct proc_frame *frame = currentFrame(pid);
+
+    if (!frame)
+        return 0;
+
+    struct dbCommon *precord = frame->precord;
+
+    if (!precord)
+        return 0;
+
+    struct profile_key key;
+    __builtin_memset(&key, 0, sizeof(key));
+
+    key.pid = pid >> 32;
+    ret = readUser(key.pvname, sizeof(key.pvname), precord->name);
+
+    struct dbRecordType *rdes = 0;
+    char *tname = 0;
+    ret = readUser(&rdes, sizeof(rdes), &precord->rdes);
+    if (rdes != 0)
+        ret = readUser(&tname, sizeof(tname), &rdes->name);
+    if (tname != 0)
+        ret = readUserStr(key.rtype, sizeof(key.rtype), tname);
+
+    key.user_stack_id = profile_stacks.get_stackid(&ctx->regs, BPF_F_USER_STACK);
+
+    profile_counts.increment(key);
+
+#ifdef STALL_WATCH
+    if (!frame->stalled && frame->deadline_ns && bpf_ktime_get_ns() >= frame->deadline_ns)
+        checkStall(pid, frame, stall_stacks.get_stackid(&ctx->regs, BPF_F_USER_STACK));
+#endif
+
+    return 0;
+};
+
+int enter_support(struct pt_regs *ctx)
+{
+    probeBegin(PROBE_ENTER_SUPPORT);
+    struct process_info depth = {0};
+    struct process_info *pdepth;
+    struct key_proc_pv key;
+    struct support_call call = {};
+    __u64 pid = bpf_get_current_pid_tgid();
+
+    call.ktime_ns = bpf_ktime_get_ns();
+    call.addr = PT_REGS_IP(ctx);
+
+    pdepth = support_depth_hash.lookup(&pid);
+
+    if (pdepth)
+    {
+        depth.count = pdepth->count;
+    }
+    depth.count = depth.count + 1;
+
+    key.pid = pid;
+    key.count = depth.count;
+
+    checkUpdate(support_depth_hash.update(&pid, &depth));
+    checkUpdate(support_call_hash.update(&key, &call));
+
+    return 0;
+};
+
+int exit_support(struct pt_regs *ctx)
+{
+    probeBegin(PROBE_EXIT_SUPPORT);
+    int ret;
+    struct process_info depth = {0};
+    struct process_info *pdepth;
+    struct key_proc_pv key;
+    struct event_support e = {};
+    __u64 pid = bpf_get_current_pid_tgid();
+
+    e.ktime_ns_end = bpf_ktime_get_ns();
+
+    pdepth = support_depth_hash.lookup(&pid);
+
+    if (!pdepth)
+        return 0;
+
+    key.pid = pid;
+    key.count = pdepth->count;
+
+    depth.count = pdepth->count - 1;
+    if (depth.count == 0)
+    {
+        support_depth_hash.delete(&pid);
+    }
+    else
+    {
+        checkUpdate(support_depth_hash.update(&pid, &depth));
+    }
+
+    struct support_call *call = support_call_hash.lookup(&key);
+
+    if (!call)
+        return 0;
+
+    e.ktime_ns = call->ktime_ns;
+    e.addr = call->addr;
+    support_call_hash.delete(&key);
+
+    struct proc_frame *frame = currentFrame(pid);
+
+    if (!frame || !traceSampled(pid))
+        return 0;
+
+    if (frame->precord != 0)
+        ret = readUser(e.pvname, sizeof(e.pvname), frame->precord->name);
+
+    e.pid = pid >> 32;
+    e.ptid = frame->tid;
+    e.psid = frame->sid;
+    e.tid = frame->tid;
+    e.sid = nextId();
+
+    countDrop(ring_buf_support.ringbuf_output(&e, sizeof(struct event_support), 0), RING_SUPPORT);
+
+    return 0;
+};
+
+int enter_post(struct pt_regs *ctx, struct dbCommon *precord, void *pfield, unsigned int caller_mask)
+{
+    probeBegin(PROBE_ENTER_POST);
+    int ret;
+    struct post_state state = {};
+    __u64 pid = bpf_get_current_pid_tgid();
+
+    if (!precord)
+        return 0;
+
+    state.ktime_ns = bpf_ktime_get_ns();
+
+    int count = 0;
+    ret = readUser(&count, sizeof(count), &precord->mlis.count);
+    state.subscribers = count;
+    state.key.tgid = pid >> 32;
+    ret = readUser(state.key.name, sizeof(state.key.name), precord->name);
+
+    checkUpdate(post_state_hash.update(&pid, &state));
+
+    return 0;
+};
+
+int exit_post(struct pt_regs *ctx)
+{
+    probeBegin(PROBE_EXIT_POST);
+    __u64 pid = bpf_get_current_pid_tgid();
+    struct post_state *state = post_state_hash.lookup(&pid);
+
+    if (!state)
+        return 0;
+
+    __u64 ktime_ns_end = bpf_ktime_get_ns();
+
+    struct post_stat zero_stat = {};
+    struct post_stat *stat = post_stats.lookup_or_try_init(&(state->key), &zero_stat);
+
+    if (stat)
+    {
+        __sync_fetch_and_add(&stat->posts, 1);
+        __sync_fetch_and_add(&stat->post_ns, ktime_ns_end - state->ktime_ns);
+        __sync_fetch_and_add(&stat->subscribers, state->subscribers);
+        __sync_fetch_and_add(&stat->queued, state->queued);
+        __sync_fetch_and_add(&stat->bytes, state->bytes);
+        __sync_fetch_and_add(&stat->overflows, state->overflows);
+    }
+
+    struct proc_frame *frame = currentFrame(pid);
+
+    if (frame && traceSampled(pid))
+    {
+        struct event_post e = {};
+
+        e.ktime_ns = state->ktime_ns;
+        e.ktime_ns_end = ktime_ns_end;
+        e.pid = pid >> 32;
+        memcpy(e.pvname, state->key.name, sizeof(e.pvname));
+        e.subscribers = state->subscribers;
+        e.queued = state->queued;
+        e.bytes = state->bytes;
+        e.overflows = state->overflows;
+        e.ptid = frame->tid;
+        e.psid = frame->sid;
+        e.tid = frame->tid;
+        e.sid = nextId();
+
+        countDrop(ring_buf_post.ringbuf_output(&e, sizeof(struct event_post), 0), RING_POST);
+    }
+
+    post_state_hash.delete(&pid);
+
+    return 0;
+};
+
+int enter_queue_log(struct pt_regs *ctx, struct evSubscrip *pevent, db_field_log *plog)
+{
+    probeBegin(PROBE_ENTER_QUEUE_LOG);
+    int ret;
+    __u64 pid = bpf_get_current_pid_tgid();
+    struct post_state *state = post_state_hash.lookup(&pid);
+
+    if (!state || !pevent || !plog)
+        return 0;
+
+    struct queue_state qstate = {};
+    qstate.pevent = pevent;
+    ret = readUser(&(qstate.nreplace), sizeof(qstate.nreplace), &pevent->nreplace);
+    checkUpdate(queue_state_hash.update(&pid, &qstate));
+
+    short field_size = 0;
+    long no_elements = 0;
+    ret = readUser(&field_size, sizeof(field_size), &plog->field_size);
+    ret = readUser(&no_elements, sizeof(no_elements), &plog->no_elements);
+
+    state->queued = state->queued + 1;
+    state->bytes = state->bytes + field_size * no_elements;
+
+    struct queued_log qlog = {};
+    qlog.ktime_ns = bpf_ktime_get_ns();
+    memcpy(&qlog.key, &state->key, sizeof(qlog.key));
+
+    __u64 key = (__u64)plog;
+    checkUpdate(queued_log_hash.update(&key, &qlog));
+
+    return 0;
+};
+
+int exit_queue_log(struct pt_regs *ctx)
+{
+    probeBegin(PROBE_EXIT_QUEUE_LOG);
+    int ret;
+    __u64 pid = bpf_get_current_pid_tgid();
+    struct queue_state *qstate = queue_state_hash.lookup(&pid);
+
+    if (!qstate)
+        return 0;
+
+    __u64 nreplace = 0;
+    ret = readUser(&nreplace, sizeof(nreplace), &qstate->pevent->nreplace);
+
+    struct post_state *state = post_state_hash.lookup(&pid);
+
+    if (state && nreplace != qstate->nreplace)
+    {
+        state->overflows = state->overflows + 1;
+    }
+
+    queue_state_hash.delete(&pid);
+
+    return 0;
+};
+
+int enter_delete_log(struct pt_regs *ctx, db_field_log *plog)
+{
+    probeBegin(PROBE_ENTER_DELETE_LOG);
+    __u64 pid = bpf_get_current_pid_tgid();
+    __u64 key = (__u64)plog;
+
+    if (queue_state_hash.lookup(&pid))
+    {
+        // The queue was full and db_queue_event_log replaced this log.
+        queued_log_hash.delete(&key);
+        return 0;
+    }
+
+    struct queued_log *qlog = queued_log_hash.lookup(&key);
+
+    if (!qlog)
+        return 0;
+
+    __u64 latency = bpf_ktime_get_ns() - qlog->ktime_ns;
+
+    struct post_stat zero_stat = {};
+    struct post_stat *stat = post_stats.lookup_or_try_init(&(qlog->key), &zero_stat);
+
+    if (stat)
+    {
+        __sync_fetch_and_add(&stat->delivered, 1);
+        __sync_fetch_and_add(&stat->latency_ns, latency);
+        if (latency > stat->latency_max_ns)
+            stat->latency_max_ns = latency;
+    }
+
+    queued_log_hash.delete(&key);
+
+    return 0;
+};
+
+// scanOnce(precord) / scanOnceCallback(precord, ...)
+int enter_scan_once(struct pt_regs *ctx)
+{
+    probeBegin(PROBE_ENTER_SCAN_ONCE);
+    __u64 pid = bpf_get_current_pid_tgid();
+    struct queued_record key = {.tgid = pid >> 32, .precord = PT_REGS_PARM1(ctx)};
+    __u64 now = bpf_ktime_get_ns();
+
+    checkUpdate(queued_records.update(&key, &now));
+    return 0;
+};
+
+// Allocator calls while the thread is in dbProcess, timed to their return
+static __always_inline int enterAlloc(__u32 kind, __u64 size, int counted)
+{
+    __u64 pid = bpf_get_current_pid_tgid();
+    struct alloc_call *open = alloc_call_hash.lookup(&pid);
+
+    // Called by the open one (freeListMalloc refilling its pool): part of
+    // it, only the return of the outer call counts
+    if (open)
+    {
+        open->depth++;
+        return 0;
+    }
+
+    if (!counted || !currentFrame(pid))
+        return 0;
+
+    struct alloc_call call = {.ktime_ns = bpf_ktime_get_ns(), .size = size, .kind = kind};
+    checkUpdate(alloc_call_hash.update(&pid, &call));
+    return 0;
+}
+
+int enter_malloc(struct pt_regs *ctx)
+{
+    probeBegin(PROBE_ENTER_MALLOC);
+    return enterAlloc(ALLOC_MALLOC, PT_REGS_PARM1(ctx), 1);
+};
+
+int enter_calloc(struct pt_regs *ctx)
+{
+    probeBegin(PROBE_ENTER_CALLOC);
+    return enterAlloc(ALLOC_MALLOC, PT_REGS_PARM1(ctx) * PT_REGS_PARM2(ctx), 1);
+};
+
+int enter_realloc(struct pt_regs *ctx)
+{
+    probeBegin(PROBE_ENTER_REALLOC);
+    return enterAlloc(ALLOC_MALLOC, PT_REGS_PARM2(ctx), 1);
+};
+
+int enter_free(struct pt_regs *ctx)
+{
+    probeBegin(PROBE_ENTER_FREE);
+    // free(NULL) is not counted, but still nests in an open call
+    return enterAlloc(ALLOC_FREE, 0, PT_REGS_PARM1(ctx) != 0);
+};
+
+int enter_freelist_malloc(struct pt_regs *ctx)
+{
+    probeBegin(PROBE_ENTER_FREELIST_MALLOC);
+    return enterAlloc(ALLOC_POOL, 0, 1);
+};
+
+int enter_freelist_free(struct pt_regs *ctx)
+{
+    probeBegin(PROBE_ENTER_FREELIST_FREE);
+    return enterAlloc(ALLOC_POOL, 0, 1);
+};
+
+int exit_alloc(struct pt_regs *ctx)
+{
+    probeBegin(PROBE_EXIT_ALLOC);
+    __u64 pid = bpf_get_current_pid_tgid();
+    struct alloc_call *pcall = alloc_call_hash.lookup(&pid);
+
+    if (!pcall)
+        return 0;
+
+    if (pcall->depth)
+    {
+        pcall->depth--;
+        return 0;
+    }
+
+    struct alloc_call call = *pcall;
+    __u64 ns = bpf_ktime_get_ns() - call.ktime_ns;
+    alloc_call_hash.delete(&pid);
+
+    // The innermost record: the one calling the allocator
+    struct proc_frame *frame = currentFrame(pid);
+    if (!frame)
+        return 0;
+
+    struct alloc_stat *stat = &frame->alloc;
+    if (call.kind == ALLOC_MALLOC)
+    {
+        stat->calls++;
+        stat->bytes += call.size;
+    }
+    else if (call.kind == ALLOC_FREE)
+        stat->frees++;
+    else
+        stat->pool++;
+    stat->ns += ns;
+
+    struct queued_record key = {.tgid = pid >> 32, .precord = (__u64)frame->precord};
+    struct alloc_record *rec = alloc_records.lookup(&key);
+
+    if (!rec)
+    {
+        __u32 zero = 0;
+        struct alloc_record *init = alloc_record_temp.lookup(&zero);
+        if (!init)
+            return 0;
+        __builtin_memset(init, 0, sizeof(*init));
+        readUserStr(init->name, sizeof(init->name), frame->precord->name);
+        checkUpdate(alloc_records.update(&key, init));
+        rec = alloc_records.lookup(&key);
+        if (!rec)
+            return 0;
+    }
+    if (call.kind == ALLOC_MALLOC)
+    {
+        __sync_fetch_and_add(&rec->calls, 1);
+        __sync_fetch_and_add(&rec->bytes, call.size);
+    }
+    else if (call.kind == ALLOC_FREE)
+        __sync_fetch_and_add(&rec->frees, 1);
+    else
+        __sync_fetch_and_add(&rec->pool, 1);
+    __sync_fetch_and_add(&rec->ns, ns);
+
+    return 0;
+};
+
+// Database link reads and writes of the record in dbProcess, as child spans
+// of its span. The target records they process are children of the link.
+static __always_inline int enterLink(__u32 dir, struct link *plink, short dbrType, void *pbuffer)
+{
+    __u64 pid = bpf_get_current_pid_tgid();
+    struct process_info *pproc_info = process_hash.lookup(&pid);
+
+    if (!pproc_info || !plink)
+        return 0;
+
+    struct key_proc_pv key = {.pid = pid, .count = pproc_info->count};
+    struct proc_frame *frame = proc_pv_hash.lookup(&key);
+
+    if (!frame)
+        return 0;
+
+    __u32 zero = 0;
+    struct link *ldata = link_data.lookup(&zero);
+    struct link_call *call = link_call_temp.lookup(&zero);
+
+    if (!ldata || !call)
+        return 0;
+
+    if (readUser(ldata, sizeof(struct link), plink) < 0)
+        return 0;
+
+    // Constants are copied from the link: not worth a span
+    if (ldata->type == CONSTANT)
+        return 0;
+
+    __builtin_memset(call, 0, sizeof(*call));
+    struct event_link *e = &call->e;
+    e->ktime_ns = bpf_ktime_get_ns();
+    e->tgid = pid >> 32;
+    e->dir = dir;
+    e->link_type = ldata->type;
+    e->dbr_type = dbrType;
+    call->plink = plink;
+    readUserStr(e->pvname, sizeof(e->pvname), frame->precord->name);
+    if ((ldata->type == DB_LINK || ldata->type == CA_LINK) && ldata->value.pv_link.pvname)
+        readUserStr(e->target, sizeof(e->target), ldata->value.pv_link.pvname);
+    else if (ldata->text)
+        readUserStr(e->target, sizeof(e->target), ldata->text);
+
+    e->ptid = frame->tid;
+    e->psid = frame->sid;
+    e->tid = frame->tid;
+    e->sid = nextId();
+    e->sample = traceThreshold(pid);
+    frame->link_sid = e->sid;
+
+    // The value written is known now, the value read at the return
+    if (dir == LINK_PUT && pbuffer)
+        e->val_type = pickPvValue(dbrType, pbuffer, &(e->val_i), &(e->val_u), &(e->val_d), e->val_s);
+    else
+        call->pbuffer = pbuffer;
+
+    checkUpdate(link_call_hash.update(&key, call));
+    return 0;
+}
+
+// long dbGetLink(struct link *, short dbrType, void *pbuffer, long *options, long *nRequest)
+int enter_get_link(struct pt_regs *ctx)
+{
+    probeBegin(PROBE_ENTER_GET_LINK);
+    return enterLink(LINK_GET, (struct link *)PT_REGS_PARM1(ctx), PT_REGS_PARM2(ctx),
+                     (void *)PT_REGS_PARM3(ctx));
+};
+
+// long dbPutLink(struct link *, short dbrType, const void *pbuffer, long nRequest)
+int enter_put_link(struct pt_regs *ctx)
+{
+    probeBegin(PROBE_ENTER_PUT_LINK);
+    return enterLink(LINK_PUT, (struct link *)PT_REGS_PARM1(ctx), PT_REGS_PARM2(ctx),
+                     (void *)PT_REGS_PARM3(ctx));
+};
+
+int exit_link(struct pt_regs *ctx)
+{
+    probeBegin(PROBE_EXIT_LINK);
+    __u64 pid = bpf_get_current_pid_tgid();
+    struct process_info *pproc_info = process_hash.lookup(&pid);
+
+    if (!pproc_info)
+        return 0;
+
+    struct key_proc_pv key = {.pid = pid, .count = pproc_info->count};
+    struct link_call *call = link_call_hash.lookup(&key);
+
+    if (!call)
+        return 0;
+
+    struct event_link *e = &call->e;
+    e->ktime_ns_end = bpf_ktime_get_ns();
+    e->status = PT_REGS_RC(ctx);
+    if (e->dir == LINK_GET && e->status == 0 && call->pbuffer)
+        e->val_type = pickPvValue(e->dbr_type, call->pbuffer, &(e->val_i), &(e->val_u), &(e->val_d), e->val_s);
+
+    struct proc_frame *frame = proc_pv_hash.lookup(&key);
+    if (frame)
+        frame->link_sid = 0;
+
+    __u64 ns = e->ktime_ns_end - e->ktime_ns;
+    struct link_key lkey = {.plink = (__u64)call->plink, .tgid = e->tgid, .dir = e->dir};
+    struct link_stat *stat = link_stats.lookup(&lkey);
+
+    if (!stat)
+    {
+        __u32 zero = 0;
+        struct link_stat *init = link_stat_temp.lookup(&zero);
+        if (init)
+        {
+            __builtin_memset(init, 0, sizeof(*init));
+            init->link_type = e->link_type;
+            memcpy(init->pvname, e->pvname, sizeof(init->pvname));
+            memcpy(init->target, e->target, sizeof(init->target));
+            checkUpdate(link_stats.update(&lkey, init));
+            stat = link_stats.lookup(&lkey);
+        }
+    }
+    if (stat)
+    {
+        __sync_fetch_and_add(&stat->count, 1);
+        __sync_fetch_and_add(&stat->ns, ns);
+        if (ns > stat->max_ns)
+            stat->max_ns = ns;
+        if (e->status)
+            __sync_fetch_and_add(&stat->errors, 1);
+    }
+    lkey.slot = bpf_log2l(ns);
+    link_latency.increment(lkey);
+
+    if (traceSampled(pid))
+        countDrop(ring_buf_link.ringbuf_output(e, sizeof(struct event_link), 0), RING_LINK);
+    link_call_hash.delete(&key);
+
+    return 0;
+};
+
+// Loading attaches a tracepoint: not when adopting the holder's (pinned.py)
+#if defined(STALL_WATCH) && !defined(ADOPT)
+TRACEPOINT_PROBE(sched, sched_switch)
+{
+    probeBegin(PROBE_SCHED_SWITCH);
+    // prev is the current task: remember where it blocked while in dbProcess
+    __u64 pid = bpf_get_current_pid_tgid();
+    struct proc_frame *frame = currentFrame(pid);
+
+    if (!frame)
+        return 0;
+
+    __u32 tid = pid;
+    int stack_id = stall_stacks.get_stackid(args, BPF_F_USER_STACK);
+    checkUpdate(stall_stack_hash.update(&tid, &stack_id));
+
+    checkStall(pid, frame, stack_id);
+
+    return 0;
+};
+#endif
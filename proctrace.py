@@ -3,10 +3,14 @@
 from __future__ import print_function
 from os import getpid
 import argparse
+import collections
+import ctypes as ct
+import signal
+import socket
 import time
 import sys
 
-from bcc import BPF
+from bcc import BPF, PerfType, PerfSWConfig
 
 
 from opentelemetry.sdk.trace.export import (
@@ -18,95 +22,881 @@ from opentelemetry.sdk.resources import SERVICE_NAME, Resource
 
 from opentelemetry.exporter.zipkin.proto.http import ZipkinExporter
 
-from tracezipkin import ProcessTracer
-from putzipkin import PutTracer
-from caputzipkin import CaputTracer
+from tracezipkin import ProcessTracer, Data_process
+from putzipkin import PutTracer, Data as Data_put
+from caputzipkin import CaputTracer, Data as Data_caput
+from profiler import ProcessProfiler, GROUP_BY_PV, GROUP_BY_RTYPE
+from iocdb import IocDatabase
+from support import SupportProbes
+from supportzipkin import SupportTracer, Data as Data_support
+from postzipkin import PostTracer, Data as Data_post
+from stall import StallWatch, load_thresholds
+from flightrec import FlightRecorder
+from arrayzipkin import ArrayTracer, Data_array, load_array_layouts
+from changefilter import ChangeFilterStats
+from chainagg import ChainAggregator
+from selftime import SelfTimeTable
+from correxport import CorrelatorExporter, NullExporter, TeeExporter
+from eventlog import SegmentWriter
+from spanindex import SpanIndex, IndexExporter, serve
+from iocs import IocRegistry
+import metrics
+from probestats import ProbeStats, enable_bpf_stats
+from governor import Governor
+from scanjitter import ScanJitter
+from allocs import AllocProbes
+from linkzipkin import LinkTracer, Data_link
+import threadview
+from tracezipkin import BOOT_TIME_NS
+import spanids
+from pinned import PIN_DIR, pin, unpin, load_manifest, adopt
 
 
 parser = argparse.ArgumentParser(description=__doc__)
 parser.add_argument(
-    "-p", "-path", dest="libpath", required=True, help="Path to libdbCore"
+    "-p",
+    "-path",
+    dest="libpath",
+    action="append",
+    default=[],
+    help="Path to libdbCore (repeat for every build in use on the host)",
 )
-
-args = parser.parse_args()
-libpath = args.libpath
-
-b = BPF(src_file="proctrace.c", debug=0)
-b.attach_uprobe(
-    name=libpath,
-    sym="dbCreateRecord",
-    fn_name="enter_createrec",
+parser.add_argument(
+    "--discover",
+    dest="discover",
+    nargs="?",
+    const=r"^libdbCore\.so",
+    help="Also trace the libraries matching this file name regular expression "
+    "mapped by any process, containers included (default: libdbCore.so*)",
 )
-b.attach_uretprobe(
-    name=libpath,
-    sym="dbCreateRecord",
-    fn_name="exit_createrec",
+parser.add_argument(
+    "-F",
+    "--profile-freq",
+    dest="profile_freq",
+    type=int,
+    default=0,
+    help="Sample the user stack of threads inside dbProcess at this frequency (Hz)",
 )
-
-b.attach_uprobe(
-    name=libpath,
-    sym="dbProcess",
-    fn_name="enter_process",
+parser.add_argument(
+    "--profile-by",
+    dest="profile_by",
+    choices=[GROUP_BY_PV, GROUP_BY_RTYPE],
+    default=GROUP_BY_PV,
+    help="Group the folded stacks per PV or per record type",
 )
-b.attach_uretprobe(
-    name=libpath,
-    sym="dbProcess",
-    fn_name="exit_process",
+parser.add_argument(
+    "--profile-out",
+    dest="profile_out",
+    default="-",
+    help="Write the folded stacks to this file on exit (default: stdout)",
 )
-
-b.attach_uprobe(
-    name=libpath,
-    sym="dbGetRecordName",
-    fn_name="enter_dbfirstrecord",
+parser.add_argument(
+    "--ioc-pid",
+    dest="ioc_pid",
+    type=int,
+    default=0,
+    help="PID of a running IOC to read the record database layout from",
+)
+parser.add_argument(
+    "--support",
+    dest="support",
+    action="store_true",
+    help="Probe the rset/dset routines of the records of --ioc-pid",
+)
+parser.add_argument(
+    "--post-report",
+    dest="post_report",
+    type=float,
+    default=0,
+    help="Trace db_post_events and print the per-PV monitor cost every N seconds",
+)
+parser.add_argument(
+    "--stall-threshold",
+    dest="stall_threshold",
+    type=float,
+    default=0,
+    help="Report dbProcess frames open longer than N seconds",
+)
+parser.add_argument(
+    "--stall-config",
+    dest="stall_config",
+    help='Per-record stall thresholds, lines of "<record name> <seconds>"',
+)
+parser.add_argument(
+    "--stall-interval",
+    dest="stall_interval",
+    type=float,
+    default=1.0,
+    help="Seconds between sweeps for threads stuck without running",
+)
+parser.add_argument(
+    "--flight-recorder",
+    dest="flight_recorder",
+    type=float,
+    default=0,
+    help="Keep the last N seconds of events and export them only on a trigger "
+    "(latency, alarm or SIGUSR1)",
+)
+parser.add_argument(
+    "--fr-post",
+    dest="fr_post",
+    type=float,
+    default=1.0,
+    help="Seconds recorded after the trigger before the window is exported",
 )
-b.attach_uretprobe(
-    name=libpath,
-    sym="dbGetRecordName",
-    fn_name="exit_dbfirstrecord",
+parser.add_argument(
+    "--fr-max-events",
+    dest="fr_max_events",
+    type=int,
+    default=200000,
+    help="Maximum number of events kept by the flight recorder",
 )
-b.attach_uprobe(
-    name=libpath,
-    sym="dbPutField",
-    fn_name="enter_dbput",
+parser.add_argument(
+    "--fr-latency-ms",
+    dest="fr_latency_ms",
+    type=float,
+    default=0,
+    help="Trigger when a process, put or CA put span is longer than this",
 )
-b.attach_uretprobe(
-    name=libpath,
-    sym="dbPutField",
-    fn_name="exit_dbput",
+parser.add_argument(
+    "--fr-alarm",
+    dest="fr_alarm",
+    action="store_true",
+    help="Trigger when a record goes into alarm (SEVR from dbCommon at exit)",
 )
-b.attach_uprobe(
-    name=libpath,
-    sym="dbCaPutLinkCallback",
-    fn_name="enter_caput",
+parser.add_argument(
+    "--capture-arrays",
+    dest="capture_arrays",
+    action="store_true",
+    help="Capture array values of puts, CA puts and array records (VAL/FTVL/NORD "
+    "layouts of the record types are read from --ioc-pid)",
+)
+parser.add_argument(
+    "--array-elements",
+    dest="array_elements",
+    type=int,
+    default=256,
+    help="Maximum number of array elements captured",
+)
+parser.add_argument(
+    "--array-bytes",
+    dest="array_bytes",
+    type=int,
+    default=2048,
+    help="Maximum number of array bytes captured",
+)
+parser.add_argument(
+    "--changed-only",
+    dest="changed_only",
+    action="store_true",
+    help="Drop process spans whose value and alarm state did not change "
+    "(kept when a nested record changed)",
+)
+parser.add_argument(
+    "--flush-interval",
+    dest="flush_interval",
+    type=float,
+    default=10.0,
+    help="Seconds between prints of the per-record suppressed counts",
+)
+parser.add_argument(
+    "--aggregate",
+    dest="aggregate",
+    type=float,
+    default=0,
+    help="Export one representative trace with duration statistics per chain "
+    "structure every N seconds, plus the outliers",
+)
+parser.add_argument(
+    "--agg-outlier",
+    dest="agg_outlier",
+    type=float,
+    default=3.0,
+    help="Export the full chain when a record takes longer than this many "
+    "times its median of the previous interval",
+)
+parser.add_argument(
+    "--selftime-report",
+    dest="selftime_report",
+    type=float,
+    default=0,
+    help="Print the rolling per-record share of self time every N seconds",
 )
-b.attach_uretprobe(
-    name=libpath,
-    sym="dbCaPutLinkCallback",
-    fn_name="exit_caput",
+parser.add_argument(
+    "--correlator",
+    dest="correlator",
+    help="Send the spans to correlator.py at HOST:PORT instead of Zipkin, to "
+    "join the traces of CA links between IOCs",
+)
+parser.add_argument(
+    "--host-name",
+    dest="host_name",
+    default=socket.gethostname(),
+    help="Name of this collector in the correlator (default: host name)",
+)
+parser.add_argument(
+    "--exporter",
+    dest="exporter",
+    choices=["zipkin", "none"],
+    default="zipkin",
+    help="Where the spans go (none: assemble them and drop them)",
+)
+parser.add_argument(
+    "--count-events",
+    dest="count_events",
+    action="store_true",
+    help="Print the number of events received from each ring buffer on exit",
+)
+parser.add_argument(
+    "--record",
+    dest="record",
+    help="Write the raw ring buffer events to the segment files <RECORD>.NNN "
+    "(see replay.py)",
+)
+parser.add_argument(
+    "--segment-mb",
+    dest="segment_mb",
+    type=int,
+    default=64,
+    help="Size of a recording segment file",
+)
+parser.add_argument(
+    "--store",
+    dest="store",
+    help="Also write the finished spans to Parquet files under this directory "
+    "(see spanquery.py)",
+)
+parser.add_argument(
+    "--index",
+    dest="index",
+    type=int,
+    default=0,
+    help="Keep the last N spans in memory and answer queries on --index-listen",
+)
+parser.add_argument(
+    "--index-listen",
+    dest="index_listen",
+    default="/tmp/proctrace.sock",
+    help="Unix socket path or HOST:PORT of the span query endpoint",
+)
+parser.add_argument(
+    "--metrics-listen",
+    dest="metrics_listen",
+    help="Serve OpenMetrics on HOST:PORT/metrics",
+)
+parser.add_argument(
+    "--metrics-max-pvs",
+    dest="metrics_max_pvs",
+    type=int,
+    default=1000,
+    help="PV names with their own metrics label, the others are summed",
+)
+parser.add_argument(
+    "--stats",
+    dest="stats",
+    type=float,
+    default=0,
+    help="Count the cost of every probe handler and print it with the "
+    "latency added per traced call every N seconds",
+)
+parser.add_argument(
+    "--governor",
+    dest="governor",
+    action="store_true",
+    help="Lower the share of sampled traces, down to metrics-only, while the "
+    "probes are over the CPU or ring buffer drop budget",
+)
+parser.add_argument(
+    "--gov-cpu",
+    dest="gov_cpu",
+    type=float,
+    default=5.0,
+    help="Probe CPU budget in percent of one CPU",
+)
+parser.add_argument(
+    "--gov-drops",
+    dest="gov_drops",
+    type=float,
+    default=0,
+    help="Ring buffer drop budget in events per second",
+)
+parser.add_argument(
+    "--gov-min-ratio",
+    dest="gov_min_ratio",
+    type=float,
+    default=0.01,
+    help="Lowest sampling ratio before switching to metrics-only",
+)
+parser.add_argument(
+    "--gov-interval",
+    dest="gov_interval",
+    type=float,
+    default=2.0,
+    help="Seconds between governor decisions",
+)
+parser.add_argument(
+    "--gov-relax",
+    dest="gov_relax",
+    type=int,
+    default=5,
+    help="Decisions under half the budget before relaxing one step",
+)
+parser.add_argument(
+    "--gov-trap-ns",
+    dest="gov_trap_ns",
+    type=int,
+    default=1000,
+    help="Cost of a uprobe hit outside the BPF program, added per run",
+)
+parser.add_argument(
+    "--scan-jitter",
+    dest="scan_jitter",
+    type=float,
+    default=0,
+    help="Count the period jitter and missed scans of periodically scanned "
+    "records in the kernel and print them every N seconds",
+)
+parser.add_argument(
+    "--scan-miss",
+    dest="scan_miss",
+    type=float,
+    default=1.5,
+    help="Intervals longer than this multiple of the period are missed scans",
 )
+parser.add_argument(
+    "--scan-period",
+    dest="scan_period",
+    action="append",
+    default=[],
+    help='Period of a scan thread not named after it, "<thread name>=<seconds>"',
+)
+parser.add_argument(
+    "--threads",
+    dest="threads",
+    action="store_true",
+    help="Show the busy share, queue wait and top records by self time of "
+    "every IOC thread, refreshed every --threads-interval seconds",
+)
+parser.add_argument(
+    "--threads-listen",
+    dest="threads_listen",
+    help="Serve the thread utilization as JSON on HOST:PORT/threads",
+)
+parser.add_argument(
+    "--threads-interval",
+    dest="threads_interval",
+    type=float,
+    default=1.0,
+    help="Seconds between refreshes of the thread utilization",
+)
+parser.add_argument(
+    "--alloc-report",
+    dest="alloc_report",
+    type=float,
+    default=0,
+    help="Count the malloc/free and freeList calls made while processing "
+    "each record and print the records spending the most time in the "
+    "allocator every N seconds",
+)
+parser.add_argument(
+    "--link-report",
+    dest="link_report",
+    type=float,
+    default=0,
+    help="Trace dbGetLink/dbPutLink as child spans of the record and print "
+    "the links with the most time spent in them every N seconds",
+)
+parser.add_argument(
+    "--ioc-config",
+    dest="ioc_config",
+    help="JSON rules giving each IOC its service name, sampling and PV filters",
+)
+parser.add_argument(
+    "--ioc-scan",
+    dest="ioc_scan",
+    type=float,
+    default=5.0,
+    help="Seconds between scans for started and exited IOCs",
+)
+state = parser.add_mutually_exclusive_group()
+state.add_argument(
+    "--hold",
+    dest="hold",
+    nargs="?",
+    const=PIN_DIR,
+    help="Attach the probes, pin the maps and programs under this bpffs "
+    f"directory (default: {PIN_DIR}) and keep them attached without collecting",
+)
+state.add_argument(
+    "--adopt",
+    dest="adopt",
+    nargs="?",
+    const=PIN_DIR,
+    help="Collect from the maps and ring buffers pinned by --hold instead of "
+    "attaching the probes",
+)
+parser.add_argument(
+    "--metrics-pv-regex",
+    dest="metrics_pv_regex",
+    help="Only PV names matching this get their own metrics label",
+)
+
+# Options attaching probes with rings or tables of their own
+PROBE_OPTIONS = [
+    ("post_report", "--post-report"),
+    ("link_report", "--link-report"),
+    ("alloc_report", "--alloc-report"),
+    ("profile_freq", "-F"),
+]
+
+args = parser.parse_args()
+manifest = None
+if args.adopt:
+    manifest = load_manifest(args.adopt)
+    args.libpath = args.libpath or manifest["libpaths"]
+    args.discover = args.discover or manifest["discover"]
+    # What is attached is the holder's, like its compile options below
+    held = manifest["probes"]
+    applied = []
+    for name, option in PROBE_OPTIONS:
+        if bool(getattr(args, name)) != bool(held[name]):
+            setattr(args, name, held[name])
+            applied.append(f"{option} {held[name]}")
+    if held["support"] != (args.ioc_pid if args.support else 0):
+        args.support = bool(held["support"])
+        args.ioc_pid = held["support"] or args.ioc_pid
+        applied.append(f"--support --ioc-pid {held['support']}" if held["support"] else "no --support")
+    if (args.threads or args.threads_listen) and not held["threads"]:
+        # Nothing is left unread the other way round: no ring behind it
+        args.threads = False
+        args.threads_listen = None
+        applied.append("no --threads")
+    if applied:
+        print(f"using the probes of the holder: {', '.join(applied)}")
+libpaths = args.libpath
+if not libpaths and not args.discover:
+    parser.error("give -p <libdbCore> or --discover")
+
+# (symbol, enter_/exit_ function suffix) of the probes always attached
+PROBES = [
+    ("dbCreateRecord", "createrec"),
+    ("dbProcess", "process"),
+    ("dbGetRecordName", "dbfirstrecord"),
+    ("dbPutField", "dbput"),
+    ("dbCaPutLinkCallback", "caput"),
+]
+
+stall_watch = args.stall_threshold > 0 or args.stall_config is not None
+thread_view = args.threads or args.threads_listen is not None
+
+# (symbols to try, handler) of the queues feeding the IOC threads
+THREAD_PROBES = [
+    (("scanOnceCallback", "scanOnce"), "enter_scan_once"),
+]
+
+# (symbol, enter handler) of the database link reads and writes
+LINK_PROBES = [
+    ("dbGetLink", "enter_get_link"),
+    ("dbPutLink", "enter_put_link"),
+]
+
+cflags = spanids.cflags()
+if stall_watch:
+    cflags.append("-DSTALL_WATCH")
+    cflags.append(f"-DSTALL_DEFAULT_NS={int(args.stall_threshold * 1e9)}ULL")
+if args.capture_arrays:
+    cflags.append("-DCAPTURE_ARRAYS")
+    cflags.append(f"-DARRAY_CAPTURE_ELEMS={args.array_elements}")
+    cflags.append(f"-DARRAY_CAPTURE_BYTES={args.array_bytes}")
+if args.changed_only:
+    cflags.append("-DCHANGE_FILTER")
+if args.stats > 0:
+    cflags.append("-DPROBE_STATS")
+if args.governor:
+    cflags.append("-DGOVERNOR")
+if args.scan_jitter > 0:
+    cflags.append("-DSCAN_JITTER")
+    cflags.append(f"-DSCAN_MISS_PCT={int(args.scan_miss * 100)}")
+if thread_view:
+    cflags.append("-DTHREAD_VIEW")
+
+if manifest:
+    if sorted(cflags) != sorted(manifest["cflags"]):
+        print(f"using the options of the holder: {' '.join(manifest['cflags'])}")
+    cflags = manifest["cflags"]
+    b = BPF(src_file="proctrace.c", cflags=cflags + ["-DADOPT"], debug=0)
+    adopt(b, args.adopt, manifest)
+else:
+    b = BPF(src_file="proctrace.c", cflags=cflags, debug=0)
+
+if args.stall_config and not manifest:
+    load_thresholds(b, args.stall_config)
+
+
+def post_probes():
+    yield "db_post_events", "enter_post", "exit_post"
+    yield "db_delete_field_log", "enter_delete_log", None
+    # db_queue_event_log is static and may be inlined or stripped.
+    yield "db_queue_event_log", "enter_queue_log", "exit_queue_log"
+
+
+def attach_lib(libpath):
+    """Every IOC mapping the library is traced."""
+    for sym, fn in PROBES:
+        b.attach_uprobe(name=libpath, sym=sym, fn_name=f"enter_{fn}")
+        b.attach_uretprobe(name=libpath, sym=sym, fn_name=f"exit_{fn}")
+    if args.post_report > 0:
+        for sym, enter, exit in post_probes():
+            try:
+                b.attach_uprobe(name=libpath, sym=sym, fn_name=enter)
+                if exit:
+                    b.attach_uretprobe(name=libpath, sym=sym, fn_name=exit)
+            except Exception:
+                print(f"{sym} not found in {libpath}: no queue and delivery statistics")
+    if thread_view:
+        for syms, fn in THREAD_PROBES:
+            for sym in syms:
+                try:
+                    b.attach_uprobe(name=libpath, sym=sym, fn_name=fn)
+                    break
+                except Exception:
+                    continue
+            else:
+                print(f"{syms[0]} not found in {libpath}: no queue wait")
+    if args.link_report > 0:
+        for sym, fn in LINK_PROBES:
+            b.attach_uprobe(name=libpath, sym=sym, fn_name=fn)
+            b.attach_uretprobe(name=libpath, sym=sym, fn_name="exit_link")
+
+
+def detach_lib(libpath):
+    probes = [(sym, True) for sym, _ in PROBES]
+    if args.post_report > 0:
+        probes += [(sym, exit is not None) for sym, _, exit in post_probes()]
+    if thread_view:
+        probes += [(sym, False) for syms, _ in THREAD_PROBES for sym in syms]
+    if args.link_report > 0:
+        probes += [(sym, True) for sym, _ in LINK_PROBES]
+    for sym, ret in probes:
+        try:
+            b.detach_uprobe(name=libpath, sym=sym)
+            if ret:
+                b.detach_uretprobe(name=libpath, sym=sym)
+        except Exception:
+            pass
+
+
+if manifest:
+    # The holder attaches the libraries it discovers
+    iocs = IocRegistry(b, libpaths, args.ioc_config, args.discover)
+else:
+    for libpath in libpaths:
+        attach_lib(libpath)
+    iocs = IocRegistry(b, libpaths, args.ioc_config, args.discover, attach_lib, detach_lib)
+
+alloc_probes = None
+if args.alloc_report > 0:
+    alloc_probes = AllocProbes(b, iocs)
+
+
+def scan():
+    iocs.scan()
+    if alloc_probes and not manifest:
+        alloc_probes.sync()
 
 
+scan()
+
+profiler = None
+if args.profile_freq > 0:
+    if not manifest:
+        b.attach_perf_event(
+            ev_type=PerfType.SOFTWARE,
+            ev_config=PerfSWConfig.CPU_CLOCK,
+            fn_name="sample_process",
+            sample_freq=args.profile_freq,
+        )
+    profiler = ProcessProfiler(b, args.profile_by)
+
+db = None
+if args.ioc_pid:
+    ioc = iocs.get(args.ioc_pid)
+    if ioc:
+        db = IocDatabase(b, args.ioc_pid, ioc.path, ioc.root)
+    else:
+        print(f"{args.ioc_pid} does not map a traced libdbCore")
+
+support = None
+if args.support and db:
+    support = SupportProbes(b, db)
+    print(f"attached {support.attach(probe=not manifest)} support routines")
+
+if args.capture_arrays and db and not manifest:
+    print(f"found {load_array_layouts(b, db)} array record types")
+
+if args.hold:
+    probes = {name: getattr(args, name) for name, _ in PROBE_OPTIONS}
+    probes["support"] = args.ioc_pid if support else 0
+    probes["threads"] = thread_view
+    pin(b, args.hold, cflags, probes, libpaths, args.discover)
+    print(f"holding the probes, state pinned under {args.hold}")
+    signal.signal(signal.SIGTERM, lambda signum, frame: sys.exit())
+    try:
+        while 1:
+            time.sleep(args.ioc_scan)
+            scan()
+    except (KeyboardInterrupt, SystemExit):
+        unpin(args.hold)
+        sys.exit()
+
+probe_stats = None
+bpf_stats_fd = None
+if args.stats > 0:
+    probe_stats = ProbeStats(b)
+if args.stats > 0 or args.governor:
+    # Stays open until the collector exits
+    bpf_stats_fd = enable_bpf_stats()
+    if bpf_stats_fd is None:
+        # Let atexit restore the sysctl on SIGTERM too
+        signal.signal(signal.SIGTERM, lambda signum, frame: sys.exit())
+
+governor = None
+if args.governor:
+    governor = Governor(
+        b, args.gov_cpu, args.gov_drops, args.gov_min_ratio, args.gov_relax, args.gov_trap_ns
+    )
+
 resource = Resource(attributes={SERVICE_NAME: "process-service"})
-zipkin_exporter = ZipkinExporter(endpoint="http://localhost:9411/api/v2/spans")
+if args.exporter == "none":
+    zipkin_exporter = NullExporter()
+elif args.correlator:
+    zipkin_exporter = CorrelatorExporter(args.correlator, args.host_name)
+else:
+    zipkin_exporter = ZipkinExporter(endpoint="http://localhost:9411/api/v2/spans")
+if args.store:
+    # pyarrow is only needed for the span store
+    from spanstore import ColumnarExporter
+
+    zipkin_exporter = TeeExporter(
+        [zipkin_exporter, ColumnarExporter(args.store, args.host_name)]
+    )
+if args.index > 0:
+    span_index = SpanIndex(args.index)
+    serve(span_index, args.index_listen)
+    zipkin_exporter = TeeExporter([zipkin_exporter, IndexExporter(span_index)])
 
 # processor = BatchSpanProcessor(ConsoleSpanExporter())
-prt = ProcessTracer("process-service", BatchSpanProcessor(zipkin_exporter))
-ptt = PutTracer("put-service", BatchSpanProcessor(zipkin_exporter))
-cpt = CaputTracer("caput-service", BatchSpanProcessor(zipkin_exporter))
+processors = {}
+
+
+def processor(name):
+    processors[name] = BatchSpanProcessor(zipkin_exporter)
+    return processors[name]
+
+
+prt = ProcessTracer("process-service", processor("process"))
+ptt = PutTracer("put-service", processor("put"))
+cpt = CaputTracer("caput-service", processor("caput"))
+
+# Ring buffers assembled into spans: (name, callback, event type, reset)
+rings = [
+    ("ring_buf", prt.callback, Data_process, prt.reset),
+    ("ring_buf_put", ptt.callback, Data_put, None),
+    ("ring_buf_caput", cpt.callback, Data_caput, None),
+]
+
+# [interval, next deadline, function] run from the poll loop
+periodic = []
+
+prt.iocs = ptt.iocs = cpt.iocs = iocs
+periodic.append([args.ioc_scan, time.monotonic() + args.ioc_scan, scan])
+
+if args.aggregate > 0:
+    prt.aggregator = ChainAggregator(prt.export_chain, args.agg_outlier)
+    periodic.append([args.aggregate, time.monotonic() + args.aggregate, prt.aggregator.flush])
+
+if args.selftime_report > 0:
+    prt.selftime = SelfTimeTable()
+    periodic.append(
+        [args.selftime_report, time.monotonic() + args.selftime_report, prt.selftime.report]
+    )
+
+if support:
+    spt = SupportTracer("support-service", processor("support"), support)
+    spt.iocs = iocs
+    rings.append(("ring_buf_support", spt.callback, Data_support, None))
+
+if args.post_report > 0:
+    pst = PostTracer("post-service", processor("post"), b["post_stats"])
+    pst.iocs = iocs
+    rings.append(("ring_buf_post", pst.callback, Data_post, None))
+    periodic.append([args.post_report, time.monotonic() + args.post_report, pst.report])
+
+link_tracer = None
+if args.link_report > 0:
+    link_tracer = LinkTracer("link-service", processor("link"), b)
+    link_tracer.iocs = iocs
+    rings.append(("ring_buf_link", link_tracer.callback, Data_link, None))
+    periodic.append([args.link_report, time.monotonic() + args.link_report, link_tracer.report])
+
+if args.capture_arrays:
+    art = ArrayTracer("array-service", processor("array"))
+    art.iocs = iocs
+    rings.append(("ring_buf_array", art.callback, Data_array, None))
+
+if probe_stats:
+    periodic.append([args.stats, time.monotonic() + args.stats, probe_stats.report])
+
+if governor:
+    periodic.append([args.gov_interval, time.monotonic() + args.gov_interval, governor.poll])
+
+scan_jitter = None
+if args.scan_jitter > 0:
+    periods = {}
+    for item in args.scan_period:
+        name, _, seconds = item.rpartition("=")
+        periods[name] = float(seconds)
+    scan_jitter = ScanJitter(b, iocs, periods)
+    periodic.append([args.scan_jitter, time.monotonic() + args.scan_jitter, scan_jitter.report])
+
+if alloc_probes:
+    periodic.append([args.alloc_report, time.monotonic() + args.alloc_report, alloc_probes.report])
+
+if thread_view:
+    threads = threadview.ThreadView(b, iocs, live=args.threads)
+    if args.threads_listen:
+        threadview.serve(threads, args.threads_listen)
+    periodic.append([args.threads_interval, time.monotonic() + args.threads_interval, threads.refresh])
+
+if args.changed_only:
+    cfs = ChangeFilterStats(b["change_state_hash"])
+    periodic.append([args.flush_interval, time.monotonic() + args.flush_interval, cfs.flush])
+
+if args.metrics_listen:
+    pmt = metrics.Metrics(args.metrics_max_pvs, args.metrics_pv_regex)
+    prt.metrics = ptt.metrics = cpt.metrics = pmt
+    pmt.gauge(
+        "proctrace_ring_drops_total",
+        "Events lost because a ring buffer was full.",
+        lambda: [(f'ring="{metrics.RING_NAMES[k.value]}"', v.value) for k, v in b["ring_drops"].items()],
+    )
+    pmt.gauge(
+        "proctrace_export_queue",
+        "Spans waiting to be exported.",
+        lambda: [(f'tracer="{n}"', metrics.queue_depth(p)) for n, p in list(processors.items())],
+    )
+    pmt.gauge(
+        "proctrace_open_spans",
+        "dbProcess enters waiting for their exit.",
+        lambda: [("", sum(len(p) for p in list(prt.procs.values())))],
+    )
+    if probe_stats:
+        probe_stats.gauges(pmt)
+    if scan_jitter:
+        scan_jitter.gauges(pmt)
+    if alloc_probes:
+        alloc_probes.gauges(pmt)
+    if link_tracer:
+        link_tracer.gauges(pmt)
+    if governor:
+        governor.gauges(pmt)
+        pmt.histogram(
+            "epics_ioc_process_seconds",
+            "dbProcess duration per IOC, counted in the kernel for every trace.",
+            lambda: governor.latency(iocs),
+        )
+    metrics.serve(pmt, args.metrics_listen)
+
+flight = None
+if args.flight_recorder > 0:
+    flight = FlightRecorder(
+        args.flight_recorder,
+        args.fr_post,
+        args.fr_max_events,
+        args.fr_latency_ms,
+        args.fr_alarm,
+    )
+    signal.signal(signal.SIGUSR1, lambda signum, frame: flight.trigger("SIGUSR1"))
+    periodic.append([0, 0, flight.poll])
+
+received = collections.Counter()
+
+
+def counted(name, callback):
+    def count(cpu, data, size):
+        received[name] += 1
+        callback(cpu, data, size)
+
+    return count
+
+
+def recorded(name, callback, ctype):
+    # Stamped with the kernel time the event was sent (the end of a span
+    # sent at its end), not the receive time with the jitter of the polls
+    field = getattr(ctype, "ktime_ns_end", None) or ctype.ktime_ns
+
+    def record(cpu, data, size):
+        payload = ct.string_at(data, size)
+        ts_ns = ct.c_uint64.from_buffer_copy(payload, field.offset).value
+        recorder.write(name, cpu, ts_ns, payload)
+        callback(cpu, data, size)
+
+    return record
+
+
+recorder = None
+if args.record:
+    recorder = SegmentWriter(
+        args.record,
+        [name for name, _, _, _ in rings],
+        args.segment_mb << 20,
+        meta={
+            "boot_time_ns": BOOT_TIME_NS,
+            "trace_id_hi": spanids.TRACE_ID_HI,
+            "host": args.host_name,
+        },
+    )
+    periodic.append([1.0, time.monotonic() + 1.0, recorder.flush])
+
+for name, callback, ctype, reset in rings:
+    if flight:
+        callback = flight.wrap(name, callback, ctype, reset)
+    if args.count_events:
+        callback = counted(name, callback)
+    if recorder:
+        callback = recorded(name, callback, ctype)
+    b[name].open_ring_buffer(callback)
 
-b["ring_buf"].open_ring_buffer(prt.callback)
-b["ring_buf_put"].open_ring_buffer(ptt.callback)
-b["ring_buf_caput"].open_ring_buffer(cpt.callback)
+if stall_watch:
+    stw = StallWatch("stall-service", processor("stall"), b)
+    stw.iocs = iocs
+    b["ring_buf_stall"].open_ring_buffer(stw.callback)
+    periodic.append([args.stall_interval, time.monotonic() + args.stall_interval, stw.sweep])
 
 
-print("start")
+print("start", flush=True)
 
 try:
     while 1:
-        b.ring_buffer_poll()
-        # or b.ring_buffer_consume()
-        time.sleep(0.5)
+        # Wake up for the next periodic task even when no event comes
+        now = time.monotonic()
+        wait = min([task[1] - now for task in periodic if task[0] > 0], default=0.5)
+        b.ring_buffer_poll(timeout=int(min(max(wait, 0), 0.5) * 1000))
+        now = time.monotonic()
+        for task in periodic:
+            if now >= task[1]:
+                task[1] = now + task[0]
+                task[2]()
 except KeyboardInterrupt:
+    if args.count_events or recorder:
+        b.ring_buffer_consume()
+    if recorder:
+        recorder.close()
+    if args.count_events:
+        for name, count in sorted(received.items()):
+            print(f"received {name} {count}")
+    if profiler:
+        profiler.write(args.profile_out)
     sys.exit()
 
 # me = getpid()
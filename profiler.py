@@ -0,0 +1,53 @@
+from __future__ import print_function
+import sys
+
+
+GROUP_BY_PV = "pv"
+GROUP_BY_RTYPE = "rtype"
+
+
+class ProcessProfiler(object):
+    """Fold the in-kernel stack counts of sample_process into flame graph
+    input. Each line is "<pv or record type>;<outermost frame>;...;<innermost
+    frame> <count>" as expected by flamegraph.pl."""
+
+    def __init__(self, bpf, group_by=GROUP_BY_PV):
+        self.bpf = bpf
+        self.group_by = group_by
+
+    def folded(self):
+        counts = self.bpf["profile_counts"]
+        stacks = self.bpf["profile_stacks"]
+
+        folded = {}
+        for key, value in counts.items():
+            if self.group_by == GROUP_BY_RTYPE:
+                label = key.rtype.decode("utf-8", "replace") or "[unknown type]"
+            else:
+                label = key.pvname.decode("utf-8", "replace")
+
+            if key.user_stack_id < 0:
+                frames = ["[missing user stack]"]
+            else:
+                frames = [
+                    self.bpf.sym(addr, key.pid, show_module=True).decode(
+                        "utf-8", "replace"
+                    )
+                    for addr in stacks.walk(key.user_stack_id)
+                ]
+                frames.reverse()
+
+            line = ";".join([label] + frames)
+            folded[line] = folded.get(line, 0) + value.value
+
+        return folded
+
+    def write(self, path):
+        folded = self.folded()
+        out = sys.stdout if path == "-" else open(path, "w")
+        try:
+            for line in sorted(folded):
+                out.write(f"{line} {folded[line]}\n")
+        finally:
+            if out is not sys.stdout:
+                out.close()
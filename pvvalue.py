@@ -0,0 +1,26 @@
+import struct
+
+VAL_TYPE_INT = 1
+VAL_TYPE_UINT = 2
+VAL_TYPE_DOUBLE = 3
+VAL_TYPE_STRING = 4
+VAL_TYPE_NULL = 5
+VAL_TYPE_FLOAT = 6
+
+
+def decode_value(event):
+    """Return the value picked by pickPvValue in proctrace.c."""
+    if event.val_type == VAL_TYPE_INT:
+        return event.val_i
+    if event.val_type == VAL_TYPE_UINT:
+        return event.val_u
+    if event.val_type == VAL_TYPE_DOUBLE:
+        return event.val_d
+    if event.val_type == VAL_TYPE_FLOAT:
+        # DBF_FLOAT is passed as its 32 bits
+        return struct.unpack("<f", struct.pack("<I", event.val_u & 0xFFFFFFFF))[0]
+    if event.val_type == VAL_TYPE_STRING:
+        return event.val_s.decode("utf-8", "replace")
+    if event.val_type == VAL_TYPE_NULL:
+        return "NULL"
+    return 0
@@ -0,0 +1,136 @@
+#!/usr/bin/python3
+"""Feed a recording of proctrace.py --record through the span assembly and
+export of the collector, at the recorded pace or as fast as possible."""
+
+from __future__ import print_function
+import argparse
+import collections
+import ctypes as ct
+import time
+
+from opentelemetry.sdk.trace.export import BatchSpanProcessor
+from opentelemetry.exporter.zipkin.proto.http import ZipkinExporter
+
+import arrayzipkin
+import caputzipkin
+import linkzipkin
+import postzipkin
+import putzipkin
+import spanids
+import tracezipkin
+from arrayzipkin import ArrayTracer
+from caputzipkin import CaputTracer
+from chainagg import ChainAggregator
+from correxport import NullExporter
+from eventlog import read_segments
+from linkzipkin import LinkTracer
+from postzipkin import PostTracer
+from putzipkin import PutTracer
+from tracezipkin import ProcessTracer
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument("recording", help="Prefix given to --record")
+    parser.add_argument(
+        "--speed",
+        type=float,
+        default=1.0,
+        help="Replay speed relative to the recording (0: as fast as possible)",
+    )
+    parser.add_argument(
+        "--exporter",
+        choices=["zipkin", "none"],
+        default="zipkin",
+        help="Where the spans go (none: assemble them and drop them)",
+    )
+    parser.add_argument(
+        "--zipkin",
+        default="http://localhost:9411/api/v2/spans",
+        help="Zipkin v2 span endpoint",
+    )
+    parser.add_argument(
+        "--aggregate",
+        type=float,
+        default=0,
+        help="As proctrace.py --aggregate, in recorded time",
+    )
+    args = parser.parse_args()
+
+    if args.exporter == "none":
+        exporter = NullExporter()
+    else:
+        exporter = ZipkinExporter(endpoint=args.zipkin)
+
+    prt = ProcessTracer("process-service", BatchSpanProcessor(exporter))
+    ptt = PutTracer("put-service", BatchSpanProcessor(exporter))
+    cpt = CaputTracer("caput-service", BatchSpanProcessor(exporter))
+    art = ArrayTracer("array-service", BatchSpanProcessor(exporter))
+    pst = PostTracer("post-service", BatchSpanProcessor(exporter), None)
+    lkt = LinkTracer("link-service", BatchSpanProcessor(exporter), None)
+    callbacks = {
+        "ring_buf": prt.callback,
+        "ring_buf_put": ptt.callback,
+        "ring_buf_caput": cpt.callback,
+        "ring_buf_array": art.callback,
+        "ring_buf_post": pst.callback,
+        "ring_buf_link": lkt.callback,
+    }
+    if args.aggregate > 0:
+        prt.aggregator = ChainAggregator(prt.export_chain)
+
+    counts = collections.Counter()
+    skipped = collections.Counter()
+    first_ts = None
+    next_flush = None
+    start = time.monotonic_ns()
+
+    for meta, ring, cpu, ts_ns, payload in read_segments(args.recording):
+        if first_ts is None:
+            first_ts = ts_ns
+            next_flush = ts_ns + int(args.aggregate * 1e9)
+            # Span times are relative to the boot of the recording host
+            for module in (
+                tracezipkin,
+                putzipkin,
+                caputzipkin,
+                postzipkin,
+                arrayzipkin,
+                linkzipkin,
+            ):
+                module.BOOT_TIME_NS = meta["boot_time_ns"]
+            # and so are the trace ids
+            spanids.TRACE_ID_HI = meta.get("trace_id_hi", spanids.TRACE_ID_HI)
+
+        if args.speed > 0:
+            delay = start + (ts_ns - first_ts) / args.speed - time.monotonic_ns()
+            if delay > 0:
+                time.sleep(delay / 1e9)
+
+        callback = callbacks.get(ring)
+        if callback is None:
+            # Support spans need the symbols of the recorded IOC
+            skipped[ring] += 1
+            continue
+        buf = ct.create_string_buffer(payload.tobytes(), len(payload))
+        callback(cpu, buf, len(payload))
+        counts[ring] += 1
+
+        if prt.aggregator and ts_ns >= next_flush:
+            prt.aggregator.flush()
+            next_flush = ts_ns + int(args.aggregate * 1e9)
+
+    if prt.aggregator:
+        prt.aggregator.flush()
+
+    elapsed = (time.monotonic_ns() - start) / 1e9
+    total = sum(counts.values())
+    for ring, count in sorted(counts.items()):
+        print(f"{ring:<16} {count:>10}")
+    for ring, count in sorted(skipped.items()):
+        print(f"{ring:<16} {count:>10} skipped")
+    print(f"{total} events in {elapsed:.3f} s ({total / elapsed if elapsed else 0:.0f}/s)")
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,175 @@
+from __future__ import print_function
+import os
+import re
+
+from metrics import escape
+
+
+JITTER_SLOTS = 40  # proctrace.c
+PERCENTILES = (50, 90, 99)
+# EPICS names its periodic scan threads after the period: scan-1, scan-0.1
+SCAN_THREAD = re.compile(r"^scan-?(\d+(?:\.\d+)?)$")
+
+
+def percentile(buckets, q):
+    """Upper bound (ns) of the bucket holding the q-th percentile."""
+    total = sum(buckets)
+    if not total:
+        return None
+    rank = q / 100 * total
+    seen = 0
+    for slot, n in enumerate(buckets):
+        seen += n
+        if n and seen >= rank:
+            return 1 << slot
+    return 1 << (len(buckets) - 1)
+
+
+class Series(object):
+    """Scans of a record, or of every record of a scan thread."""
+
+    __slots__ = ("count", "sum_ns", "max_ns", "missed", "period_ns", "late", "buckets")
+
+    def __init__(self, period_ns):
+        self.count = self.sum_ns = self.max_ns = self.missed = self.late = 0
+        self.period_ns = period_ns
+        self.buckets = [0] * JITTER_SLOTS
+
+    def add(self, stat):
+        self.count += stat.count
+        self.sum_ns += stat.sum_ns
+        self.max_ns = max(self.max_ns, stat.max_ns)
+        self.missed += stat.missed
+
+    def add_slot(self, slot, n):
+        if slot >= JITTER_SLOTS:
+            self.late += n
+            slot -= JITTER_SLOTS
+        self.buckets[slot] += n
+
+    def row(self):
+        mean = self.sum_ns / self.count / 1e6 if self.count else 0
+        jitter = [percentile(self.buckets, q) for q in PERCENTILES]
+        jitter = " ".join(f"{j / 1e3 if j else 0:>8.0f}" for j in jitter)
+        ran = sum(self.buckets)
+        late = self.late / ran if ran else 0
+        return (
+            f"{self.count:>7} {self.period_ns / 1e6:>9.0f} {mean:>9.1f} {jitter} "
+            f"{late:>5.0%} {self.max_ns / 1e6:>8.1f} {self.missed:>6}"
+        )
+
+
+class ScanJitter(object):
+    """Period, jitter and missed scans of the periodically scanned records.
+
+    The kernel counts, per record and scan thread, the interval between
+    successive dbProcess calls against the period of the thread, which is
+    taken from its name (or `periods`, {thread name: seconds}) and written
+    to scan_period. Jitter is the deviation of the intervals from the period
+    (log2 buckets, so the percentiles are upper bounds), intervals longer
+    than the miss multiple count the missed scans."""
+
+    def __init__(self, bpf, iocs, periods=None, top=20):
+        self.bpf = bpf
+        self.iocs = iocs
+        self.periods = periods or {}
+        self.top = top
+        self.known = set()
+        self.discover()
+
+    def discover(self):
+        """Give the kernel the period of the scan threads of the IOCs."""
+        table = self.bpf["scan_period"]
+        for tgid in list(self.iocs.iocs):
+            try:
+                tasks = os.listdir(f"/proc/{tgid}/task")
+            except OSError:
+                continue
+            for task in tasks:
+                try:
+                    with open(f"/proc/{tgid}/task/{task}/comm") as f:
+                        comm = f.read().strip()
+                except OSError:
+                    continue
+                if comm in self.known:
+                    continue
+                seconds = self.periods.get(comm)
+                m = SCAN_THREAD.match(comm)
+                if seconds is None and m:
+                    seconds = float(m.group(1))
+                if seconds:
+                    key = table.Key()
+                    key.comm = comm.encode()
+                    table[key] = table.Leaf(int(seconds * 1e9))
+                    self.known.add(comm)
+
+    def collect(self):
+        """({(tgid, record address): (name, thread, Series)},
+        {(tgid, thread): Series}) since the start."""
+        records = {}
+        threads = {}
+        for key, stat in self.bpf["scan_stats"].items():
+            comm = stat.comm.decode("utf-8", "replace")
+            series = Series(stat.period_ns)
+            series.add(stat)
+            records[(key.tgid, key.precord)] = (stat.name.decode("utf-8", "replace"), comm, series)
+            thread = threads.get((key.tgid, comm))
+            if thread is None:
+                thread = threads[(key.tgid, comm)] = Series(stat.period_ns)
+            thread.add(stat)
+
+        for key, n in self.bpf["scan_jitter"].items():
+            record = records.get((key.tgid, key.precord))
+            if record is None:
+                continue
+            record[2].add_slot(key.slot, n.value)
+            threads[(key.tgid, record[1])].add_slot(key.slot, n.value)
+        return records, threads
+
+    def report(self):
+        """Print the scan threads, then the records with the most jitter."""
+        self.discover()
+        records, threads = self.collect()
+        header = (
+            f"{'SCANS':>7} {'PERIOD_MS':>9} {'MEAN_MS':>9} "
+            + " ".join(f"{f'P{q}_US':>8}" for q in PERCENTILES)
+            + f" {'LATE':>5} {'MAX_MS':>8} {'MISSED':>6}"
+        )
+
+        print(f"{'PID':>7} {'THREAD':<16} {header}")
+        for (tgid, comm), series in sorted(threads.items()):
+            print(f"{tgid:>7} {comm:<16} {series.row()}")
+
+        rows = sorted(
+            records.values(),
+            key=lambda r: (r[2].missed, percentile(r[2].buckets, PERCENTILES[-1]) or 0),
+            reverse=True,
+        )
+        print(f"{'PV':<40} {'THREAD':<16} {header}")
+        for name, comm, series in rows[: self.top]:
+            print(f"{name:<40} {comm:<16} {series.row()}")
+
+    def gauges(self, metrics):
+        def rows(field):
+            def fn():
+                out = []
+                for (tgid, comm), series in sorted(self.collect()[1].items()):
+                    ioc = self.iocs.iocs.get(tgid)
+                    name = ioc.name if ioc else str(tgid)
+                    labels = f'ioc="{escape(name)}",thread="{escape(comm)}"'
+                    if field == "missed":
+                        out.append((labels, series.missed))
+                    else:
+                        q = percentile(series.buckets, field)
+                        out.append((labels, q / 1e9 if q else None))
+                return out
+
+            return fn
+
+        metrics.gauge("epics_scan_missed_total", "Periodic scans missed.", rows("missed"))
+        for q in PERCENTILES:
+            metrics.gauge(
+                f"epics_scan_jitter_p{q}_seconds",
+                f"Upper bound of the {q}th percentile of the scan jitter.",
+                rows(q),
+            )
@@ -0,0 +1,74 @@
+from __future__ import print_function
+
+
+class ChainTiming(object):
+    """Exclusive (self) time and critical path of nested dbProcess spans,
+    computed as the exits arrive.
+
+    Only one accumulator per open depth of each thread is kept: children
+    add their duration and their critical path to the accumulator of the
+    depth above, which the parent consumes at its own exit. With
+    --changed-only the children arrive before the enter of their parent,
+    which works the same way."""
+
+    def __init__(self):
+        self.acc = {}  # (pid, depth) -> [children ns, longest child ns, its path]
+
+    def exit(self, enter, exit):
+        """Return (duration, self time, critical path) of a finished span."""
+        duration = exit.ktime_ns - enter.ktime_ns
+        children, _, path = self.acc.pop((exit.pid, exit.count), (0, 0, []))
+        self_ns = max(duration - children, 0)
+        path = [enter.pvname.decode("utf-8")] + path
+
+        if exit.count > 1:
+            parent = self.acc.setdefault((exit.pid, exit.count - 1), [0, 0, []])
+            parent[0] += duration
+            if duration > parent[1]:
+                parent[1] = duration
+                parent[2] = path
+        else:
+            # Left over by spans whose parent was never seen
+            for key in [k for k in self.acc if k[0] == exit.pid]:
+                del self.acc[key]
+
+        return duration, self_ns, path
+
+    def reset(self):
+        self.acc = {}
+
+
+class SelfTimeTable(object):
+    """Rolling per-record self time: every report halves the accumulated
+    times, so older intervals fade out."""
+
+    def __init__(self, top=20, decay=0.5):
+        self.top = top
+        self.decay = decay
+        self.self_ns = {}
+        self.count = {}
+
+    def add(self, pvname, self_ns):
+        self.self_ns[pvname] = self.self_ns.get(pvname, 0) + self_ns
+        self.count[pvname] = self.count.get(pvname, 0) + 1
+
+    def report(self):
+        total = sum(self.self_ns.values())
+        if total <= 0:
+            return
+        rows = sorted(self.self_ns.items(), key=lambda r: r[1], reverse=True)
+
+        print(f"{'PV':<40} {'SHARE':>7} {'SELF_US':>10} {'COUNT':>8}")
+        for pvname, self_ns in rows[: self.top]:
+            count = self.count[pvname]
+            print(
+                f"{pvname:<40} {self_ns / total:>7.1%} "
+                f"{self_ns / count / 1e3:>10.1f} {count:>8.0f}"
+            )
+
+        for pvname in list(self.self_ns):
+            self.self_ns[pvname] *= self.decay
+            self.count[pvname] *= self.decay
+            if self.count[pvname] < 0.01:
+                del self.self_ns[pvname]
+                del self.count[pvname]
@@ -0,0 +1,85 @@
+from __future__ import print_function
+import hashlib
+import os
+import random
+import socket
+
+from opentelemetry.sdk.trace import Span
+from opentelemetry.sdk.util.instrumentation import InstrumentationScope
+from opentelemetry.trace import SpanContext, TraceFlags
+
+
+# Span ids and the low half of the trace ids are made in the kernel
+# (nextId() of proctrace.c): a per-CPU counter tagged with the CPU number,
+# XORed with ID_SALT. The high half of the trace ids is TRACE_ID_HI. Both
+# come from the host and boot identity and a random nonce drawn at every
+# start, since the counters restart with the program: ids are unique per
+# host and run without any state kept between runs.
+
+MACHINE_ID = ("/etc/machine-id", "/var/lib/dbus/machine-id")
+BOOT_ID = "/proc/sys/kernel/random/boot_id"
+SAMPLED = TraceFlags(TraceFlags.SAMPLED)
+
+
+def _read(paths):
+    for path in paths:
+        try:
+            with open(path, "rb") as f:
+                return f.read().strip()
+        except OSError:
+            pass
+    return b""
+
+
+def host_seed():
+    """(trace id high half, span id salt) of this host, boot and run."""
+    identity = _read(MACHINE_ID) or socket.gethostname().encode()
+    seed = b"/".join([identity, _read([BOOT_ID]), os.urandom(16)])
+    digest = hashlib.blake2b(seed, digest_size=16).digest()
+    return int.from_bytes(digest[:8], "big"), int.from_bytes(digest[8:], "big")
+
+
+TRACE_ID_HI, ID_SALT = host_seed()
+
+
+def cflags():
+    return [f"-DID_SALT={ID_SALT}ULL"]
+
+
+def trace_id(tid):
+    return TRACE_ID_HI << 64 | tid
+
+
+class KernelSpan(Span):
+    """SDK span built from the kernel's ids rather than by a Tracer."""
+
+
+def start_span(name, processor, resource, scope, start_time, tid, sid=None, ptid=0, psid=0):
+    """A span with the ids of the kernel, reported to processor when ended.
+
+    Nothing is shared between calls (no id generator, no current context),
+    so spans can be exported from any thread. Without sid (spans the kernel
+    gives no id) a random span id is used."""
+    context = SpanContext(
+        trace_id(tid),
+        random.getrandbits(64) if sid is None else sid,
+        is_remote=False,
+        trace_flags=SAMPLED,
+    )
+    parent = None
+    if ptid:
+        parent = SpanContext(trace_id(ptid), psid, is_remote=True, trace_flags=SAMPLED)
+    span = KernelSpan(
+        name,
+        context,
+        parent=parent,
+        resource=resource,
+        span_processor=processor,
+        instrumentation_scope=scope,
+    )
+    span.start(start_time=start_time)
+    return span
+
+
+def scope(name):
+    return InstrumentationScope(name)
@@ -0,0 +1,368 @@
+from __future__ import print_function
+import array
+import bisect
+import heapq
+import json
+import os
+import socketserver
+import threading
+import urllib.parse
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+
+from opentelemetry.sdk.resources import SERVICE_NAME
+from opentelemetry.sdk.trace.export import SpanExporter, SpanExportResult
+
+
+BUCKET_NS = 10**9
+PERCENTILES = (50, 90, 99)
+LATENCY_SUB_BITS = 3  # 8 latency buckets per power of two
+
+
+def latency_bucket(ns):
+    """Log-linear bucket of a duration: exact below 8 ns, then 8 buckets
+    per power of two (at most 12.5% wide)."""
+    if ns < 1 << LATENCY_SUB_BITS:
+        return max(ns, 0)
+    shift = ns.bit_length() - LATENCY_SUB_BITS - 1
+    return ((shift + 1) << LATENCY_SUB_BITS) + (ns >> shift) - (1 << LATENCY_SUB_BITS)
+
+
+def latency_bounds(bucket):
+    """[lo, hi) of the durations in a latency bucket."""
+    if bucket < 1 << LATENCY_SUB_BITS:
+        return bucket, bucket + 1
+    shift = (bucket >> LATENCY_SUB_BITS) - 1
+    top = (1 << LATENCY_SUB_BITS) + (bucket & ((1 << LATENCY_SUB_BITS) - 1))
+    return top << shift, (top + 1) << shift
+
+
+class SpanIndex(object):
+    """The last `capacity` finished spans in preallocated columns, indexed
+    by PV name, trace id, one second time bucket and latency bucket.
+
+    A span is stored at slot seq % capacity. The indexes hold sequence
+    numbers in increasing order; the ones overwritten since are skipped by
+    bisecting on the oldest live sequence number, and swept out every
+    `capacity` spans so the indexes stay within twice the capacity.
+
+    Queries copy what they need from the indexes under the lock and filter
+    outside it, so the exporter thread is not held up; a span overwritten
+    meanwhile is dropped from the result. The latency buckets keep their
+    sum of durations, so a summary reads only the durations of the buckets
+    holding a percentile or a min_us/max_us bound."""
+
+    def __init__(self, capacity):
+        self.capacity = capacity
+        self.seq = 0
+        self.lock = threading.Lock()
+
+        self.start = array.array("q", bytes(8 * capacity))
+        self.duration = array.array("q", bytes(8 * capacity))
+        self.self_ns = array.array("q", bytes(8 * capacity))
+        self.trace_hi = array.array("Q", bytes(8 * capacity))
+        self.trace_lo = array.array("Q", bytes(8 * capacity))
+        self.span_id = array.array("Q", bytes(8 * capacity))
+        self.parent_id = array.array("Q", bytes(8 * capacity))
+        self.pv = [None] * capacity
+        self.service = [None] * capacity
+        self.value = [None] * capacity
+
+        self.by_pv = {}
+        self.by_trace = {}
+        self.by_bucket = {}
+        self.by_latency = {}
+        self.latency_sum = {}
+
+    @property
+    def oldest(self):
+        return max(self.seq - self.capacity, 0)
+
+    def add(self, span):
+        attrs = span.attributes
+        ctx = span.get_span_context()
+        pv = attrs.get("pv.name", span.name)
+        self_us = attrs.get("proc.self_us")
+        value = attrs.get("pv.value")
+
+        with self.lock:
+            seq = self.seq
+            i = seq % self.capacity
+            self.seq += 1
+            if seq >= self.capacity:
+                old = latency_bucket(self.duration[i])
+                self.latency_sum[old] -= self.duration[i]
+
+            duration = span.end_time - span.start_time
+            latency = latency_bucket(duration)
+            self.start[i] = span.start_time
+            self.duration[i] = duration
+            self.self_ns[i] = int(self_us * 1e3) if self_us is not None else -1
+            self.trace_hi[i] = ctx.trace_id >> 64
+            self.trace_lo[i] = ctx.trace_id & 0xFFFFFFFFFFFFFFFF
+            self.span_id[i] = ctx.span_id
+            self.parent_id[i] = span.parent.span_id if span.parent is not None else 0
+            self.pv[i] = pv
+            self.service[i] = span.resource.attributes.get(SERVICE_NAME, "")
+            self.value[i] = None if value is None else str(value)
+
+            self.by_pv.setdefault(pv, array.array("Q")).append(seq)
+            self.by_trace.setdefault(ctx.trace_id, array.array("Q")).append(seq)
+            self.by_bucket.setdefault(span.start_time // BUCKET_NS, array.array("Q")).append(seq)
+            self.by_latency.setdefault(latency, array.array("Q")).append(seq)
+            self.latency_sum[latency] = self.latency_sum.get(latency, 0) + duration
+
+            if self.seq % self.capacity == 0:
+                self._sweep()
+
+    def _sweep(self):
+        oldest = self.oldest
+        for index in (self.by_pv, self.by_trace, self.by_bucket, self.by_latency):
+            for key in list(index):
+                seqs = index[key]
+                n = bisect.bisect_left(seqs, oldest)
+                if n == len(seqs):
+                    del index[key]
+                elif n:
+                    del seqs[:n]
+
+    def _live(self, seqs):
+        return seqs[bisect.bisect_left(seqs, self.oldest) :]
+
+    def _row(self, seq):
+        i = seq % self.capacity
+        return {
+            "pv": self.pv[i],
+            "service": self.service[i],
+            "trace_id": f"{self.trace_hi[i]:016x}{self.trace_lo[i]:016x}",
+            "span_id": f"{self.span_id[i]:016x}",
+            "parent_id": f"{self.parent_id[i]:016x}" if self.parent_id[i] else None,
+            "start_ns": self.start[i],
+            "duration_us": self.duration[i] / 1e3,
+            "self_us": self.self_ns[i] / 1e3 if self.self_ns[i] >= 0 else None,
+            "value": self.value[i],
+        }
+
+    def _latency_buckets(self, min_ns, max_ns):
+        """[(lo, hi, live sequence numbers, sum of durations)] of the
+        latency buckets overlapping [min_ns, max_ns], in increasing latency.
+        Under the lock."""
+        out = []
+        for bucket in sorted(self.by_latency):
+            lo, hi = latency_bounds(bucket)
+            if (min_ns is not None and hi <= min_ns) or (max_ns is not None and lo > max_ns):
+                continue
+            out.append((lo, hi, self._live(self.by_latency[bucket]), self.latency_sum.get(bucket, 0)))
+        return out
+
+    def select(self, pv=None, trace_id=None, since_ns=None, until_ns=None,
+               min_us=None, max_us=None, limit=None):
+        """Sequence numbers of the matching spans, most recent first."""
+        min_ns = min_us * 1e3 if min_us is not None else None
+        max_ns = max_us * 1e3 if max_us is not None else None
+        with self.lock:
+            if trace_id is not None:
+                seqs = reversed(self._live(self.by_trace.get(trace_id, array.array("Q"))))
+            elif pv is not None:
+                seqs = reversed(self._live(self.by_pv.get(pv, array.array("Q"))))
+            elif since_ns is not None or until_ns is not None:
+                lo = (since_ns or 0) // BUCKET_NS
+                hi = (until_ns // BUCKET_NS) if until_ns is not None else None
+                seqs = array.array("Q")
+                for bucket, b in self.by_bucket.items():
+                    if bucket >= lo and (hi is None or bucket <= hi):
+                        seqs.extend(self._live(b))
+                seqs = reversed(sorted(seqs))
+            elif min_ns is not None or max_ns is not None:
+                # Only the latency buckets in range, merged newest first
+                buckets = self._latency_buckets(min_ns, max_ns)
+                seqs = heapq.merge(*[reversed(b[2]) for b in buckets], reverse=True)
+            else:
+                seqs = reversed(range(self.oldest, self.seq))
+
+        out = []
+        for seq in seqs:
+            if limit is not None and len(out) >= limit:
+                break
+            i = seq % self.capacity
+            if pv is not None and self.pv[i] != pv:
+                continue
+            if since_ns is not None and self.start[i] < since_ns:
+                continue
+            if until_ns is not None and self.start[i] > until_ns:
+                continue
+            d = self.duration[i]
+            if min_ns is not None and d < min_ns:
+                continue
+            if max_ns is not None and d > max_ns:
+                continue
+            out.append(seq)
+        return out
+
+    def spans(self, limit=1000, **query):
+        seqs = self.select(limit=limit, **query)
+        with self.lock:
+            # Overwritten while the lock was released
+            return [self._row(s) for s in seqs if s >= self.oldest]
+
+    def summary(self, **query):
+        if all(query.get(k) is None for k in ("pv", "trace_id", "since_ns", "until_ns")):
+            return self._latency_summary(query.get("min_us"), query.get("max_us"))
+        seqs = self.select(**query)
+        durations = [self.duration[s % self.capacity] for s in seqs]
+        with self.lock:
+            oldest = self.oldest
+        durations = sorted(d for s, d in zip(seqs, durations) if s >= oldest)
+        if not durations:
+            return {"count": 0}
+        n = len(durations)
+        out = {
+            "count": n,
+            "min_us": durations[0] / 1e3,
+            "mean_us": sum(durations) / n / 1e3,
+            "max_us": durations[-1] / 1e3,
+        }
+        for q in PERCENTILES:
+            out[f"p{q}_us"] = durations[round(q / 100 * (n - 1))] / 1e3
+        return out
+
+    def _latency_summary(self, min_us, max_us):
+        """summary() of every span in the duration range, from the latency
+        buckets: only the durations of the buckets cut by the range or
+        holding a percentile, the minimum or the maximum are read."""
+        min_ns = min_us * 1e3 if min_us is not None else None
+        max_ns = max_us * 1e3 if max_us is not None else None
+        with self.lock:
+            buckets = self._latency_buckets(min_ns, max_ns)
+
+        # [count, sum, sorted durations or None, sequence numbers]
+        rows = []
+        for lo, hi, seqs, total in buckets:
+            if (min_ns is not None and lo < min_ns) or (max_ns is not None and hi - 1 > max_ns):
+                durations = sorted(
+                    d
+                    for d in (self.duration[s % self.capacity] for s in seqs)
+                    if (min_ns is None or d >= min_ns) and (max_ns is None or d <= max_ns)
+                )
+                rows.append([len(durations), sum(durations), durations, seqs])
+            elif len(seqs):
+                rows.append([len(seqs), total, None, seqs])
+        rows = [r for r in rows if r[0]]
+        n = sum(r[0] for r in rows)
+        if not n:
+            return {"count": 0}
+
+        def durations(row):
+            if row[2] is None:
+                row[2] = sorted(self.duration[s % self.capacity] for s in row[3])
+            return row[2]
+
+        def rank(k):
+            for row in rows:
+                if k < row[0]:
+                    return durations(row)[k]
+                k -= row[0]
+            return durations(rows[-1])[-1]
+
+        out = {
+            "count": n,
+            "min_us": durations(rows[0])[0] / 1e3,
+            "mean_us": sum(r[1] for r in rows) / n / 1e3,
+            "max_us": durations(rows[-1])[-1] / 1e3,
+        }
+        for q in PERCENTILES:
+            out[f"p{q}_us"] = rank(round(q / 100 * (n - 1))) / 1e3
+        return out
+
+    def pvs(self, top=100):
+        with self.lock:
+            counts = [(pv, len(self._live(seqs))) for pv, seqs in self.by_pv.items()]
+        counts.sort(key=lambda r: r[1], reverse=True)
+        return [{"pv": pv, "count": n} for pv, n in counts[:top] if n]
+
+
+class IndexExporter(SpanExporter):
+    def __init__(self, index):
+        self.index = index
+
+    def export(self, spans):
+        for span in spans:
+            self.index.add(span)
+        return SpanExportResult.SUCCESS
+
+    def shutdown(self):
+        pass
+
+
+def parse_query(qs):
+    params = urllib.parse.parse_qs(qs)
+
+    def get(name, conv=str):
+        return conv(params[name][0]) if name in params else None
+
+    query = {
+        "pv": get("pv"),
+        "since_ns": get("since_ns", int),
+        "until_ns": get("until_ns", int),
+        "min_us": get("min_us", float),
+        "max_us": get("max_us", float),
+    }
+    trace_id = get("trace_id")
+    if trace_id is not None:
+        query["trace_id"] = int(trace_id, 16)
+    return query, params
+
+
+class Handler(BaseHTTPRequestHandler):
+    """GET /spans, /summary and /pvs with query parameters pv, trace_id,
+    since_ns, until_ns, min_us, max_us, limit and top."""
+
+    index = None
+
+    def do_GET(self):
+        url = urllib.parse.urlparse(self.path)
+        try:
+            query, params = parse_query(url.query)
+            if url.path == "/spans":
+                limit = int(params.get("limit", ["1000"])[0])
+                body = self.index.spans(limit=limit, **query)
+            elif url.path == "/summary":
+                body = self.index.summary(**query)
+            elif url.path == "/pvs":
+                body = self.index.pvs(int(params.get("top", ["100"])[0]))
+            else:
+                self.send_error(404)
+                return
+        except ValueError as e:
+            self.send_error(400, str(e))
+            return
+
+        data = json.dumps(body).encode("utf-8")
+        self.send_response(200)
+        self.send_header("Content-Type", "application/json")
+        self.send_header("Content-Length", str(len(data)))
+        self.end_headers()
+        self.wfile.write(data)
+
+    def address_string(self):
+        return str(self.client_address[0]) if self.client_address else "unix"
+
+    def log_message(self, format, *args):
+        pass
+
+
+class UnixHTTPServer(socketserver.ThreadingMixIn, socketserver.UnixStreamServer):
+    daemon_threads = True
+
+
+def serve(index, listen):
+    """Serve the index on "host:port" or on a Unix socket path, in a thread."""
+    handler = type("IndexHandler", (Handler,), {"index": index})
+    if ":" in listen:
+        host, port = listen.rsplit(":", 1)
+        server = ThreadingHTTPServer((host, int(port)), handler)
+    else:
+        if os.path.exists(listen):
+            os.unlink(listen)
+        server = UnixHTTPServer(listen, handler)
+    threading.Thread(target=server.serve_forever, daemon=True).start()
+    return server
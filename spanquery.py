@@ -0,0 +1,119 @@
+#!/usr/bin/python3
+"""Aggregate the span store written by proctrace.py --store.
+
+    spanquery.py store --group-by rtype,hour
+    spanquery.py store --service process-service --pv 'SR:.*' --since 2024-05-01
+"""
+
+from __future__ import print_function
+import argparse
+import datetime
+import re
+
+import pyarrow as pa
+import pyarrow.compute as pc
+import pyarrow.dataset as ds
+
+
+PARTITIONING = ds.partitioning(
+    pa.schema([("ioc", pa.string()), ("date", pa.string()), ("hour", pa.string())]),
+    flavor="hive",
+)
+QUANTILES = [0.5, 0.9, 0.99]
+
+
+def parse_time(text):
+    t = datetime.datetime.fromisoformat(text)
+    if t.tzinfo is None:
+        t = t.replace(tzinfo=datetime.timezone.utc)
+    return t
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter
+    )
+    parser.add_argument("store", help="Directory given to --store")
+    parser.add_argument(
+        "--group-by",
+        default="rtype",
+        help="Comma separated columns out of service, ioc, pv, rtype, pid, tid, date, hour",
+    )
+    parser.add_argument(
+        "--metric",
+        choices=["duration_ns", "self_ns"],
+        default="duration_ns",
+        help="Column aggregated",
+    )
+    parser.add_argument(
+        "--service",
+        default="process-service",
+        help="Tracer service, with or without the <ioc>/ prefix of --ioc-config",
+    )
+    parser.add_argument("--ioc", help="Only this IOC partition")
+    parser.add_argument("--pv", help="Only PV names matching this regular expression")
+    parser.add_argument("--rtype", help="Only this record type")
+    parser.add_argument("--since", type=parse_time, help="ISO time (UTC if no zone)")
+    parser.add_argument("--until", type=parse_time, help="ISO time (UTC if no zone)")
+    parser.add_argument("--sort", default="p99", help="Output column to sort on")
+    parser.add_argument("--limit", type=int, default=50)
+    args = parser.parse_args()
+
+    keys = [k for k in args.group_by.split(",") if k]
+
+    dataset = ds.dataset(args.store, format="parquet", partitioning=PARTITIONING)
+
+    # Partition columns prune whole directories before any file is read
+    expr = pc.match_substring_regex(pc.field("service"), f"(^|/){re.escape(args.service)}$")
+    if args.ioc:
+        expr &= pc.field("ioc") == args.ioc
+    if args.rtype:
+        expr &= pc.field("rtype") == args.rtype
+    if args.since:
+        expr &= pc.field("date") >= f"{args.since:%Y-%m-%d}"
+        expr &= pc.field("start") >= pa.scalar(args.since, pa.timestamp("ns", tz="UTC"))
+    if args.until:
+        expr &= pc.field("date") <= f"{args.until:%Y-%m-%d}"
+        expr &= pc.field("start") < pa.scalar(args.until, pa.timestamp("ns", tz="UTC"))
+
+    table = dataset.to_table(columns=list(set(keys + [args.metric, "pv"])), filter=expr)
+    if args.pv:
+        table = table.filter(pc.match_substring_regex(table["pv"], args.pv))
+    table = table.filter(pc.is_valid(table[args.metric]))
+    if table.num_rows == 0:
+        print("no spans")
+        return
+
+    result = table.group_by(keys).aggregate(
+        [
+            (args.metric, "count"),
+            (args.metric, "mean"),
+            (args.metric, "max"),
+            (args.metric, "tdigest", pc.TDigestOptions(q=QUANTILES)),
+        ]
+    )
+
+    rows = []
+    for row in result.to_pylist():
+        q = row[f"{args.metric}_tdigest"]
+        out = {k: row[k] for k in keys}
+        out["count"] = row[f"{args.metric}_count"]
+        out["mean"] = row[f"{args.metric}_mean"] / 1e3
+        out["max"] = row[f"{args.metric}_max"] / 1e3
+        for quantile, value in zip(QUANTILES, q):
+            out[f"p{round(quantile * 100)}"] = value / 1e3
+        rows.append(out)
+    rows.sort(key=lambda r: r.get(args.sort) or 0, reverse=True)
+
+    widths = {k: max([len(k)] + [len(str(r[k])) for r in rows]) for k in keys}
+    stats = ["count", "mean", "p50", "p90", "p99", "max"]
+    print(" ".join(f"{k:<{widths[k]}}" for k in keys), " ".join(f"{s + '_us' if s != 'count' else s:>10}" for s in stats))
+    for r in rows[: args.limit]:
+        print(
+            " ".join(f"{str(r[k]):<{widths[k]}}" for k in keys),
+            " ".join(f"{r[s]:>10}" if s == "count" else f"{r[s]:>10.1f}" for s in stats),
+        )
+
+
+if __name__ == "__main__":
+    main()
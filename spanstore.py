@@ -0,0 +1,142 @@
+from __future__ import print_function
+import datetime
+import os
+import threading
+
+import pyarrow as pa
+import pyarrow.parquet as pq
+
+from opentelemetry.sdk.resources import SERVICE_NAME
+from opentelemetry.sdk.trace.export import SpanExporter, SpanExportResult
+
+
+SCHEMA = pa.schema(
+    [
+        ("service", pa.string()),
+        ("pv", pa.string()),
+        ("rtype", pa.string()),
+        ("pid", pa.uint32()),
+        ("tid", pa.uint32()),
+        ("trace_id", pa.string()),
+        ("span_id", pa.string()),
+        ("parent_id", pa.string()),
+        ("start", pa.timestamp("ns", tz="UTC")),
+        ("duration_ns", pa.int64()),
+        ("self_ns", pa.int64()),
+        ("value", pa.string()),
+        ("sevr", pa.uint16()),
+    ]
+)
+
+HOUR_NS = 3600 * 10**9
+
+
+class Partition(object):
+    def __init__(self, path):
+        self.path = path
+        self.columns = {name: [] for name in SCHEMA.names}
+        self.rows = 0
+        self.writer = None
+
+    def write(self):
+        if self.rows == 0:
+            return
+        if self.writer is None:
+            os.makedirs(os.path.dirname(self.path), exist_ok=True)
+            self.writer = pq.ParquetWriter(self.path, SCHEMA, compression="zstd")
+        table = pa.Table.from_pydict(self.columns, schema=SCHEMA)
+        self.writer.write_table(table, row_group_size=self.rows)
+        self.columns = {name: [] for name in SCHEMA.names}
+        self.rows = 0
+
+    def close(self):
+        self.write()
+        if self.writer is not None:
+            self.writer.close()
+            self.writer = None
+
+
+class ColumnarExporter(SpanExporter):
+    """Write finished spans to Parquet files partitioned by IOC and hour:
+    <root>/ioc=<host>-<pid>/date=<YYYY-MM-DD>/hour=<HH>/<service>-<n>.parquet
+
+    with the "/" of per-IOC service names (cm1/process-service) as "_".
+
+    Rows are buffered per partition and written as row groups of
+    `row_group` rows; a partition is closed when its hour is over."""
+
+    def __init__(self, root, host, row_group=256 * 1024):
+        self.root = root
+        self.host = host
+        self.row_group = row_group
+        self.lock = threading.Lock()
+        self.partitions = {}
+        self.sequence = 0
+
+    def _partition(self, ioc, hour, service):
+        key = (ioc, hour, service)
+        part = self.partitions.get(key)
+        if part is None:
+            t = datetime.datetime.fromtimestamp(hour * 3600, datetime.timezone.utc)
+            self.sequence += 1
+            path = os.path.join(
+                self.root,
+                f"ioc={ioc}",
+                f"date={t:%Y-%m-%d}",
+                f"hour={t:%H}",
+                f"{service.replace('/', '_')}-{os.getpid()}-{self.sequence}.parquet",
+            )
+            part = self.partitions[key] = Partition(path)
+        return part
+
+    def export(self, spans):
+        with self.lock:
+            latest = 0
+            for span in spans:
+                attrs = span.attributes
+                service = span.resource.attributes.get(SERVICE_NAME, "")
+                # The process, and the thread in os.pid
+                pid = attrs.get("os.tgid")
+                ioc = (
+                    attrs.get("ioc.name")
+                    or span.resource.attributes.get("ioc.name")
+                    or (f"{self.host}-{pid}" if pid else self.host)
+                )
+                hour = span.start_time // HOUR_NS
+                latest = max(latest, hour)
+
+                part = self._partition(ioc, hour, service)
+                ctx = span.get_span_context()
+                c = part.columns
+                c["service"].append(service)
+                c["pv"].append(attrs.get("pv.name"))
+                c["rtype"].append(attrs.get("pv.rtype"))
+                c["pid"].append(pid)
+                c["tid"].append(attrs.get("os.pid"))
+                c["trace_id"].append(f"{ctx.trace_id:032x}")
+                c["span_id"].append(f"{ctx.span_id:016x}")
+                c["parent_id"].append(
+                    f"{span.parent.span_id:016x}" if span.parent is not None else None
+                )
+                c["start"].append(span.start_time)
+                c["duration_ns"].append(span.end_time - span.start_time)
+                self_us = attrs.get("proc.self_us")
+                c["self_ns"].append(int(self_us * 1e3) if self_us is not None else None)
+                value = attrs.get("pv.value")
+                c["value"].append(None if value is None else str(value))
+                c["sevr"].append(attrs.get("pv.sevr"))
+                part.rows += 1
+                if part.rows >= self.row_group:
+                    part.write()
+
+            # Spans arrive in batches a few seconds late: keep the last hour open
+            for key in [k for k in self.partitions if k[1] < latest - 1]:
+                self.partitions.pop(key).close()
+
+        return SpanExportResult.SUCCESS
+
+    def shutdown(self):
+        with self.lock:
+            for part in self.partitions.values():
+                part.close()
+            self.partitions = {}
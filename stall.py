@@ -0,0 +1,191 @@
+from __future__ import print_function
+import ctypes as ct
+import time
+
+
+from bcc.libbcc import lib
+from opentelemetry.sdk.resources import SERVICE_NAME, Resource
+
+
+from spanids import scope, start_span
+from iocmem import IocMemory
+
+TASK_COMM_LEN = 16  # linux/sched.h
+STALL_MAX_DEPTH = 8
+
+BOOT_TIME_NS = int((time.time() - time.monotonic()) * 1e9)
+
+STALLED_KERNEL = 1
+STALLED_SWEEP = 2
+BPF_EXIST = 2  # linux/bpf.h: update an existing element only
+
+# The structure is defined manually in this program.
+# BCC can cast the automatically, but double is not supported.
+# https://github.com/iovisor/bcc/pull/2198
+
+
+class Data_stall(ct.Structure):
+    _fields_ = [
+        ("ktime_ns", ct.c_ulonglong),
+        ("pid", ct.c_uint),
+        ("tgid", ct.c_uint),
+        ("comm", ct.c_char * TASK_COMM_LEN),
+        ("user_stack_id", ct.c_int),
+        ("depth", ct.c_uint),
+        ("tid", ct.c_ulonglong),
+        ("sid", ct.c_ulonglong),
+        ("enter_ns", ct.c_ulonglong * STALL_MAX_DEPTH),
+        ("pvname", (ct.c_char * 61) * STALL_MAX_DEPTH),
+    ]
+
+
+def load_thresholds(bpf, path):
+    """Fill stall_threshold from lines of "<record name> <seconds>", for the
+    records of that name in every IOC (tgid 0)."""
+    table = bpf["stall_threshold"]
+    with open(path) as f:
+        for line in f:
+            fields = line.split("#", 1)[0].split()
+            if len(fields) != 2:
+                continue
+            key = table.Key()
+            key.tgid = 0
+            key.name = fields[0].encode("utf-8")
+            table[key] = table.Leaf(int(float(fields[1]) * 1e9))
+
+
+class StallWatch(object):
+    """Report dbProcess frames that stay open past their deadline.
+
+    The kernel flags overdue frames itself when the stuck thread is switched
+    out or sampled. Threads that never run again (deadlock, blocking I/O
+    without timeout) are caught by sweep(), which uses the user stack
+    recorded when the thread last blocked."""
+
+    def __init__(self, servie_name, processor, bpf):
+        self.bpf = bpf
+        self.processor = processor
+        self.resource = Resource(attributes={SERVICE_NAME: servie_name})
+        self.scope = scope("tracer.stall")
+        self.service_name = servie_name
+        self.iocs = None
+
+    def callback(self, cpu, data, size):
+        event = ct.cast(data, ct.POINTER(Data_stall)).contents
+
+        frames = []
+        for i in range(min(event.depth, STALL_MAX_DEPTH)):
+            frames.append((event.enter_ns[i], event.pvname[i].value.decode("utf-8")))
+        frames.reverse()
+
+        self.report(
+            event.pid,
+            event.tgid,
+            event.comm.decode("utf-8"),
+            event.user_stack_id,
+            event.depth,
+            frames,
+            event.tid,
+            event.sid,
+            event.ktime_ns,
+        )
+
+    def sweep(self):
+        now = time.monotonic_ns()
+        table = self.bpf["proc_pv_hash"]
+
+        threads = {}
+        for key, frame in table.items():
+            threads.setdefault(key.pid, {})[key.count] = (key, frame)
+
+        for tid, frames in threads.items():
+            key, frame = frames[max(frames)]
+            if frame.stalled or not frame.deadline_ns or now < frame.deadline_ns:
+                continue
+
+            # Not table[key] = frame: if exit_process deleted the frame since
+            # items(), that would bring it back and leak it
+            frame.stalled = STALLED_SWEEP
+            if lib.bpf_update_elem(table.map_fd, ct.byref(key), ct.byref(frame), BPF_EXIST) < 0:
+                continue
+
+            try:
+                tgid = _tgid(tid)
+                with open(f"/proc/{tid}/comm") as f:
+                    comm = f.read().strip()
+                mem = IocMemory(tid)
+                names = [
+                    (frames[c][1].ktime_ns, mem.read_str(frames[c][1].precord))
+                    for c in sorted(frames)
+                ]
+            except OSError:
+                continue
+
+            stack_id = -1
+            stacks = self.bpf["stall_stack_hash"]
+            k = stacks.Key(tid)
+            if k in stacks:
+                stack_id = stacks[k].value
+
+            self.report(
+                tid, tgid, comm, stack_id, max(frames), names, frame.tid, frame.sid, now
+            )
+
+    def report(self, pid, tgid, comm, stack_id, depth, frames, tid, sid, now):
+        stack = []
+        if stack_id >= 0:
+            stack = [
+                self.bpf.sym(addr, tgid, show_module=True).decode("utf-8", "replace")
+                for addr in self.bpf["stall_stacks"].walk(stack_id)
+            ]
+
+        enter_ns, pvname = frames[-1]
+        print(
+            f"STALL {comm} ({tgid}/{pid}) {pvname} open for "
+            f"{(now - enter_ns) / 1e9:.1f} s, depth {depth}"
+        )
+        for ns, name in frames:
+            print(f"    {name} ({(now - ns) / 1e9:.1f} s)")
+        for line in stack:
+            print(f"        {line}")
+
+        resource = self.resource
+        if self.iocs:
+            # Not held like the other spans: a stalled top-level record may
+            # never exit. Decided here when the frames reach it.
+            if len(frames) == depth:
+                allowed = self.iocs.decide(tgid, frames[0][1], tid)
+            else:
+                allowed = self.iocs.trace_allowed(tid)
+            if not allowed:
+                return
+            resource = self.iocs.resource(self, tgid)
+
+        # Child of the innermost frame, with a span id of its own
+        span = start_span(
+            f"STALL {pvname}",
+            self.processor,
+            resource,
+            self.scope,
+            enter_ns + BOOT_TIME_NS,
+            tid,
+            None,
+            tid,
+            sid,
+        )
+        span.set_attribute("error", True)
+        span.set_attribute("pv.name", pvname)
+        span.set_attribute("os.pid", pid)
+        span.set_attribute("os.tgid", tgid)
+        span.set_attribute("thread.name", comm)
+        span.set_attribute("stall.records", [name for _, name in frames])
+        span.set_attribute("stall.stack", stack)
+        span.end(now + BOOT_TIME_NS)
+
+
+def _tgid(tid):
+    with open(f"/proc/{tid}/status") as f:
+        for line in f:
+            if line.startswith("Tgid:"):
+                return int(line.split()[1])
+    return tid
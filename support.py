@@ -0,0 +1,113 @@
+from __future__ import print_function
+import struct
+
+from iocmem import IocMemory
+
+
+RSET_PROCESS_SLOT = 4  # number, report, init, init_record, process
+DSET_IO_SLOT = 5  # first record specific routine after get_ioint_info
+
+# Name of the first record specific dset routine of the base record types.
+DSET_IO_NAMES = {
+    "aai": "read_aai",
+    "aao": "write_aao",
+    "ai": "read_ai",
+    "ao": "write_ao",
+    "bi": "read_bi",
+    "bo": "write_bo",
+    "calcout": "write",
+    "event": "read_event",
+    "histogram": "read_histogram",
+    "int64in": "read_int64in",
+    "int64out": "write_int64out",
+    "longin": "read_longin",
+    "longout": "write_longout",
+    "lsi": "read_string",
+    "lso": "write_string",
+    "mbbi": "read_mbbi",
+    "mbbiDirect": "read_mbbi",
+    "mbbo": "write_mbbo",
+    "mbboDirect": "write_mbbo",
+    "printf": "output",
+    "stringin": "read_stringin",
+    "stringout": "write_stringout",
+    "subArray": "read_sa",
+    "waveform": "read_wf",
+}
+
+
+class SupportProbes(object):
+    """Attach enter_support/exit_support to the record support process()
+    and the device support I/O routine of every record of a running IOC.
+
+    The function pointers are read from the IOC's memory, so the IOC has to
+    be past iocInit when the loader runs."""
+
+    def __init__(self, bpf, db):
+        self.bpf = bpf
+        self.db = db
+        self.mem = db.mem
+        self.names = {}  # (path, ELF address) -> (record type, routine, symbol)
+        self.cache = {}  # (tgid, runtime address) -> (record type, routine, symbol)
+
+    def resolve(self):
+        """Map runtime address -> (record type, routine) for all records."""
+        Common = self.db.Common
+        lo = Common.rset.offset
+        hi = Common.rdes.offset + 8
+        types = {}
+        routines = {}
+
+        for precord, rdes in self.db.records():
+            buf = self.mem.read(precord + lo, hi - lo)
+            (prset,) = struct.unpack_from("<Q", buf, Common.rset.offset - lo)
+            (pdset,) = struct.unpack_from("<Q", buf, Common.dset.offset - lo)
+
+            if rdes not in types:
+                rtype = self.mem.read_struct(self.db.RecordType, rdes)
+                types[rdes] = self.mem.read_str(rtype.name)
+            tname = types[rdes]
+
+            if prset:
+                process = self.mem.read_ptrs(prset, RSET_PROCESS_SLOT + 1)[-1]
+                if process:
+                    routines.setdefault(process, (tname, "process"))
+
+            if pdset:
+                dset = self.mem.read_ptrs(pdset, DSET_IO_SLOT + 1)
+                if dset[0] >= DSET_IO_SLOT and dset[DSET_IO_SLOT]:
+                    routines.setdefault(
+                        dset[DSET_IO_SLOT],
+                        (tname, DSET_IO_NAMES.get(tname, f"dset[{DSET_IO_SLOT}]")),
+                    )
+
+        return routines
+
+    def attach(self, probe=True):
+        """Attach the routines, or with probe=False only name them (the
+        holder of the pinned probes attached them)."""
+        for addr, (tname, routine) in self.resolve().items():
+            target = self.mem.elf_address(addr)
+            if target is None:
+                continue
+            path, vaddr = target
+            symbol = self.bpf.sym(addr, self.mem.pid).decode("utf-8", "replace")
+            if probe:
+                self.bpf.attach_uprobe(name=path, addr=vaddr, fn_name="enter_support")
+                self.bpf.attach_uretprobe(name=path, addr=vaddr, fn_name="exit_support")
+            self.names[target] = (tname, routine, symbol)
+            self.cache[(self.mem.pid, addr)] = self.names[target]
+
+        return len(self.names)
+
+    def lookup(self, tgid, addr):
+        key = (tgid, addr)
+        if key not in self.cache:
+            # Same library mapped by another IOC process.
+            try:
+                root = f"/proc/{tgid}/root" if self.mem.root else ""
+                target = IocMemory(tgid, root).elf_address(addr)
+            except OSError:
+                target = None
+            self.cache[key] = self.names.get(target, ("", hex(addr), ""))
+        return self.cache[key]
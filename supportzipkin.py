@@ -0,0 +1,72 @@
+from __future__ import print_function
+import ctypes as ct
+import time
+
+
+from opentelemetry.sdk.resources import SERVICE_NAME, Resource
+
+
+from spanids import scope, start_span
+
+# The structure is defined manually in this program.
+# BCC can cast the automatically, but double is not supported.
+# https://github.com/iovisor/bcc/pull/2198
+
+BOOT_TIME_NS = int((time.time() - time.monotonic()) * 1e9)
+
+
+class Data(ct.Structure):
+    _fields_ = [
+        ("ktime_ns", ct.c_ulonglong),
+        ("ktime_ns_end", ct.c_ulonglong),
+        ("pid", ct.c_uint),
+        ("addr", ct.c_ulonglong),
+        ("pvname", ct.c_char * 61),
+        ("ptid", ct.c_ulonglong),
+        ("psid", ct.c_ulonglong),
+        ("tid", ct.c_ulonglong),
+        ("sid", ct.c_ulonglong),
+    ]
+
+
+class SupportTracer(object):
+    def __init__(self, servie_name, processor, probes):
+        self.probes = probes
+        self.processor = processor
+        self.resource = Resource(attributes={SERVICE_NAME: servie_name})
+        self.scope = scope("tracer.support")
+        self.service_name = servie_name
+        self.iocs = None
+
+    def callback(self, cpu, data, size):
+        event = ct.cast(data, ct.POINTER(Data)).contents
+        if self.iocs:
+            self.iocs.export(event.pid, event.tid, self.export, event)
+        else:
+            self.export(event)
+
+    def export(self, event):
+        resource = self.resource
+        if self.iocs:
+            resource = self.iocs.resource(self, event.pid)
+
+        rtype, routine, symbol = self.probes.lookup(event.pid, event.addr)
+
+        pvname = event.pvname.decode("utf-8")
+        span_name = f"{rtype}.{routine}" if rtype else routine
+        span = start_span(
+            span_name,
+            self.processor,
+            resource,
+            self.scope,
+            event.ktime_ns + BOOT_TIME_NS,
+            event.tid,
+            event.sid,
+            event.ptid,
+            event.psid,
+        )
+        span.set_attribute("pv.name", pvname)
+        span.set_attribute("record.type", rtype)
+        span.set_attribute("support.routine", routine)
+        span.set_attribute("code.function", symbol)
+        span.end(event.ktime_ns_end + BOOT_TIME_NS)
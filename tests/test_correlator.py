@@ -0,0 +1,67 @@
+import ctypes as ct
+import unittest
+
+from opentelemetry.sdk.trace.export import SimpleSpanProcessor
+from opentelemetry.sdk.trace.export.in_memory_span_exporter import InMemorySpanExporter
+
+import caputzipkin
+import putzipkin
+from correlator import Correlator
+from correxport import zipkin_span
+from iocs import Ioc, IocRegistry, Lib
+from pvvalue import VAL_TYPE_DOUBLE
+
+CM1, CM2 = 1001, 1002
+
+
+def event(struct, tgid, tid, sid, ktime_ns):
+    e = struct()
+    e.ktime_ns = ktime_ns
+    e.ktime_ns_end = ktime_ns + 50000
+    e.pvname = b"CM2:SET"
+    e.tid = tid
+    e.sid = sid
+    e.val_type = VAL_TYPE_DOUBLE
+    e.val_d = 1.5
+    e.tgid = tgid
+    e.sample = 0xFFFFFFFF
+    return e
+
+
+class CorrelatorTest(unittest.TestCase):
+    def spans(self, tracer, *events):
+        exporter = InMemorySpanExporter()
+        tracer.processor = SimpleSpanProcessor(exporter)
+        tracer.iocs = self.iocs
+        for e in events:
+            tracer.callback(0, ct.addressof(e), ct.sizeof(e))
+        return exporter.get_finished_spans()
+
+    def setUp(self):
+        self.iocs = IocRegistry(None, [])
+        lib = Lib("/usr/lib/libdbCore.so")
+        for tgid, name in ((CM1, "cm1"), (CM2, "cm2")):
+            self.iocs.iocs[tgid] = Ioc(tgid, name, lib, lib.path, {})
+
+    def test_per_ioc_service_names(self):
+        caput = event(caputzipkin.Data, CM1, 10, 11, 1000000)
+        caput.ptid, caput.psid = 10, 9
+        put = event(putzipkin.Data, CM2, 20, 21, 1200000)
+        spans = self.spans(caputzipkin.CaputTracer("caput-service", None), caput)
+        spans += self.spans(putzipkin.PutTracer("put-service", None), put)
+        services = [s.resource.attributes["service.name"] for s in spans]
+        self.assertEqual(services, ["cm1/caput-service", "cm2/put-service"])
+
+        corr = Correlator(window_ms=1000, hold_s=1.0)
+        for span in spans:
+            corr.add(zipkin_span(span, "host"), 0.0)
+        self.assertEqual(corr.stats["links"], 1)
+
+        out = {s["localEndpoint"]["serviceName"]: s for s in corr.flush(1.0)}
+        ca, pt = out["cm1/caput-service"], out["cm2/put-service"]
+        self.assertEqual(pt["traceId"], ca["traceId"])
+        self.assertEqual(pt["parentId"], ca["id"])
+
+
+if __name__ == "__main__":
+    unittest.main()
@@ -0,0 +1,71 @@
+import ctypes as ct
+import re
+import unittest
+
+from opentelemetry.sdk.trace.export import SimpleSpanProcessor
+from opentelemetry.sdk.trace.export.in_memory_span_exporter import InMemorySpanExporter
+
+from iocs import Ioc, IocRegistry, Lib
+from linkzipkin import Data_link, LinkTracer
+from pvvalue import VAL_TYPE_NULL
+
+TGID = 4242
+
+
+class LinkTracerTest(unittest.TestCase):
+    def setUp(self):
+        self.exporter = InMemorySpanExporter()
+        self.tracer = LinkTracer("link-service", SimpleSpanProcessor(self.exporter), None)
+        self.iocs = IocRegistry(None, [])
+        lib = Lib("/usr/lib/libdbCore.so")
+        self.iocs.iocs[TGID] = Ioc(TGID, "cm1", lib, lib.path, {})
+        self.tracer.iocs = self.iocs
+
+    def event(self, pvname=b"CM1:LINK"):
+        event = Data_link()
+        event.ktime_ns = 1000
+        event.ktime_ns_end = 3000
+        event.pvname = pvname
+        event.target = b"CM1:TARGET"
+        event.dir = 1
+        event.link_type = 10
+        event.tgid = TGID
+        event.tid = 7
+        event.sid = 8
+        event.ptid = 7
+        event.psid = 6
+        event.val_type = VAL_TYPE_NULL
+        event.sample = 0xFFFFFFFF
+        return event
+
+    def callback(self, event):
+        self.tracer.callback(0, ct.addressof(event), ct.sizeof(event))
+
+    def test_registered_ioc(self):
+        self.callback(self.event())
+        spans = self.exporter.get_finished_spans()
+        self.assertEqual(len(spans), 1)
+        span = spans[0]
+        self.assertEqual(span.name, "CM1:LINK put CM1:TARGET")
+        self.assertEqual(span.resource.attributes["service.name"], "cm1/link-service")
+        self.assertEqual(span.resource.attributes["ioc.name"], "cm1")
+        self.assertEqual(span.attributes["link.type"], "DB_LINK")
+        self.assertEqual(span.parent.span_id, 6)
+
+    def test_held_until_top_level_record(self):
+        # The link is seen before its top-level record, whose name decides
+        self.iocs.iocs[TGID].exclude = re.compile("CM1:LINK")
+        self.callback(self.event())
+        self.assertEqual(self.exporter.get_finished_spans(), ())
+        self.assertTrue(self.iocs.decide(TGID, "CM1:ROOT", 7))
+        self.assertEqual(len(self.exporter.get_finished_spans()), 1)
+
+    def test_excluded_trace(self):
+        self.iocs.iocs[TGID].exclude = re.compile("CM1:ROOT")
+        self.callback(self.event())
+        self.assertFalse(self.iocs.decide(TGID, "CM1:ROOT", 7))
+        self.callback(self.event())
+        self.assertEqual(self.exporter.get_finished_spans(), ())
+
+if __name__ == "__main__":
+    unittest.main()
@@ -0,0 +1,156 @@
+from __future__ import print_function
+import json
+import os
+import sys
+import threading
+import time
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+
+
+CLEAR = "\x1b[H\x1b[2J"
+
+
+class ThreadView(object):
+    """Utilization of the IOC threads that process records, from the
+    in-kernel thread_stats and thread_records.
+
+    Every refresh gives, per thread and over the last interval, the share of
+    time spent in top-level dbProcess, the wait of the records queued to it
+    by scanOnce, and the records with the most self time. The snapshot is
+    drawn on the terminal and served as JSON."""
+
+    def __init__(self, bpf, iocs, top=3, live=True):
+        self.bpf = bpf
+        self.iocs = iocs
+        self.top = top
+        self.live = live
+        self.last = None
+        self.snapshot = {"threads": []}
+
+    def _read(self):
+        threads = {}
+        for key, st in self.bpf["thread_stats"].items():
+            threads[key.value] = (
+                st.tgid,
+                st.comm.decode("utf-8", "replace"),
+                st.busy_ns,
+                st.processes,
+                st.wait_ns,
+                st.waits,
+                st.wait_max_ns,
+            )
+        records = {}
+        for key, rec in self.bpf["thread_records"].items():
+            records[(key.tid, key.precord)] = (
+                rec.name.decode("utf-8", "replace"),
+                rec.self_ns,
+                rec.count,
+            )
+        return time.monotonic_ns(), threads, records
+
+    def _prune(self, threads):
+        """Forget the threads that exited."""
+        stats = self.bpf["thread_stats"]
+        records = self.bpf["thread_records"]
+        for tid, row in threads.items():
+            if os.path.exists(f"/proc/{row[0]}/task/{tid}"):
+                continue
+            try:
+                del stats[stats.Key(tid)]
+            except KeyError:
+                pass
+            for key in [k for k in records.keys() if k.tid == tid]:
+                try:
+                    del records[key]
+                except KeyError:
+                    pass
+
+    def refresh(self):
+        now = self._read()
+        last, self.last = self.last, now
+        if last is None:
+            return
+        elapsed = now[0] - last[0]
+        if elapsed <= 0:
+            return
+
+        per_thread = {}
+        for (tid, precord), (name, self_ns, count) in now[2].items():
+            prev = last[2].get((tid, precord), (name, 0, 0))
+            d_self = self_ns - prev[1]
+            if d_self > 0:
+                per_thread.setdefault(tid, []).append((d_self, count - prev[2], name))
+
+        rows = []
+        for tid, (tgid, comm, busy, processes, wait, waits, wait_max) in now[1].items():
+            prev = last[1].get(tid, (tgid, comm, 0, 0, 0, 0, 0))
+            d_busy = busy - prev[2]
+            d_waits = waits - prev[5]
+            ioc = self.iocs.iocs.get(tgid) if self.iocs else None
+            recs = sorted(per_thread.get(tid, []), reverse=True)[: self.top]
+            rows.append(
+                {
+                    "ioc": ioc.name if ioc else str(tgid),
+                    "pid": tgid,
+                    "tid": tid,
+                    "thread": comm,
+                    "busy": d_busy / elapsed,
+                    "processes_per_s": (processes - prev[3]) / elapsed * 1e9,
+                    "wait_us": (wait - prev[4]) / d_waits / 1e3 if d_waits else None,
+                    "waits_per_s": d_waits / elapsed * 1e9,
+                    "wait_max_us": wait_max / 1e3,
+                    "records": [
+                        {"pv": name, "self": d_self / elapsed, "count": n}
+                        for d_self, n, name in recs
+                    ],
+                }
+            )
+        rows.sort(key=lambda r: r["busy"], reverse=True)
+        self.snapshot = {"time_ns": time.time_ns(), "interval_s": elapsed / 1e9, "threads": rows}
+
+        self._prune(now[1])
+        if self.live:
+            self.draw()
+
+    def draw(self):
+        out = sys.stdout
+        if out.isatty():
+            out.write(CLEAR)
+        out.write(
+            f"{'IOC':<16} {'TID':>7} {'THREAD':<16} {'BUSY':>6} {'PROC/S':>8} "
+            f"{'WAIT_US':>8} {'MAX_US':>9}  TOP SELF TIME\n"
+        )
+        for r in self.snapshot["threads"]:
+            wait = f"{r['wait_us']:>8.0f}" if r["wait_us"] is not None else f"{'-':>8}"
+            top = "  ".join(f"{rec['pv']} {rec['self']:.1%}" for rec in r["records"])
+            out.write(
+                f"{r['ioc'][:16]:<16} {r['tid']:>7} {r['thread']:<16} {r['busy']:>6.1%} "
+                f"{r['processes_per_s']:>8.0f} {wait} {r['wait_max_us']:>9.0f}  {top}\n"
+            )
+        out.flush()
+
+
+class Handler(BaseHTTPRequestHandler):
+    view = None
+
+    def do_GET(self):
+        if self.path.split("?", 1)[0] != "/threads":
+            self.send_error(404)
+            return
+        data = json.dumps(self.view.snapshot).encode("utf-8")
+        self.send_response(200)
+        self.send_header("Content-Type", "application/json")
+        self.send_header("Content-Length", str(len(data)))
+        self.end_headers()
+        self.wfile.write(data)
+
+    def log_message(self, format, *args):
+        pass
+
+
+def serve(view, listen):
+    handler = type("ThreadViewHandler", (Handler,), {"view": view})
+    host, port = listen.rsplit(":", 1)
+    server = ThreadingHTTPServer((host, int(port)), handler)
+    threading.Thread(target=server.serve_forever, daemon=True).start()
+    return server
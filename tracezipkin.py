@@ -3,24 +3,19 @@ import ctypes as ct
 import time
 
 
-from opentelemetry import trace
-from opentelemetry.sdk.trace import TracerProvider
-from opentelemetry.trace import NonRecordingSpan, SpanContext, TraceFlags
-
 from opentelemetry.sdk.resources import SERVICE_NAME, Resource
 
 
-from customidgen import CustomIdGen
+from spanids import scope, start_span
+from pvvalue import decode_value
+from selftime import ChainTiming
 
 
 TASK_COMM_LEN = 16  # linux/sched.h
-MAX_STRING_SIZE = 60
+MAX_STRING_SIZE = 40  # epicsStructure.h
+RECTYPE_NAME_LEN = 32
+SAMPLE_ALL = 0xFFFFFFFF  # proctrace.c
 
-VAL_TYPE_INT = 1
-VAL_TYPE_UINT = 2
-VAL_TYPE_DOUBLE = 3
-VAL_TYPE_STRING = 4
-VAL_TYPE_NULL = 5
 
 BOOT_TIME_NS = int((time.time() - time.monotonic()) * 1e9)
 EPICS_TIME_OFFSET = 631152000
@@ -54,23 +49,34 @@ class Data_process(ct.Structure):
         ("val_u", ct.c_ulonglong),
         ("val_d", ct.c_double),
         ("val_s", ct.c_char * MAX_STRING_SIZE),
+        ("stat", ct.c_ushort),
+        ("sevr", ct.c_ushort),
+        ("suppressed", ct.c_uint),
+        ("rtype", ct.c_char * RECTYPE_NAME_LEN),
+        ("tgid", ct.c_uint),
+        ("sample", ct.c_uint),
+        ("alloc_calls", ct.c_uint),
+        ("alloc_frees", ct.c_uint),
+        ("alloc_pool", ct.c_uint),
+        ("alloc_pad", ct.c_uint),
+        ("alloc_bytes", ct.c_ulonglong),
+        ("alloc_ns", ct.c_ulonglong),
     ]
 
 
 class ProcessTracer(object):
     def __init__(self, servie_name, processor):
-        self.custom_id_generator = CustomIdGen()
-
-        resource = Resource(attributes={SERVICE_NAME: servie_name})
-
-        provider = TracerProvider(
-            resource=resource, id_generator=self.custom_id_generator
-        )
-        provider.add_span_processor(processor)
-
-        self.tracer = trace.get_tracer("my.tracer.name", tracer_provider=provider)
+        self.resource = Resource(attributes={SERVICE_NAME: servie_name})
+        self.scope = scope("my.tracer.name")
+        self.service_name = servie_name
+        self.processor = processor
+        self.iocs = None
 
         self.procs = {}
+        self.aggregator = None
+        self.selftime = None
+        self.metrics = None
+        self.timing = ChainTiming()
 
     def callback(self, cpu, data, size):
         event = ct.cast(data, ct.POINTER(Data_process)).contents
@@ -83,20 +89,61 @@ class ProcessTracer(object):
 
         # print(f"{event.pvname} {event.pid} {event.state} {event.ptid} {event.psid}")
         if event.state == STATE_ENTER_PROC:
+            if self.iocs and event.count == 1:
+                # The top-level record decides the filter of its trace
+                self.iocs.decide(event.tgid, event.pvname.decode("utf-8"), event.tid)
             events = [event]
             proc.append(events)
             return
 
         if event.state == STATE_EXIT_PROC:
-            events = proc[event.count - 1]
+            # Pair with the last open enter of the same depth: siblings and
+            # filtered (--changed-only) frames do not line up with the depth.
+            index = None
+            for i in range(len(proc) - 1, -1, -1):
+                if len(proc[i]) == 1 and proc[i][0].count == event.count:
+                    index = i
+                    break
+            if index is None:
+                # The enter was not seen (e.g. a partial flight recorder window)
+                return
+            events = proc[index]
             events.append(event)
-            if event.count == 1:
-                for p in proc:
-                    self.export_zipkin_index(p)
 
+            duration, self_ns, path = self.timing.exit(events[0], event)
+            attributes = {
+                "proc.self_us": self_ns / 1e3,
+                "proc.child_us": (duration - self_ns) / 1e3,
+                "proc.critical_path": " > ".join(path),
+            }
+            if self.selftime:
+                self.selftime.add(path[0], self_ns)
+            if self.metrics:
+                self.metrics.process(path[0], event.rtype.decode("utf-8", "replace"), duration)
+
+            if self.aggregator:
+                events.append(attributes)
+                if event.count == 1:
+                    self.aggregator.add(proc)
+            else:
+                # Nothing else needs the span: export it right away
+                del proc[index]
+                self.export_zipkin_index(events, attributes)
+
+            if event.count == 1:
                 del self.procs[event.pid]
 
-    def export_zipkin_index(self, events):
+    def reset(self):
+        self.procs = {}
+        self.timing.reset()
+
+    def export_chain(self, chain, attributes=None):
+        for i, events in enumerate(chain):
+            attrs = dict(events[2]) if len(events) > 2 else {}
+            attrs.update(attributes[i] if attributes else {})
+            self.export_zipkin_index(events, attrs)
+
+    def export_zipkin_index(self, events, attributes=None):
         if len(events) < 2:
             return
 
@@ -106,49 +153,57 @@ class ProcessTracer(object):
         if enter.state == STATE_EXIT_PROC:
             return
 
-        val = 0
-        if exit.val_type == VAL_TYPE_INT:
-            val = exit.val_i
-        if exit.val_type == VAL_TYPE_UINT:
-            val = exit.val_u
-        if exit.val_type == VAL_TYPE_DOUBLE:
-            val = exit.val_d
-        if exit.val_type == VAL_TYPE_STRING:
-            val = exit.val_s.decode("utf-8")
-        if exit.val_type == VAL_TYPE_NULL:
-            val = "NULL"
+        if self.iocs:
+            self.iocs.export(exit.tgid, enter.tid, self.export_span, enter, exit, attributes)
+        else:
+            self.export_span(enter, exit, attributes)
+
+    def export_span(self, enter, exit, attributes):
+        val = decode_value(exit)
 
         pvname = enter.pvname.decode("utf-8")
         span_name = f"{pvname} ({val})"
-        ctx = None
-
-        # print(pvname)
-        ptid = enter.ptid | enter.ptid << 64
-        # print(ptid)
-        if ptid != 0:
-            psid = enter.psid
-
-            span_context = SpanContext(
-                trace_id=ptid,
-                span_id=psid,
-                is_remote=True,
-                trace_flags=TraceFlags(0x01),
-            )
-            ctx = trace.set_span_in_context(NonRecordingSpan(span_context))
-
-        sid = enter.sid
-        tid = enter.tid | enter.tid << 64
-        self.custom_id_generator.set_generate_span_id_arguments(tid, sid)
-        with self.tracer.start_as_current_span(
+
+        resource = self.resource
+        if self.iocs:
+            resource = self.iocs.resource(self, exit.tgid)
+
+        span = start_span(
             span_name,
-            start_time=(enter.ktime_ns + BOOT_TIME_NS),
-            end_on_exit=False,
-            context=ctx,
-        ) as span:
-            # export_zipkin_index(proc, index + 1)
-            ts = int((exit.ts_sec + EPICS_TIME_OFFSET) * 1e9 + exit.ts_nano)
-            span.add_event("Process", timestamp=ts)
-            span.set_attribute("pv.name", pvname)
-            span.set_attribute("pv.value", val)
-            span.set_attribute("os.pid", enter.pid)
-            span.end(exit.ktime_ns + BOOT_TIME_NS)
+            self.processor,
+            resource,
+            self.scope,
+            enter.ktime_ns + BOOT_TIME_NS,
+            enter.tid,
+            enter.sid,
+            enter.ptid,
+            enter.psid,
+        )
+        ts = int((exit.ts_sec + EPICS_TIME_OFFSET) * 1e9 + exit.ts_nano)
+        span.add_event("Process", timestamp=ts)
+        span.set_attribute("pv.name", pvname)
+        span.set_attribute("pv.value", val)
+        span.set_attribute("os.pid", enter.pid)
+        span.set_attribute("os.tgid", exit.tgid)
+        if self.iocs:
+            ns_pid = self.iocs.ns_pid(enter.pid)
+            if ns_pid != enter.pid:
+                span.set_attribute("os.ns_pid", ns_pid)
+        span.set_attribute("pv.rtype", exit.rtype.decode("utf-8", "replace"))
+        span.set_attribute("pv.stat", exit.stat)
+        span.set_attribute("pv.sevr", exit.sevr)
+        if exit.suppressed:
+            span.set_attribute("pv.suppressed", exit.suppressed)
+        if exit.alloc_calls or exit.alloc_frees or exit.alloc_pool:
+            # Made by this record, not the nested ones (--alloc-report)
+            span.set_attribute("alloc.calls", exit.alloc_calls)
+            span.set_attribute("alloc.bytes", exit.alloc_bytes)
+            span.set_attribute("alloc.frees", exit.alloc_frees)
+            span.set_attribute("alloc.pool", exit.alloc_pool)
+            span.set_attribute("alloc.us", exit.alloc_ns / 1e3)
+        if enter.sample != SAMPLE_ALL:
+            # Share of the traces kept when this one was started
+            span.set_attribute("sampling.ratio", enter.sample / SAMPLE_ALL)
+        for key, value in (attributes or {}).items():
+            span.set_attribute(key, value)
+        span.end(exit.ktime_ns + BOOT_TIME_NS)